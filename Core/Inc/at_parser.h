@@ -0,0 +1,51 @@
+/**
+  ************************************************************************************************
+  * @file           : at_parser.h
+  * @brief          : Header for at_parser.c file.
+  *                   Streaming tokenizer for the AT responses of the ESP8266. Received spans are
+  *                   split into lines once, every line is checked against the expected ACK, the
+  *                   final responses and the registered unsolicited result codes.
+  ************************************************************************************************
+*/
+
+
+#ifndef __AT_PARSER_H
+#define __AT_PARSER_H
+
+
+#include "main.h"
+
+
+// Defines
+#define AT_LINE_MAX     80      // bytes of a line kept, longer lines keep their end
+#define AT_URC_MAX      6       // max number of registered unsolicited result codes
+
+// Flags of an expected ACK
+#define AT_EXPECT_RAW   0x01    // ACK is not terminated by a newline, e.g. the send prompt,
+                                // final responses before it do not end the wait
+
+
+// Typedefs
+typedef enum __AT_ResultTypeDef {
+	AT_RESULT_NONE = 0,     // command still running
+	AT_RESULT_MATCH,        // expected ACK received
+	AT_RESULT_OK,           // "OK" without the expected ACK
+	AT_RESULT_SEND_OK,      // "SEND OK" without the expected ACK
+	AT_RESULT_ERROR,        // "ERROR"
+	AT_RESULT_FAIL          // "FAIL"
+} AT_ResultTypeDef;
+
+typedef void (*AT_UrcHandler)(const char *line);
+typedef void (*AT_DataHandler)(const uint8_t *data, uint16_t len);
+
+
+// Function exports
+extern void at_Expect(const char *ack, uint8_t flags);
+extern uint16_t at_Feed(const uint8_t *data, uint16_t len);
+extern AT_ResultTypeDef at_GetResult(void);
+extern uint8_t at_GetCapture(void);
+extern uint8_t at_RegisterUrc(const char *prefix, AT_UrcHandler handler);
+extern void at_SetDataHandler(AT_DataHandler handler);
+
+
+#endif
@@ -0,0 +1,45 @@
+/**
+  ************************************************************************************************
+  * @file           : buf_pool.h
+  * @brief          : Header for buf_pool.c file.
+  *                   Fixed-block buffer pool shared by the formatters, the MQTT serializer and
+  *                   the UART DMA. A block has one owner at a time and is handed on instead of
+  *                   being copied, the DMA returns it to the pool when it was transmitted.
+  ************************************************************************************************
+*/
+
+
+#ifndef __BUF_POOL_H
+#define __BUF_POOL_H
+
+
+#include "main.h"
+
+
+// Defines
+#define BUF_POOL_BLOCK_SIZE     128     // longest AT command, debug line or received MQTT packet
+#define BUF_POOL_BLOCKS         8
+#define BUF_POOL_RESERVE        2       // blocks debug output leaves for AT commands and MQTT
+
+
+// Typedefs
+typedef enum __BUF_OwnerTypeDef {
+	BUF_OWNER_FREE = 0,
+	BUF_OWNER_LOG,          // debug output being formatted, dropped if the pool runs low
+	BUF_OWNER_AT,           // AT command being formatted
+	BUF_OWNER_MQTT,         // packet being serialized or deserialized
+	BUF_OWNER_DMA           // queued on a UART, freed when transmitted
+} BUF_OwnerTypeDef;
+
+
+// Functions
+extern uint8_t *buf_Alloc(BUF_OwnerTypeDef owner);
+extern uint8_t *buf_AllocWait(BUF_OwnerTypeDef owner, uint32_t timeout);
+extern void buf_Handover(uint8_t *block, BUF_OwnerTypeDef owner);
+extern void buf_Free(uint8_t *block);
+extern void buf_FreeCallback(void *ctx);
+extern uint8_t buf_MaxUsed(void);
+extern void buf_PrintUsage(void);
+
+
+#endif /* __BUF_POOL_H */
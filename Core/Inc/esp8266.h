@@ -21,12 +21,59 @@
 // Defines
 #define OK_ACK            (uint8_t*)"OK"
 #define TRANS_QUIT_CMD    (uint8_t*)"+++"
+#define SEND_PROMPT       (uint8_t*)">"
 
 #define WITH_NEWLINE     1
 #define WITHOUT_NEWLINE  0
 
 #define ESP8266_MAX_TIMEOUT     (uint16_t)0x0fff
 #define ESP8266_MAX_RETRY_TIME  10
+#define ESP8266_RETRY_DELAY     100    // ms to wait before a step is retried
+#define ESP8266_RESET_PULSE     500    // ms the reset line is held low
+#define ESP8266_CMD_BUFLEN      96     // max length of a command built at runtime
+
+#define ESP8266_WARM_RECONNECT  1      // 1: probe module state on wake instead of full set up
+#define ESP8266_SLEEP_MODE      ESP_SLEEP_MODEM    // mode the module is kept in while the MCU sleeps
+#define ESP8266_DEEP_SLEEP_MS   3600000UL  // deep sleep time, the module is woken earlier by the reset line
+#define ESP8266_TRANS_GUARD     1100   // ms of silence the module needs around "+++"
+#define ESP8266_ACTIVE_CURRENT  70000UL    // typical current in uA while sending and receiving
+#define ESP8266_BAUD_DEFAULT    115200UL   // rate of the module after reset, kept by AT+UART_DEF
+#define ESP8266_BAUD_MAX        2000000UL  // highest rate negotiated, limited by the RTS margin of the receive ring, not by USART1
+#if ESP_FLOW_CONTROL == 1
+#define ESP8266_UART_FLOW       3          // AT+UART_CUR flow control: module drives RTS and obeys CTS
+#else
+#define ESP8266_UART_FLOW       0
+#endif
+
+// Flags of a bring-up step
+#define ESP_STEP_NEWLINE   0x01    // command is terminated with CR LF
+#define ESP_STEP_OPTIONAL  0x02    // failing step does not abort the set up
+#define ESP_STEP_HWRESET   0x04    // step is a hardware reset instead of a command
+#define ESP_STEP_PROBE     0x08    // failing step falls back to the full set up
+#define ESP_STEP_NOACK     0x10    // module does not answer, step is done after timeout
+#define ESP_STEP_CAPTURE   0x20    // keep the character following the ACK
+#define ESP_STEP_RAWACK    0x40    // ACK is not terminated by a newline
+#define ESP_STEP_LINK      0x80    // step needs the AP or TCP connection set up before
+
+// Indexes of the bring-up steps
+#define ESP_STEP_WAKE            0
+#define ESP_STEP_PROBE_TRANS     1
+#define ESP_STEP_PROBE_AT        2
+#define ESP_STEP_WAKE_ECHO       3
+#define ESP_STEP_SLEEP_OFF       4
+#define ESP_STEP_PROBE_STATUS    5
+#define ESP_STEP_PROBE_AP        6
+#define ESP_STEP_FULL_START      7
+#define ESP_STEP_RESET_MODULE    7
+#define ESP_STEP_DISABLE_TRANS   8
+#define ESP_STEP_RAISE_BAUD      9
+#define ESP_STEP_VERIFY_BAUD     10
+#define ESP_STEP_CONNECT_AP      14
+#define ESP_STEP_SINGLE_CONN     18
+#define ESP_STEP_TRANS_MODE      19
+#define ESP_STEP_CONNECT_SERVER  20
+#define ESP_STEP_ENABLE_SEND     21
+#define ESP_STEP_COUNT           22
 
 
 // Typedefs
@@ -42,12 +89,73 @@ typedef enum __WIFI_StateTypDef {
 	_DISCONNECTED = 8,  // server disconnected
 	_TRANS_ENBALE = 9,
 	_TRANS_DISABLE = 10,
+	_BUSY = 11,         // set up still ongoing
 	_UNKNOWN_STATE = 0xee,
 	_UNKNOWN_ERROR = 0xff
 } WIFI_StateTypeDef;
 
+typedef enum __ESP_PathTypeDef {
+	ESP_PATH_FULL = 0,      // reset and full configuration
+	ESP_PATH_WARM_AP,       // configuration kept, AP joined again
+	ESP_PATH_WARM_IP,       // AP kept, TCP connection opened again
+	ESP_PATH_WARM_TCP,      // TCP connection kept, transparent mode entered again
+	ESP_PATH_COUNT
+} ESP_PathTypeDef;
+
+// Values match the argument of AT+SLEEP
+typedef enum __ESP_SleepModeTypeDef {
+	ESP_SLEEP_NONE = 0,     // module stays awake
+	ESP_SLEEP_LIGHT = 1,    // CPU and RF paused between DTIM beacons, AP and TCP kept
+	ESP_SLEEP_MODEM = 2,    // RF paused between DTIM beacons, AP and TCP kept
+	ESP_SLEEP_DEEP = 3,     // only RTC running, woken by reset line, AP joined again on boot
+	ESP_SLEEP_COUNT
+} ESP_SleepModeTypeDef;
+
+typedef struct __ESP_SleepStatsTypeDef {
+	uint16_t sleeps;                // times the module was sent to this mode
+	uint16_t resumes;               // successful set ups after waking from this mode
+	uint32_t resumeSum;             // ms of all resumes, for the average
+	uint32_t resumeMax;             // ms of slowest resume
+} ESP_SleepStatsTypeDef;
+
+typedef struct __ESP_StepTypeDef {
+	const char *name;               // name of step for debug output
+	const char *cmd;                // AT command, NULL if built at runtime
+	void (*build)(char *buf);       // builds AT command with runtime arguments
+	const char *ack;                // expected ACK of module
+	uint16_t timeout;               // ms to wait for ACK
+	uint8_t retries;                // retries before step fails
+	uint8_t flags;                  // ESP_STEP_x flags
+} ESP_StepTypeDef;
+
+typedef struct __ESP_StepTimingTypeDef {
+	uint32_t start;                 // tick the step was started
+	uint32_t duration;              // ms until ACK was received or step failed
+	uint8_t attempts;               // number of transmissions needed
+} ESP_StepTimingTypeDef;
+
+
 // Function exports
+extern void esp8266_Init(void);
+extern void esp8266_StartTCPConnection(void);
+extern WIFI_StateTypeDef esp8266_Poll(void);
+extern void esp8266_PollWait(void);
+extern uint8_t esp8266_GetStep(void);
+extern void esp8266_PrintTiming(void);
+extern ESP_PathTypeDef esp8266_GetPath(void);
+extern WIFI_StateTypeDef esp8266_EnterSleep(ESP_SleepModeTypeDef mode);
+extern void esp8266_PrintSleepStats(void);
+extern uint32_t esp8266_GetBaudRate(void);
+extern uint32_t esp8266_GetThroughput(void);
 extern WIFI_StateTypeDef esp8266_SetUpTCPConnection(void);
 
 
+// Variable exports
+extern ESP_StepTimingTypeDef esp8266_StepTiming[ESP_STEP_COUNT];
+extern uint32_t esp8266_SetupTime;
+extern uint16_t esp8266_PathCount[ESP_PATH_COUNT];    // how often each path was taken
+extern ESP_SleepStatsTypeDef esp8266_SleepStats[ESP_SLEEP_COUNT];
+extern const uint32_t esp8266_IdleCurrent[ESP_SLEEP_COUNT];    // uA per sleep mode
+
+
 #endif
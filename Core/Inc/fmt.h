@@ -0,0 +1,25 @@
+/**
+  ************************************************************************************************
+  * @file           : fmt.h
+  * @brief          : Header for fmt.c file.
+  *                   Small bounded formatter replacing the printf family of the C library, which
+  *                   pulls in the newlib allocator. Supports %s %c %d %i %u %x %X %%, the l
+  *                   modifier and a zero padded width, e.g. %02x.
+  ************************************************************************************************
+*/
+
+
+#ifndef __FMT_H
+#define __FMT_H
+
+
+#include <stdarg.h>
+#include "main.h"
+
+
+// Functions
+extern uint16_t fmt_Format(char *buf, uint16_t size, const char *fmt, va_list ap);
+extern uint16_t fmt_Print(char *buf, uint16_t size, const char *fmt, ...);
+
+
+#endif /* __FMT_H */
@@ -0,0 +1,73 @@
+/**
+  ************************************************************************************************
+  * @file           : log.h
+  * @brief          : Header for log.c file.
+  *                   Deferred binary logging: format strings only live in the non-loaded ELF
+  *                   section .log_str, the target only sends the string ID and raw arguments.
+  *                   Tools/log_decode.py rebuilds the text from the ELF file.
+  ************************************************************************************************
+*/
+
+
+#ifndef __LOG_H
+#define __LOG_H
+
+
+#include "main.h"
+
+
+// Defines
+#define LOG_FRAME_SYNC   0xfe    // first byte of every frame
+#define LOG_MAX_FRAME    96      // max bytes of one frame
+#define LOG_MAX_STR      32      // max bytes of one string argument
+#define LOG_MAX_ARGS     8
+
+#define LOG_STR_SECTION  __attribute__((section(".log_str"), used))
+
+
+// Typedefs
+typedef struct __LOG_ArgTypeDef {
+	uint32_t value;         // integer argument
+	const char *str;        // string argument, NULL for integers
+} LOG_ArgTypeDef;
+
+
+// Function exports
+extern void log_Write(const char *fmt, const LOG_ArgTypeDef *args, uint8_t nargs);
+extern LOG_ArgTypeDef log_ArgInt(uint32_t value);
+extern LOG_ArgTypeDef log_ArgStr(const void *str);
+
+
+// Argument encoding is chosen at compile time by the argument type
+#define LOG_ARG(x) _Generic((x), \
+		char*: log_ArgStr, \
+		const char*: log_ArgStr, \
+		unsigned char*: log_ArgStr, \
+		const unsigned char*: log_ArgStr, \
+		default: log_ArgInt)(x)
+
+#define LOG_CAT_(a, b) a##b
+#define LOG_CAT(a, b) LOG_CAT_(a, b)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, N, ...) N
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+
+#define LOG_MAP_0()
+#define LOG_MAP_1(a) LOG_ARG(a)
+#define LOG_MAP_2(a, ...) LOG_ARG(a), LOG_MAP_1(__VA_ARGS__)
+#define LOG_MAP_3(a, ...) LOG_ARG(a), LOG_MAP_2(__VA_ARGS__)
+#define LOG_MAP_4(a, ...) LOG_ARG(a), LOG_MAP_3(__VA_ARGS__)
+#define LOG_MAP_5(a, ...) LOG_ARG(a), LOG_MAP_4(__VA_ARGS__)
+#define LOG_MAP_6(a, ...) LOG_ARG(a), LOG_MAP_5(__VA_ARGS__)
+#define LOG_MAP_7(a, ...) LOG_ARG(a), LOG_MAP_6(__VA_ARGS__)
+#define LOG_MAP_8(a, ...) LOG_ARG(a), LOG_MAP_7(__VA_ARGS__)
+#define LOG_MAP(...) LOG_CAT(LOG_MAP_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+
+// Logs a message, fmt must be a string literal using printf conversions
+#define LOG(fmt, ...) do { \
+		static const char logFmt[] LOG_STR_SECTION = fmt; \
+		const LOG_ArgTypeDef logArgs[] = { { 0, NULL }, LOG_MAP(__VA_ARGS__) }; \
+		log_Write(logFmt, &logArgs[1], LOG_NARGS(__VA_ARGS__)); \
+	} while (0)
+
+
+#endif
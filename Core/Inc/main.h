@@ -24,6 +24,7 @@
 
 /* Includes ------------------------------------------------------------------*/
 #include "stm32f0xx_hal.h"
+#include "heap_conf.h"
 
 
 // Exported functions prototypes
@@ -43,6 +44,10 @@ extern void toggle_LED(uint8_t toggleCNT, int timeout);
 #define LED_GPIO_Port GPIOA
 #define WIFI_RST_Pin GPIO_PIN_8
 #define WIFI_RST_GPIO_Port GPIOC
+#define WIFI_CTS_Pin GPIO_PIN_11
+#define WIFI_CTS_GPIO_Port GPIOA
+#define WIFI_RTS_Pin GPIO_PIN_12
+#define WIFI_RTS_GPIO_Port GPIOA
 #define TMS_Pin GPIO_PIN_13
 #define TMS_GPIO_Port GPIOA
 #define TCK_Pin GPIO_PIN_14
@@ -53,9 +58,20 @@ extern void toggle_LED(uint8_t toggleCNT, int timeout);
 
 #define WIFI_RST_Enable()    HAL_GPIO_WritePin(WIFI_RST_GPIO_Port,WIFI_RST_Pin,RESET)
 #define WIFI_RST_Disable() 	HAL_GPIO_WritePin(WIFI_RST_GPIO_Port, WIFI_RST_Pin, SET)
+#define WIFI_RTS_Pause()     HAL_GPIO_WritePin(WIFI_RTS_GPIO_Port, WIFI_RTS_Pin, SET)
+#define WIFI_RTS_Resume()    HAL_GPIO_WritePin(WIFI_RTS_GPIO_Port, WIFI_RTS_Pin, RESET)
 
 #define CONNECTION_RETRYS 10
 #define DEBUG_MODE 1
+#ifndef LOG_BINARY
+#define LOG_BINARY 1      // 1: debug output as binary frames, decode with Tools/log_decode.py
+#endif
+#ifndef ESP_FLOW_CONTROL
+#define ESP_FLOW_CONTROL 0    // 1: RTS/CTS to the module, GPIO13 (CTS) and GPIO15 (RTS) wired to PA12 and PA11
+#endif
+#ifndef FAST_WAKE
+#define FAST_WAKE 1           // 1: wake interrupt only starts the PLL, clock switch in the main loop; 0: full HAL re-init in the interrupt
+#endif
 
 #define MQTT_SUBSCRIBE_FOR "NucleoButton"
 
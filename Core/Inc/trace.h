@@ -0,0 +1,77 @@
+/**
+  ************************************************************************************************
+  * @file           : trace.h
+  * @brief          : Header for trace.c file.
+  *                   Wake-to-publish latency trace. TIM3 runs free at 1 MHz and is extended to
+  *                   32 bit by its update interrupt, the M0 has no cycle counter. Durations of
+  *                   every stage are kept as min/max/sum and log2 histogram in RAM and published
+  *                   as one binary message on the next connection.
+  ************************************************************************************************
+*/
+
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+
+#include "main.h"
+#include "esp8266.h"
+
+
+// Defines
+#define TRACE_TIM               TIM3
+#define TRACE_TICK_HZ           1000000UL   // timer ticks per second, 1 us resolution
+#define TRACE_HIST_BUCKETS      16
+#define TRACE_HIST_SHIFT        6           // bucket 0: < 128 us, bucket n: 2^(n+6) us, last: >= 2 s
+#define TRACE_REPORT_VERSION    2
+#define TRACE_TOPIC             MQTT_SUBSCRIBE_FOR "/trace"
+
+
+// Typedefs
+typedef enum __TRACE_StageTypeDef {
+	TRACE_STAGE_CLOCK = 0,          // wake up until system clock is restored
+	TRACE_STAGE_PERIPH,             // peripheral init after wake up
+	TRACE_STAGE_ESP_SETUP,          // peripherals ready until TCP connection is up, all attempts
+	TRACE_STAGE_MQTT_CONNECT,       // CONNECT until CONNACK, or held session checked
+	TRACE_STAGE_PUBLISH,            // publish serialized and queued
+	TRACE_STAGE_LED,                // LED blinks between the stages, kept out of them
+	TRACE_STAGE_TOTAL,              // wake up until publish
+	TRACE_STAGE_AT,                 // first AT step, one stage per step of esp8266_Steps
+	TRACE_STAGE_COUNT = TRACE_STAGE_AT + ESP_STEP_COUNT
+} TRACE_StageTypeDef;
+
+// Layout of the published report, little endian as in RAM
+typedef struct __attribute__((packed)) __TRACE_StageStatsTypeDef {
+	uint32_t min;                   // us
+	uint32_t max;                   // us
+	uint32_t sum;                   // us, saturates
+	uint16_t count;
+	uint8_t hist[TRACE_HIST_BUCKETS];   // samples per log2 bucket, saturate at 255
+} TRACE_StageStatsTypeDef;
+
+typedef struct __attribute__((packed)) __TRACE_ReportTypeDef {
+	uint8_t version;                // TRACE_REPORT_VERSION
+	uint8_t stages;                 // TRACE_STAGE_COUNT
+	uint16_t wakes;                 // wake ups since last report
+	TRACE_StageStatsTypeDef stage[TRACE_STAGE_COUNT];
+} TRACE_ReportTypeDef;
+
+
+// Function exports
+extern void trace_Init(void);
+extern uint32_t trace_Now(void);
+extern void trace_SetClock(uint32_t hz);
+extern void trace_WakeStart(void);
+extern void trace_Mark(TRACE_StageTypeDef stage);
+extern void trace_Record(TRACE_StageTypeDef stage, uint32_t us);
+extern void trace_WakeEnd(void);
+extern void trace_Publish(void);
+extern void trace_Print(void);
+
+
+// Variable exports
+extern TIM_HandleTypeDef htim3;
+extern TRACE_ReportTypeDef trace_Report;
+
+
+#endif
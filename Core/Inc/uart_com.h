@@ -11,29 +11,103 @@
 #define __UART_COM_H
 
 
+#include "main.h"
+#include "buf_pool.h"
+
+
 // Defines
 #define pc_uart         huart2
 #define esp8266_uart     huart1
 
-#define PC_MAX_SENDLEN  1024
-#define PC_MAX_RECVLEN  1024
-#define ESP_MAX_SENDLEN  1024
 #define ESP_MAX_RECVLEN  1024
 
+#define UART_TX_QUEUE_DEPTH    8          // max number of entries waiting per UART
+#define PC_TX_ARENA_SIZE       512        // bytes for copied debug output
+#define ESP_TX_ARENA_SIZE      256        // bytes for copied ESP commands and packets
+#define UART_TX_BLOCK_TIMEOUT  100        // ms a blocking queue waits for space
+#define UART_TX_NO_ARENA       0xffff     // entry references caller's memory
+
+#define ESP_RX_RTS_HIGH  (ESP_MAX_RECVLEN - 256)  // bytes in ring to stop the module, 1 ms at 2 Mbaud plus its FIFO
+#define ESP_RX_RTS_LOW   (ESP_MAX_RECVLEN / 4)    // bytes in ring to let the module send again
+
+
+// Typedefs
+typedef enum __UART_TxPolicyTypeDef {
+	UART_TX_DROP = 0,       // drop data if queue is full
+	UART_TX_BLOCK = 1       // wait until DMA made room
+} UART_TxPolicyTypeDef;
+
+typedef void (*UART_TxCallback)(void *ctx);
+
+typedef struct __UART_TxDescTypeDef {
+	const uint8_t *data;
+	uint16_t len;
+	uint16_t arenaEnd;      // arena offset after data, UART_TX_NO_ARENA if not copied
+	UART_TxCallback cb;     // called from interrupt when transmitted
+	void *ctx;
+} UART_TxDescTypeDef;
+
+typedef struct __UART_TxQueueTypeDef {
+	UART_HandleTypeDef *huart;
+	uint8_t *arena;
+	uint16_t arenaSize;
+	uint16_t arenaHead;
+	volatile uint16_t arenaTail;
+	volatile uint8_t arenaUsed;     // number of queued entries stored in arena
+	UART_TxDescTypeDef desc[UART_TX_QUEUE_DEPTH];
+	uint8_t head;
+	volatile uint8_t tail;
+	volatile uint8_t count;
+	volatile uint8_t busy;          // DMA transfer ongoing
+	UART_TxPolicyTypeDef policy;
+	uint32_t dropped;               // number of entries dropped or rejected
+	volatile uint32_t sent;         // number of bytes transmitted
+	volatile uint32_t busyUs;       // trace time the DMA was transmitting them
+	uint32_t kickUs;                // trace time the running transfer was started
+} UART_TxQueueTypeDef;
+
 
 // Functions
+#if LOG_BINARY == 1
+#include "log.h"
+#define pc_printf(...)  LOG(__VA_ARGS__)
+#else
 extern void pc_printf(char *fmt, ...);
+#endif
 extern void esp_transmit(char *fmt, ...);
 
+extern void uart_TxInit(void);
+extern void uart_TxQueueInit(UART_TxQueueTypeDef *q, UART_HandleTypeDef *huart, uint8_t *arena, uint16_t arenaSize, UART_TxPolicyTypeDef policy);
+extern HAL_StatusTypeDef uart_TxReserve(UART_TxQueueTypeDef *q, uint8_t entries, uint16_t copyLen);
+extern HAL_StatusTypeDef uart_TxEnqueue(UART_TxQueueTypeDef *q, const uint8_t *data, uint16_t len, UART_TxCallback cb, void *ctx);
+extern HAL_StatusTypeDef uart_TxEnqueueRef(UART_TxQueueTypeDef *q, const uint8_t *data, uint16_t len, UART_TxCallback cb, void *ctx);
+extern HAL_StatusTypeDef uart_TxEnqueueBlock(UART_TxQueueTypeDef *q, uint8_t *block, uint16_t len);
+extern uint8_t uart_TxIdle(UART_TxQueueTypeDef *q);
+extern uint8_t uart_TxFlush(UART_TxQueueTypeDef *q, uint32_t timeout);
+extern uint32_t uart_TxThroughput(UART_TxQueueTypeDef *q);
 
-// Variables
-extern uint8_t PC_TxBUF[PC_MAX_SENDLEN];
-extern uint8_t PC_RxBUF[PC_MAX_RECVLEN];
+extern void esp_RxStart(void);
+extern uint16_t esp_RxUpdateHead(void);
+extern uint16_t esp_RxAvailable(void);
+extern uint16_t esp_RxPeekSpan(const uint8_t **span);
+extern void esp_RxConsume(uint16_t len);
+extern uint16_t esp_RxPeek(uint8_t *buf, uint16_t len);
+extern uint16_t esp_RxRead(uint8_t *buf, uint16_t len);
+extern void esp_RxFlush(void);
+extern void esp_RxFlowControl(void);
+extern uint32_t esp_RxFlowDeadline(void);
+extern HAL_StatusTypeDef esp_SetBaudRate(uint32_t baud);
 
-extern uint8_t ESP_TxBUF[ESP_MAX_SENDLEN];
+
+// Variables
 extern uint8_t ESP_RxBUF[ESP_MAX_RECVLEN];
-extern volatile uint8_t ESP_RxLen;
-extern volatile uint8_t ESP_RecvEndFlag;
+extern volatile uint8_t ESP_RecvEndFlag;    // set on IDLE, new data in ring
+extern volatile uint8_t ESP_RxOverflow;     // ring was overrun by the DMA
+extern volatile uint8_t ESP_RxPaused;       // RTS holds the module back
+extern volatile uint32_t ESP_RxPauses;      // number of times RTS was raised
+
+extern UART_TxQueueTypeDef PC_TxQueue;
+extern UART_TxQueueTypeDef ESP_TxQueue;
 
 
 #endif /* __UART_COM_H */
@@ -11,9 +11,27 @@
 #define __UTILS_H
 
 
+#include "main.h"
+
+
+// Defines
+#define RTC_LSI_FREQ          40000    // typical LSI frequency in Hz, varies between 30 and 50 kHz
+#define RTC_ASYNC_PREDIV      127
+#define RTC_SYNC_PREDIV       ((RTC_LSI_FREQ / (RTC_ASYNC_PREDIV + 1)) - 1)
+#define RTC_SECONDS_PER_DAY   86400UL
+
+
 // Exported functions
 extern void goToSleep(void);
+extern uint8_t wakeUp_FromStop(void);
+extern void wakeUp_StartClock(void);
 extern void wakeUp(void);
+extern void rtc_Init(void);
+extern uint32_t rtc_GetTime(void);
+extern uint32_t rtc_GetSeconds(void);
+extern void rtc_SetAlarm(uint32_t seconds);
+extern void rtc_CancelAlarm(void);
+extern void rtc_AlarmCallback(void);
 
 
 #endif
@@ -0,0 +1,49 @@
+/**
+  ************************************************************************************************
+  * @file           : wait.h
+  * @brief          : Header for wait.c file.
+  *                   Tickless waiting for the module and the UART DMA. The MCU sleeps with WFI
+  *                   until an interrupt or the deadline of the one-shot timer TIM14, SysTick is
+  *                   suspended meanwhile and the slept time is added to the tick afterwards.
+  *                   While the receive ring fills, sleeps end in time to raise RTS.
+  ************************************************************************************************
+*/
+
+
+#ifndef __WAIT_H
+#define __WAIT_H
+
+
+#include "main.h"
+
+
+// Defines
+#define WAIT_TIM                TIM14
+#define WAIT_TIM_IRQn           TIM14_IRQn
+#define WAIT_TICK_HZ            10000UL     // timer ticks per second, 100 us resolution
+#define WAIT_MAX_SLEEP          6000        // ms of one sleep, the 16 bit timer overflows at 6553 ms
+
+
+// Typedefs
+typedef uint8_t (*WAIT_CondTypeDef)(void *ctx);
+
+typedef struct __WAIT_StatsTypeDef {
+	uint32_t startUs;               // trace time of wait_ResetStats
+	uint32_t asleepUs;              // us spent in SLEEP mode since then
+	uint32_t sleeps;
+	uint32_t deadlines;             // sleeps ended by the timer instead of another interrupt
+	uint32_t flowChecks;            // sleeps shortened to check the RTS mark of the receive ring
+} WAIT_StatsTypeDef;
+
+
+// Functions
+extern void wait_Init(void);
+extern void wait_Sleep(uint32_t timeout);
+extern uint8_t wait_Until(WAIT_CondTypeDef cond, void *ctx, uint32_t timeout);
+extern uint8_t wait_Flag(volatile uint8_t *flag, uint32_t timeout);
+extern void wait_Delay(uint32_t ms);
+extern void wait_ResetStats(void);
+extern void wait_PrintStats(void);
+
+
+#endif /* __WAIT_H */
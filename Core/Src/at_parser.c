@@ -0,0 +1,245 @@
+/**
+  *********************************************************************************
+  * @file           : at_parser.c
+  * @brief          : This file contains the streaming tokenizer for the AT
+  * 				  responses of the ESP8266 module. Every received byte is
+  * 				  looked at once, only the current line is kept.
+  *********************************************************************************
+*/
+
+
+// Includes
+#include <string.h>
+#include "main.h"
+#include "at_parser.h"
+#include "uart_com.h"
+
+
+// Private typedefs
+typedef struct __AT_UrcTypeDef {
+	const char *prefix;      // start of the unsolicited line
+	uint8_t len;             // length of prefix
+	AT_UrcHandler handler;
+} AT_UrcTypeDef;
+
+
+// Private variables
+static char at_Line[AT_LINE_MAX + 1];
+static uint8_t at_LineLen = 0;
+static uint16_t at_DataLeft = 0;         // payload bytes of "+IPD" still to come
+
+static const char *at_Ack = NULL;
+static uint8_t at_AckLen = 0;
+static uint8_t at_AckFlags = 0;
+static AT_ResultTypeDef at_Result = AT_RESULT_NONE;
+static uint8_t at_Capture = 0;
+
+static AT_UrcTypeDef at_Urc[AT_URC_MAX];
+static uint8_t at_UrcCount = 0;
+static AT_DataHandler at_DataHandler = NULL;
+
+
+
+/**
+  * @brief  Function to start waiting for the ACK of a new command. Drops the unfinished line
+  *         and the result of the last command.
+  * @param ack: Expected ACK, NULL if the command is not answered
+  * @param flags: AT_EXPECT_x flags
+  * @retval None
+  */
+void at_Expect(const char *ack, uint8_t flags)
+{
+	at_Ack = ack;
+	at_AckLen = (ack != NULL) ? strlen(ack) : 0;
+	at_AckFlags = flags;
+	at_Result = AT_RESULT_NONE;
+	at_Capture = 0;
+	at_LineLen = 0;
+	at_DataLeft = 0;
+}
+
+
+/**
+  * @brief  Function to handle a complete line. Unsolicited result codes are dispatched in any
+  *         case and not taken as answer, the expected ACK has to start the line. Otherwise
+  *         e.g. "CONNECT" would match "WIFI DISCONNECT".
+  * @retval None
+  */
+static void at_EndLine(void)
+{
+	uint8_t i, urc = 0;
+
+	if (at_LineLen == 0)
+		return;
+
+	at_Line[at_LineLen] = '\0';
+	at_LineLen = 0;
+
+	pc_printf("ESP8266: %s\r\n", at_Line);
+
+	for (i = 0; i < at_UrcCount; i++)
+	{
+		if (strncmp(at_Line, at_Urc[i].prefix, at_Urc[i].len) == 0)
+		{
+			at_Urc[i].handler(at_Line);
+			urc = 1;
+		}
+	}
+
+	if (urc)
+		return;
+
+	if (at_AckLen > 0 && !(at_AckFlags & AT_EXPECT_RAW) && strncmp(at_Line, at_Ack, at_AckLen) == 0)
+	{
+		// Keep the character following the ACK, e.g. the digit of "STATUS:"
+		at_Capture = (uint8_t) at_Line[at_AckLen];
+		at_Result = AT_RESULT_MATCH;
+	}
+	else if (strcmp(at_Line, "ERROR") == 0)
+		at_Result = AT_RESULT_ERROR;
+	else if (strcmp(at_Line, "FAIL") == 0)
+		at_Result = AT_RESULT_FAIL;
+	else if (at_AckFlags & AT_EXPECT_RAW)
+		return;
+	else if (strcmp(at_Line, "OK") == 0)
+		at_Result = AT_RESULT_OK;
+	else if (strcmp(at_Line, "SEND OK") == 0)
+		at_Result = AT_RESULT_SEND_OK;
+}
+
+
+/**
+  * @brief  Function to handle the header of received network data, "+IPD,<len>:" or
+  *         "+IPD,<id>,<len>:". The payload is passed on as is instead of being tokenized.
+  * @retval None
+  */
+static void at_StartData(void)
+{
+	const char *len;
+
+	at_Line[at_LineLen] = '\0';
+	at_DataLeft = 0;
+
+	for (len = strrchr(at_Line, ',') + 1; *len >= '0' && *len <= '9'; len++)
+		at_DataLeft = at_DataLeft * 10 + (*len - '0');
+
+	at_EndLine();
+}
+
+
+/**
+  * @brief  Function to feed received bytes into the tokenizer. Stops at the byte that ended the
+  *         command, the bytes behind it are left to the caller.
+  * @param data: Received bytes, e.g. a span of the receive ring
+  * @param len: Number of bytes
+  * @retval Number of bytes used
+  */
+uint16_t at_Feed(const uint8_t *data, uint16_t len)
+{
+	uint16_t i = 0, chunk;
+	uint8_t c;
+
+	while (i < len && at_Result == AT_RESULT_NONE)
+	{
+		// Payload of "+IPD" is not made of lines
+		if (at_DataLeft > 0)
+		{
+			chunk = (len - i < at_DataLeft) ? len - i : at_DataLeft;
+
+			if (at_DataHandler != NULL)
+				at_DataHandler(&data[i], chunk);
+
+			at_DataLeft -= chunk;
+			i += chunk;
+			continue;
+		}
+
+		c = data[i++];
+
+		if (c == '\n')
+		{
+			at_EndLine();
+			continue;
+		}
+
+		if (c == '\r' || c == '\0')
+			continue;
+
+		if (c == ':' && at_LineLen >= 5 && strncmp(at_Line, "+IPD,", 5) == 0)
+		{
+			at_StartData();
+			continue;
+		}
+
+		// Line too long, e.g. boot output of the module, only its end is of interest
+		if (at_LineLen == AT_LINE_MAX)
+		{
+			memmove(at_Line, &at_Line[AT_LINE_MAX / 2], AT_LINE_MAX / 2);
+			at_LineLen = AT_LINE_MAX / 2;
+		}
+
+		at_Line[at_LineLen++] = (char) c;
+
+		// Prompts and echoes are not followed by a newline
+		if ((at_AckFlags & AT_EXPECT_RAW) && at_AckLen > 0 && c == (uint8_t) at_Ack[at_AckLen - 1]
+				&& at_LineLen >= at_AckLen && memcmp(&at_Line[at_LineLen - at_AckLen], at_Ack, at_AckLen) == 0)
+		{
+			at_LineLen = 0;
+			at_Result = AT_RESULT_MATCH;
+		}
+	}
+
+	return i;
+}
+
+
+/**
+  * @brief  Function to get the result of the current command.
+  * @retval AT_RESULT_NONE while the command is still running
+  */
+AT_ResultTypeDef at_GetResult(void)
+{
+	return at_Result;
+}
+
+
+/**
+  * @brief  Function to get the character following the matched ACK in its line.
+  * @retval Character, 0 if the ACK ended the line
+  */
+uint8_t at_GetCapture(void)
+{
+	return at_Capture;
+}
+
+
+/**
+  * @brief  Function to register a handler for an unsolicited result code. The handler is called
+  *         from at_Feed for every line starting with prefix.
+  * @param prefix: Start of the line, has to stay valid
+  * @param handler: Handler getting the complete line
+  * @retval 1 if registered, 0 if the table is full
+  */
+uint8_t at_RegisterUrc(const char *prefix, AT_UrcHandler handler)
+{
+	if (at_UrcCount >= AT_URC_MAX)
+		return 0;
+
+	at_Urc[at_UrcCount].prefix = prefix;
+	at_Urc[at_UrcCount].len = strlen(prefix);
+	at_Urc[at_UrcCount].handler = handler;
+	at_UrcCount++;
+
+	return 1;
+}
+
+
+/**
+  * @brief  Function to set the handler for the payload of "+IPD", which is skipped otherwise.
+  * @param handler: Handler getting the payload in spans, NULL to skip it
+  * @retval None
+  */
+void at_SetDataHandler(AT_DataHandler handler)
+{
+	at_DataHandler = handler;
+}
@@ -0,0 +1,187 @@
+/**
+  *********************************************************************************
+  * @file           : buf_pool.c
+  * @brief          : This file contains the fixed-block buffer pool. It replaces
+  * 				  the static buffers of the pc and ESP8266 formatters and the
+  * 				  MQTT packet buffer, the worst case use is tracked so the
+  * 				  pool size can be proven on the target.
+  *********************************************************************************
+*/
+
+
+// Includes
+#include "main.h"
+#include "buf_pool.h"
+#include "uart_com.h"
+#include "wait.h"
+
+
+// Private variables
+static uint8_t buf_Pool[BUF_POOL_BLOCKS][BUF_POOL_BLOCK_SIZE] __attribute__((aligned(4)));
+static volatile uint8_t buf_Owner[BUF_POOL_BLOCKS];
+static volatile uint8_t buf_Used = 0;
+static uint8_t buf_Peak = 0;
+static uint32_t buf_Failed = 0;
+
+
+
+/**
+  * @brief  Function to take a free block out of the pool. Debug output does not get the
+  *         last BUF_POOL_RESERVE blocks, so it can never hold back the module.
+  *         Can be called from interrupt.
+  * @param owner: New owner of the block
+  * @retval Block of BUF_POOL_BLOCK_SIZE bytes, NULL if the pool is exhausted
+  */
+uint8_t *buf_Alloc(BUF_OwnerTypeDef owner)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint8_t *block = NULL;
+	uint8_t i;
+
+	__disable_irq();
+
+	if (owner != BUF_OWNER_LOG || BUF_POOL_BLOCKS - buf_Used > BUF_POOL_RESERVE)
+	{
+		for (i = 0; i < BUF_POOL_BLOCKS; i++)
+		{
+			if (buf_Owner[i] == BUF_OWNER_FREE)
+			{
+				buf_Owner[i] = owner;
+				block = buf_Pool[i];
+
+				if (++buf_Used > buf_Peak)
+					buf_Peak = buf_Used;
+				break;
+			}
+		}
+	}
+
+	if (block == NULL)
+		buf_Failed++;
+
+	__set_PRIMASK(primask);
+
+	return block;
+}
+
+
+/**
+  * @brief  Function to take a block out of the pool, sleeps until a transmission returned
+  *         one if the pool is exhausted.
+  * @param owner: New owner of the block
+  * @param timeout: Max time to wait in ms
+  * @retval Block of BUF_POOL_BLOCK_SIZE bytes, NULL on timeout
+  */
+uint8_t *buf_AllocWait(BUF_OwnerTypeDef owner, uint32_t timeout)
+{
+	uint32_t start = HAL_GetTick();
+	uint32_t elapsed;
+	uint8_t *block;
+
+	while (1)
+	{
+		__disable_irq();
+
+		block = buf_Alloc(owner);
+		elapsed = HAL_GetTick() - start;
+
+		if (block != NULL || elapsed > timeout)
+			break;
+
+		// Sleep until a transmit complete interrupt returns a block
+		wait_Sleep(timeout - elapsed + 1);
+		__enable_irq();
+	}
+
+	__enable_irq();
+
+	return block;
+}
+
+
+/**
+  * @brief  Function to get the index of a block.
+  * @param block: Block returned by buf_Alloc
+  * @retval Index, BUF_POOL_BLOCKS if block is not part of the pool
+  */
+static uint8_t buf_Index(const uint8_t *block)
+{
+	uintptr_t offset = (uintptr_t) block - (uintptr_t) buf_Pool;
+
+	if (block < buf_Pool[0] || offset % BUF_POOL_BLOCK_SIZE != 0 || offset / BUF_POOL_BLOCK_SIZE >= BUF_POOL_BLOCKS)
+		return BUF_POOL_BLOCKS;
+
+	return offset / BUF_POOL_BLOCK_SIZE;
+}
+
+
+/**
+  * @brief  Function to hand a block on to its next owner, e.g. from the formatter to the DMA.
+  * @param block: Block returned by buf_Alloc
+  * @param owner: New owner
+  * @retval None
+  */
+void buf_Handover(uint8_t *block, BUF_OwnerTypeDef owner)
+{
+	uint8_t i = buf_Index(block);
+
+	if (i < BUF_POOL_BLOCKS && buf_Owner[i] != BUF_OWNER_FREE)
+		buf_Owner[i] = owner;
+}
+
+
+/**
+  * @brief  Function to return a block to the pool. Can be called from interrupt.
+  * @param block: Block returned by buf_Alloc, NULL is ignored
+  * @retval None
+  */
+void buf_Free(uint8_t *block)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint8_t i = buf_Index(block);
+
+	if (i >= BUF_POOL_BLOCKS)
+		return;
+
+	__disable_irq();
+
+	if (buf_Owner[i] != BUF_OWNER_FREE)
+	{
+		buf_Owner[i] = BUF_OWNER_FREE;
+		buf_Used--;
+	}
+
+	__set_PRIMASK(primask);
+}
+
+
+/**
+  * @brief  Transmit callback of a queued block, the DMA is done with it.
+  * @param ctx: Block
+  * @retval None
+  */
+void buf_FreeCallback(void *ctx)
+{
+	buf_Free((uint8_t*) ctx);
+}
+
+
+/**
+  * @brief  Function to get the highest number of blocks in use at the same time.
+  * @retval Number of blocks
+  */
+uint8_t buf_MaxUsed(void)
+{
+	return buf_Peak;
+}
+
+
+/**
+  * @brief  Function to print the worst case use of the pool for sizing BUF_POOL_BLOCKS.
+  * @retval None
+  */
+void buf_PrintUsage(void)
+{
+	pc_printf("Buffer pool: %u of %u blocks used at most, %lu allocations failed\r\n",
+			buf_Peak, BUF_POOL_BLOCKS, buf_Failed);
+}
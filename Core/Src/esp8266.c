@@ -6,485 +6,951 @@
 */
 
 
-#include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 #include "main.h"
 #include "esp8266.h"
+#include "fmt.h"
 #include "uart_com.h"
+#include "at_parser.h"
 #include "net_conf.h"
-
-
+#include "trace.h"
+#include "wait.h"
+
+
+// Private typedefs
+typedef enum __ESP_SM_StateTypeDef {
+	ESP_SM_IDLE = 0,
+	ESP_SM_RESET_PULSE,      // reset line pulled low
+	ESP_SM_SEND,             // command of current step has to be sent
+	ESP_SM_WAIT,             // waiting for ACK of current step
+	ESP_SM_BACKOFF,          // waiting before retrying current step
+	ESP_SM_DONE,
+	ESP_SM_FAILED
+} ESP_SM_StateTypeDef;
+
+
+// Private function prototypes
+static void esp8266_BuildConnectAPCmd(char *buf);
+static void esp8266_BuildConnectServerCmd(char *buf);
+static void esp8266_BuildBaudCmd(char *buf);
+static void esp8266_StepFailed(uint32_t now);
+
+
+// Typical idle current of the module in each sleep mode in uA (ESP8266EX datasheet)
+const uint32_t esp8266_IdleCurrent[ESP_SLEEP_COUNT] = { 56000, 900, 15000, 20 };
+
+
+// Baud rates tried one after the other after a reset of the module, ascending. USART1 would also
+// divide 3 Mbaud exactly from the 48 MHz PCLK, but the 256 bytes above ESP_RX_RTS_HIGH only cover
+// the 1 ms between two SysTick flow control checks up to 2.56 Mbaud.
+static const uint32_t esp8266_BaudRates[] = { 460800, 921600, 1500000, 2000000 };
+
+
+// Expected answer of the AP probe, built at runtime from AP_SSID
+static char esp_ApAck[ESP8266_CMD_BUFLEN / 2];
+
+
+// Bring-up sequence of the module. Every step is only left when the expected ACK was received.
+// The probe steps check which state of the module survived since the last wake, the full
+// sequence starts at ESP_STEP_FULL_START and stores the configuration in the module's flash.
+static const ESP_StepTypeDef esp8266_Steps[ESP_STEP_COUNT] = {
+	{ "wake module",            NULL,                   NULL,                          "ready",                3000,                    0,                          ESP_STEP_PROBE | ESP_STEP_HWRESET },
+	{ "leave transparent mode", (char*) TRANS_QUIT_CMD, NULL,                          NULL,                   ESP8266_TRANS_GUARD,     0,                          ESP_STEP_PROBE | ESP_STEP_NOACK },
+	{ "probe module",           "AT",                   NULL,                          (char*) OK_ACK,         300,                     2,                          ESP_STEP_PROBE | ESP_STEP_NEWLINE },
+	{ "close echo after wake",  "ATE0",                 NULL,                          (char*) OK_ACK,         300,                     2,                          ESP_STEP_PROBE | ESP_STEP_NEWLINE },
+	{ "disable sleep",          "AT+SLEEP=0",           NULL,                          (char*) OK_ACK,         300,                     2,                          ESP_STEP_PROBE | ESP_STEP_NEWLINE },
+	{ "probe connection",       "AT+CIPSTATUS",         NULL,                          "STATUS:",              500,                     2,                          ESP_STEP_PROBE | ESP_STEP_NEWLINE | ESP_STEP_CAPTURE },
+	{ "probe AP",               "AT+CWJAP_CUR?",        NULL,                          esp_ApAck,              500,                     2,                          ESP_STEP_PROBE | ESP_STEP_NEWLINE },
+	{ "reset",                  NULL,                   NULL,                          "ready",                3000,                    ESP8266_MAX_RETRY_TIME,     ESP_STEP_HWRESET },
+	{ "close transparent mode", (char*) TRANS_QUIT_CMD, NULL,                          (char*) TRANS_QUIT_CMD, ESP8266_MAX_TIMEOUT,     ESP8266_MAX_RETRY_TIME,     ESP_STEP_RAWACK },
+	{ "raise baud rate",        NULL,                   esp8266_BuildBaudCmd,          (char*) OK_ACK,         1000,                    2,                          ESP_STEP_NEWLINE },
+	{ "verify baud rate",       "AT",                   NULL,                          (char*) OK_ACK,         300,                     2,                          ESP_STEP_NEWLINE },
+	{ "close echo",             "ATE0",                 NULL,                          (char*) OK_ACK,         ESP8266_MAX_TIMEOUT,     ESP8266_MAX_RETRY_TIME,     ESP_STEP_NEWLINE },
+	{ "set Wifi mode",          "AT+CWMODE_DEF=1",      NULL,                          (char*) OK_ACK,         1000,                    ESP8266_MAX_RETRY_TIME,     ESP_STEP_NEWLINE },
+	{ "enable auto connect",    "AT+CWAUTOCONN=1",      NULL,                          (char*) OK_ACK,         1000,                    ESP8266_MAX_RETRY_TIME,     ESP_STEP_NEWLINE },
+	{ "connect to AP",          NULL,                   esp8266_BuildConnectAPCmd,     (char*) OK_ACK,         3 * ESP8266_MAX_TIMEOUT, ESP8266_MAX_RETRY_TIME,     ESP_STEP_NEWLINE },
+	{ "get AP info",            "AT+CWJAP_CUR?",        NULL,                          (char*) OK_ACK,         ESP8266_MAX_TIMEOUT,     ESP8266_MAX_RETRY_TIME / 2, ESP_STEP_NEWLINE | ESP_STEP_OPTIONAL },
+	{ "get IP info",            "AT+CIPSTA_CUR?",       NULL,                          (char*) OK_ACK,         ESP8266_MAX_TIMEOUT,     ESP8266_MAX_RETRY_TIME / 2, ESP_STEP_NEWLINE | ESP_STEP_OPTIONAL },
+	{ "set DHCP mode",          "AT+CWDHCP_DEF=1,1",    NULL,                          (char*) OK_ACK,         1000,                    ESP8266_MAX_RETRY_TIME,     ESP_STEP_NEWLINE },
+	{ "set single connection",  "AT+CIPMUX=0",          NULL,                          (char*) OK_ACK,         1000,                    ESP8266_MAX_RETRY_TIME,     ESP_STEP_NEWLINE },
+	{ "set transparent mode",   "AT+CIPMODE=1",         NULL,                          (char*) OK_ACK,         1000,                    ESP8266_MAX_RETRY_TIME,     ESP_STEP_NEWLINE },
+	{ "connect TCP server",     NULL,                   esp8266_BuildConnectServerCmd, "CONNECT",              3 * ESP8266_MAX_TIMEOUT, ESP8266_MAX_RETRY_TIME,     ESP_STEP_NEWLINE | ESP_STEP_LINK },
+	{ "enable data send",       "AT+CIPSEND",           NULL,                          (char*) SEND_PROMPT,    1000,                    ESP8266_MAX_RETRY_TIME,     ESP_STEP_NEWLINE | ESP_STEP_RAWACK | ESP_STEP_LINK }
+};
+
+
+// Private variables
 static WIFI_StateTypeDef wifi_state = _OFFLINE;
 static WIFI_StateTypeDef trans_state = _UNKNOWN_STATE;
-static uint8_t wifi_config_step = 0;
+
+static ESP_SM_StateTypeDef esp_smState = ESP_SM_IDLE;
+static ESP_PathTypeDef esp_smPath = ESP_PATH_FULL;
+static uint8_t esp_smCapture = 0;
+static uint8_t esp_ModuleConfigured = 0;
+static ESP_SleepModeTypeDef esp_SleepMode = ESP_SLEEP_NONE;
+static ESP_SleepModeTypeDef esp_smWakeMode = ESP_SLEEP_NONE;
+static uint8_t esp_smStep = 0;
+static uint8_t esp_smRetry = 0;
+static uint8_t esp_smLinkLoss = 0;      // fallbacks after the link was lost during this set up
+static uint8_t esp_smBaudReturn = 0;    // step to continue with after the baud rate steps
+static uint32_t esp_Baud = ESP8266_BAUD_DEFAULT;        // rate of USART1 and module
+static uint32_t esp_BaudTry = 0;                        // rate being negotiated
+static uint32_t esp_BaudGood = ESP8266_BAUD_DEFAULT;    // highest rate verified so far
+static uint32_t esp_BaudLimit = ESP8266_BAUD_MAX;       // highest rate not failed so far
+static uint32_t esp_smDeadline = 0;
+static uint32_t esp_smStartTick = 0;
+static uint32_t esp_smStepTrace = 0;     // trace time the current step was started
+static char esp_CmdBuf[ESP8266_CMD_BUFLEN];
+
+ESP_StepTimingTypeDef esp8266_StepTiming[ESP_STEP_COUNT];
+uint32_t esp8266_SetupTime = 0;
+uint16_t esp8266_PathCount[ESP_PATH_COUNT];
+ESP_SleepStatsTypeDef esp8266_SleepStats[ESP_SLEEP_COUNT];
 
 
 /**
-  * @brief  Function to check ACK of ESP8266 module.
-  * @param str: Expected ACK of module
-  * @retval ACK result
+  * @brief  Function to check ACK of ESP8266 module. Feeds only bytes not seen before from the
+  *         receive ring into the tokenizer, the bytes behind the final line are kept.
+  * @retval _MATCHOK if the ACK was received, _FAILED if the command ended without it,
+  *         _MATCHERROR while waiting
   */
-WIFI_StateTypeDef esp8266_CheckRespond(uint8_t *str)
+WIFI_StateTypeDef esp8266_CheckRespond(void)
 {
-	pc_printf("(ESP8266 recv:\r\n%s\r\n", ESP_RxBUF);
+	const uint8_t *span;
+	uint16_t len;
 
-	if (strstr((const char*) ESP_RxBUF, (const char*) str) != NULL)
+	while (at_GetResult() == AT_RESULT_NONE && (len = esp_RxPeekSpan(&span)) > 0)
+		esp_RxConsume(at_Feed(span, len));
+
+	switch (at_GetResult())
 	{
+	case AT_RESULT_NONE:
+		return _MATCHERROR;
+
+	case AT_RESULT_MATCH:
 		pc_printf("Match succeed\r\n");
-		memset(ESP_RxBUF, 0, ESP_MAX_RECVLEN);
 		return _MATCHOK;
+
+	default:
+		// Module rejected or finished the command, no need to wait for the timeout
+		return _FAILED;
 	}
+}
+
 
-	memset(ESP_RxBUF, 0, ESP_MAX_RECVLEN);
-	return _MATCHERROR;
+/**
+  * @brief  Handler of "WIFI DISCONNECT", the station lost the AP.
+  * @param line: Received line
+  * @retval None
+  */
+static void esp8266_OnWifiDisconnect(const char *line)
+{
+	wifi_state = _OFFLINE;
 }
 
 
 /**
-  * @brief  Function to transmit commands to ESP8266 module.
-  * @param cmd: Buffer with command
-  * @param ack: Expected ACK of module
-  * @param waitms: Time to wait for module response
-  * @param newline: Newline expected or not
-  * @retval Transmission result
+  * @brief  Handler of "CLOSED", the TCP connection was closed.
+  * @param line: Received line
+  * @retval None
   */
-WIFI_StateTypeDef esp8266_TransmitCmd(uint8_t *cmd, uint8_t *ack, uint32_t waitms, uint8_t newline)
+static void esp8266_OnClosed(const char *line)
 {
-	int timeout = waitms;
-	uint8_t check = 0;
+	if (wifi_state == _CONNECTED)
+		wifi_state = _DISCONNECTED;
+}
 
-	// Reset receive buffer
-	memset(ESP_RxBUF, 0, ESP_MAX_RECVLEN);
 
-	pc_printf("\r\nTry to send cmd: %s\r\n", cmd);
+/**
+  * @brief  Handler of "+IPD", data received outside of transparent transmission is not used.
+  * @param line: Received line
+  * @retval None
+  */
+static void esp8266_OnReceiveData(const char *line)
+{
+	pc_printf("Dropping data received outside of transparent mode\r\n");
+}
 
-	// Transmit command to module with or without newline
-	if (newline == 0)
-		esp_transmit("%s", cmd);
-	else
-		esp_transmit("%s\r\n", cmd);
 
-	pc_printf("Waiting reply\r\n");
+/**
+  * @brief  Function to build the command for connecting to the access point.
+  * @param buf: Buffer for command, at least ESP8266_CMD_BUFLEN bytes
+  * @retval None
+  */
+static void esp8266_BuildConnectAPCmd(char *buf)
+{
+	fmt_Print(buf, ESP8266_CMD_BUFLEN, "AT+CWJAP_DEF=\"%s\",\"%s\"", AP_SSID, AP_PSWD);
+}
 
-	while (timeout--)
-	{
-		// Check if response was received
-		if (ESP_RecvEndFlag == 1)
-		{
-			check = esp8266_CheckRespond(ack);
-			if (check == _MATCHOK)
-			{
-				pc_printf("Command closed loop completed\r\n");
-			}
 
-			// Reset receive variables and interrupt
-			ESP_RxLen = 0;
-			ESP_RecvEndFlag = 0;
-			HAL_UART_Receive_DMA(&huart1, ESP_RxBUF, ESP_MAX_RECVLEN);
+/**
+  * @brief  Function to build the command for connecting to the TCP server.
+  * @param buf: Buffer for command, at least ESP8266_CMD_BUFLEN bytes
+  * @retval None
+  */
+static void esp8266_BuildConnectServerCmd(char *buf)
+{
+	fmt_Print(buf, ESP8266_CMD_BUFLEN, "AT+CIPSTART=\"TCP\",\"%s\",%s", IpServer, ServerPort);
+}
 
-			break;
-		}
 
-		HAL_Delay(1);
-	}
+/**
+  * @brief  Function to build the command for switching the module to the next baud rate.
+  *         The module answers with the old rate and switches afterwards, flow control is
+  *         switched on with the first raised rate.
+  * @param buf: Buffer for command, at least ESP8266_CMD_BUFLEN bytes
+  * @retval None
+  */
+static void esp8266_BuildBaudCmd(char *buf)
+{
+	fmt_Print(buf, ESP8266_CMD_BUFLEN, "AT+UART_CUR=%lu,8,1,0,%u", (unsigned long) esp_BaudTry,
+			ESP8266_UART_FLOW);
+}
+
 
-	if (check == _MATCHERROR)
+/**
+  * @brief  Function to get the next baud rate to negotiate. A rate verified before is set at
+  *         once, otherwise the rates are raised one after the other.
+  * @retval Baud rate, 0 if the highest usable rate is reached
+  */
+static uint32_t esp8266_NextBaud(void)
+{
+	uint8_t i;
+
+	if (esp_BaudGood > esp_Baud && esp_BaudGood <= esp_BaudLimit)
+		return esp_BaudGood;
+
+	for (i = 0; i < sizeof(esp8266_BaudRates) / sizeof(esp8266_BaudRates[0]); i++)
 	{
-		pc_printf("\r\nCmd match failed\r\n");
-		return check;
+		if (esp8266_BaudRates[i] > esp_Baud && esp8266_BaudRates[i] <= esp_BaudLimit)
+			return esp8266_BaudRates[i];
 	}
-	if (timeout <= 0)
+
+	return 0;
+}
+
+
+/**
+  * @brief  Function to switch USART1 to the baud rate the module uses from now on.
+  * @param baud: Baud rate
+  * @retval None
+  */
+static void esp8266_SetBaud(uint32_t baud)
+{
+	if (baud == esp_Baud)
+		return;
+
+	esp_SetBaudRate(baud);
+	esp_Baud = baud;
+
+	pc_printf("Baud rate %lu\r\n", baud);
+}
+
+
+/**
+  * @brief  Function to reset the receive path before a new command is sent.
+  * @param ack: Expected ACK of the command, NULL if it is not answered
+  * @param flags: ESP_STEP_x flags of the command
+  * @retval None
+  */
+static void esp8266_ResetReceive(const char *ack, uint8_t flags)
+{
+	esp_RxFlush();
+	at_Expect(ack, (flags & ESP_STEP_RAWACK) ? AT_EXPECT_RAW : 0);
+}
+
+
+/**
+  * @brief  Function to send the command of the current step.
+  * @param step: Step to be sent
+  * @retval None
+  */
+static void esp8266_SendStep(const ESP_StepTypeDef *step)
+{
+	const char *cmd = step->cmd;
+
+	if (step->build != NULL)
 	{
-		pc_printf("Finish waiting\r\n");
-		pc_printf("\r\nTimeout\r\n");
-		return _TIMEOUT;
+		step->build(esp_CmdBuf);
+		cmd = esp_CmdBuf;
 	}
 
-	pc_printf("Succeed\r\n");
-	return _SUCCEED;
+	esp8266_ResetReceive(step->ack, step->flags);
+
+	pc_printf("\r\nTry to send cmd: %s\r\n", cmd);
+
+	// Transmit command to module with or without newline
+	if (step->flags & ESP_STEP_NEWLINE)
+		esp_transmit("%s\r\n", cmd);
+	else
+		esp_transmit("%s", cmd);
 }
 
 
 /**
-  * @brief  Function to reset ESP8266 module.
-  * @param waitms: Time to wait for response of module after reset
-  * @retval Reset result
+  * @brief  Function to close the current step and move on to the next one.
+  * @param now: Current tick
+  * @retval None
   */
-WIFI_StateTypeDef esp8266_HardwareReset(uint32_t waitms)
+static void esp8266_NextStep(uint32_t now)
 {
-	int timeout = waitms;
-	WIFI_RST_Enable();
-	HAL_Delay(500);
-	WIFI_RST_Disable();
+	uint8_t next = esp_smStep + 1;
 
-	while (timeout--)
-	{
-		if (ESP_RecvEndFlag == 1)
-		{
-			pc_printf("Hardware Reset OK!\r\n");
-			HAL_Delay(2000);
+	esp8266_StepTiming[esp_smStep].duration = now - esp8266_StepTiming[esp_smStep].start;
+	esp8266_StepTiming[esp_smStep].attempts = esp_smRetry + 1;
+	trace_Record(TRACE_STAGE_AT + esp_smStep, trace_Now() - esp_smStepTrace);
 
-			ESP_RxLen = 0;
-			ESP_RecvEndFlag = 0;
-			HAL_UART_Receive_DMA(&huart1, ESP_RxBUF, ESP_MAX_RECVLEN);
+	if (esp_smStep == ESP_STEP_DISABLE_TRANS || esp_smStep == ESP_STEP_PROBE_TRANS)
+		trans_state = _TRANS_DISABLE;
+	else if (esp_smStep == ESP_STEP_CONNECT_AP)
+		wifi_state = _ONLINE;
+	else if (esp_smStep == ESP_STEP_CONNECT_SERVER)
+		wifi_state = _CONNECTED;
 
-			return _SUCCEED;
+	// Only run the steps the module is missing
+	if (esp_smStep == ESP_STEP_WAKE)
+	{
+		// Module booted again, transparent mode is off
+		trans_state = _TRANS_DISABLE;
+		next = ESP_STEP_PROBE_AT;
+	}
+	else if (esp_smStep == ESP_STEP_PROBE_AT)
+	{
+		if (esp_smWakeMode == ESP_SLEEP_DEEP)
+			next = ESP_STEP_WAKE_ECHO;
+		else if (esp_smWakeMode != ESP_SLEEP_NONE)
+			next = ESP_STEP_SLEEP_OFF;
+		else
+			next = ESP_STEP_PROBE_STATUS;
+	}
+	else if (esp_smStep == ESP_STEP_WAKE_ECHO)
+	{
+		// Module booted with the default rate
+		esp_smBaudReturn = ESP_STEP_PROBE_STATUS;
+		next = ESP_STEP_RAISE_BAUD;
+	}
+	else if (esp_smStep == ESP_STEP_DISABLE_TRANS)
+	{
+		esp_smBaudReturn = ESP_STEP_VERIFY_BAUD + 1;
+	}
+	else if (esp_smStep == ESP_STEP_RAISE_BAUD)
+	{
+		// ACK was sent with the old rate, the module uses the new one from now on
+		esp8266_SetBaud(esp_BaudTry);
+	}
+	else if (esp_smStep == ESP_STEP_VERIFY_BAUD)
+	{
+		if (esp_Baud > esp_BaudGood)
+			esp_BaudGood = esp_Baud;
+		next = ESP_STEP_RAISE_BAUD;
+	}
+	else if (esp_smStep == ESP_STEP_PROBE_STATUS)
+	{
+		if (esp_smCapture == '5')
+		{
+			// Station lost the AP, configuration is still there
+			esp_smPath = ESP_PATH_WARM_AP;
+			next = ESP_STEP_CONNECT_AP;
+		}
+		else if (esp_smCapture < '2' || esp_smCapture > '4')
+		{
+			esp_smPath = ESP_PATH_FULL;
+			next = ESP_STEP_FULL_START;
 		}
-
-		HAL_Delay(1);
 	}
+	else if (esp_smStep == ESP_STEP_PROBE_AP)
+	{
+		if (esp_smCapture == '3')
+		{
+			// TCP connection survived, only transparent transmission has to be entered again,
+			// CIPSTART is skipped after the transparent mode step
+			esp_smPath = ESP_PATH_WARM_TCP;
+			wifi_state = _CONNECTED;
+			next = ESP_STEP_TRANS_MODE;
+		}
+		else
+		{
+			esp_smPath = ESP_PATH_WARM_IP;
+			wifi_state = _ONLINE;
+			next = ESP_STEP_SINGLE_CONN;
+		}
+	}
+	else if (esp_smStep == ESP_STEP_TRANS_MODE && esp_smPath == ESP_PATH_WARM_TCP && wifi_state == _CONNECTED)
+	{
+		// Connection is still open, AT+CIPSTART would only be answered by "ALREADY CONNECTED"
+		next = ESP_STEP_ENABLE_SEND;
+	}
+
+	if (next == ESP_STEP_RAISE_BAUD && (esp_BaudTry = esp8266_NextBaud()) == 0)
+		next = esp_smBaudReturn;
 
-	if (timeout <= 0)
+	esp_smStep = next;
+	esp_smRetry = 0;
+
+	if (esp_smStep >= ESP_STEP_COUNT)
 	{
-		pc_printf("Finish waiting\r\n");
-		pc_printf("\r\nTimeout\r\n");
-		return _TIMEOUT;
+		trans_state = _TRANS_ENBALE;
+		// Nothing of the AT dialog may be taken for the first MQTT packet
+		esp_RxFlush();
+		esp8266_SetupTime = now - esp_smStartTick;
+		esp8266_PathCount[esp_smPath]++;
+		esp8266_SleepStats[esp_smWakeMode].resumes++;
+		esp8266_SleepStats[esp_smWakeMode].resumeSum += esp8266_SetupTime;
+		if (esp8266_SetupTime > esp8266_SleepStats[esp_smWakeMode].resumeMax)
+			esp8266_SleepStats[esp_smWakeMode].resumeMax = esp8266_SetupTime;
+		esp_ModuleConfigured = 1;
+		esp_smState = ESP_SM_DONE;
+		return;
 	}
 
-	return _UNKNOWN_ERROR;
+	esp8266_StepTiming[esp_smStep].start = now;
+	esp_smStepTrace = trace_Now();
+	esp_smState = ESP_SM_SEND;
 }
 
 
 /**
-  * @brief  Function to connect to access point with ESP8266 module.
-  * @retval Connection state
+  * @brief  Function to abort the current attempt of a step and continue the set up at another step.
+  * @param next: Index of step to continue with
+  * @param now: Current tick
+  * @param attempts: Number of transmissions of the current step
+  * @retval None
   */
-WIFI_StateTypeDef esp8266_ConnectAP()
+static void esp8266_JumpStep(uint8_t next, uint32_t now, uint8_t attempts)
 {
-	uint16_t cmd_len = strlen(AP_SSID) + strlen(AP_PSWD) + 30;
-	uint8_t *cmd = (uint8_t*) malloc(cmd_len * sizeof(uint8_t));
+	esp8266_StepTiming[esp_smStep].duration = now - esp8266_StepTiming[esp_smStep].start;
+	esp8266_StepTiming[esp_smStep].attempts = attempts;
+	esp_smStep = next;
+	esp_smRetry = 0;
+	esp8266_StepTiming[esp_smStep].start = now;
+	esp_smStepTrace = trace_Now();
+	esp_smState = ESP_SM_SEND;
+}
 
-	memset(cmd, 0, cmd_len);
 
-	sprintf((char*) cmd, "AT+CWJAP_CUR=\"%s\",\"%s\"", AP_SSID, AP_PSWD);
+/**
+  * @brief  Function to handle the loss of AP or TCP connection reported by the module while a
+  *         step depending on it is running. Goes back to the step setting up what was lost
+  *         instead of waiting for the timeout.
+  * @param now: Current tick
+  * @retval None
+  */
+static void esp8266_LinkLost(uint32_t now)
+{
+	const ESP_StepTypeDef *step = &esp8266_Steps[esp_smStep];
 
-	if (esp8266_TransmitCmd(cmd, (uint8_t*) "WIFI CONNECTED", 3 * ESP8266_MAX_TIMEOUT, WITH_NEWLINE) == _SUCCEED)
-		wifi_state = _ONLINE;
-	else
-		wifi_state = _OFFLINE;
+	esp_smLinkLoss++;
 
-	return wifi_state;
+	// Link keeps dropping, give up like on a failed step
+	if (esp_smLinkLoss > ESP8266_MAX_RETRY_TIME)
+	{
+		esp_smRetry = step->retries;
+		esp8266_StepFailed(now);
+		return;
+	}
+
+	if (wifi_state == _OFFLINE)
+	{
+		pc_printf("AP lost during %s\r\n", step->name);
+		esp_smPath = ESP_PATH_WARM_AP;
+		esp8266_JumpStep(ESP_STEP_CONNECT_AP, now, esp_smRetry + 1);
+	}
+	else
+	{
+		pc_printf("TCP connection lost during %s\r\n", step->name);
+		wifi_state = _ONLINE;
+		esp8266_JumpStep(ESP_STEP_CONNECT_SERVER, now, esp_smRetry + 1);
+	}
 }
 
 
 /**
-  * @brief  Function to connect to server ESP8266 module.
-  * @retval Connection state
+  * @brief  Function to handle a baud rate the module rejected or cannot be reached with.
+  *         Only lower rates are tried from now on.
+  * @param now: Current tick
+  * @retval None
   */
-WIFI_StateTypeDef esp8266_ConnectServer()
+static void esp8266_BaudFailed(uint32_t now)
 {
-	uint16_t cmd_len = strlen(IpServer) + strlen(ServerPort) + 30;
-	uint8_t *cmd = (uint8_t*) malloc(cmd_len * sizeof(uint8_t));
+	pc_printf("Baud rate %lu failed\r\n", esp_BaudTry);
 
-	memset(cmd, 0, cmd_len);
+	esp_BaudLimit = esp_BaudTry - 1;
+	if (esp_BaudGood > esp_BaudLimit)
+		esp_BaudGood = ESP8266_BAUD_DEFAULT;
 
-	sprintf((char*) cmd, "AT+CIPSTART=\"TCP\",\"%s\",%s", IpServer, ServerPort);
-
-	if (esp8266_TransmitCmd(cmd, (uint8_t*) "CONNECT", 3 * ESP8266_MAX_TIMEOUT, WITH_NEWLINE) == _SUCCEED)
-		wifi_state = _CONNECTED;
-	else
-		wifi_state = _DISCONNECTED;
+	// Module refused the rate and still uses the old one
+	if (esp_smStep == ESP_STEP_RAISE_BAUD && at_GetResult() == AT_RESULT_ERROR)
+	{
+		esp8266_JumpStep(esp_smBaudReturn, now, esp_smRetry);
+		return;
+	}
 
-	return wifi_state;
+	// Rate of the module is unknown, only a reset brings back the default rate
+	esp_smPath = ESP_PATH_FULL;
+	esp8266_JumpStep(ESP_STEP_RESET_MODULE, now, esp_smRetry);
 }
 
 
 /**
-  * @brief  Function to set up a TCP connection with ESP8266 module.
-  * @retval Connection state
+  * @brief  Function to handle a failed attempt of the current step.
+  * @param now: Current tick
+  * @retval None
   */
-WIFI_StateTypeDef esp8266_SetUpTCPConnection()
+static void esp8266_StepFailed(uint32_t now)
 {
-	uint8_t retry_count = 0;
+	const ESP_StepTypeDef *step = &esp8266_Steps[esp_smStep];
 
-	// Reset esp8266
-	pc_printf("Trying to reset esp8266\r\n");
-	wifi_config_step++;
+	esp_smRetry++;
 
-	while (esp8266_HardwareReset(500) != _SUCCEED)
+	if (esp_smRetry <= step->retries)
 	{
-		retry_count++;
-		HAL_Delay(100);
+		esp_smDeadline = now + ESP8266_RETRY_DELAY;
+		esp_smState = ESP_SM_BACKOFF;
+		return;
+	}
 
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
-		{
-			pc_printf("Reset failed\r\n");
-			retry_count = 0;
-			trans_state = _UNKNOWN_STATE;
-			wifi_config_step--;
-			return _FAILED;
-		}
+	if (esp_smStep == ESP_STEP_RAISE_BAUD || esp_smStep == ESP_STEP_VERIFY_BAUD)
+	{
+		esp8266_BaudFailed(now);
+		return;
 	}
 
-	HAL_Delay(100);
-	retry_count = 0;		// reset retry count
+	// State of module does not match, fall back to the full sequence
+	if (step->flags & ESP_STEP_PROBE)
+	{
+		pc_printf("Step %s failed, falling back to full set up\r\n", step->name);
+		esp8266_StepTiming[esp_smStep].duration = now - esp8266_StepTiming[esp_smStep].start;
+		esp8266_StepTiming[esp_smStep].attempts = esp_smRetry;
+		esp_smPath = ESP_PATH_FULL;
+		esp_smStep = ESP_STEP_FULL_START;
+		esp_smRetry = 0;
+		esp8266_StepTiming[esp_smStep].start = now;
+		esp_smStepTrace = trace_Now();
+		esp_smState = ESP_SM_SEND;
+		return;
+	}
 
+	// Optional steps only deliver information, connection process goes on
+	if (step->flags & ESP_STEP_OPTIONAL)
+	{
+		pc_printf("Step %s failed, connect process will not be terminated\r\n", step->name);
+		esp8266_NextStep(now);
+		return;
+	}
 
-	// Disable transparent transmission
-	pc_printf("Trying to close transparent transmission\r\n");
-	wifi_config_step++;
+	pc_printf("Step %s failed\r\n", step->name);
 
-	while (esp8266_TransmitCmd(TRANS_QUIT_CMD, TRANS_QUIT_CMD, ESP8266_MAX_TIMEOUT, WITHOUT_NEWLINE) != _SUCCEED)
-	{
-		retry_count++;
-		HAL_Delay(100);
+	if (esp_smStep == ESP_STEP_RESET_MODULE)
+		trans_state = _UNKNOWN_STATE;
+	else if (esp_smStep == ESP_STEP_CONNECT_AP)
+		wifi_state = _OFFLINE;
+	else if (esp_smStep == ESP_STEP_CONNECT_SERVER)
+		wifi_state = _DISCONNECTED;
 
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
-		{
-			pc_printf("Close transparent transmission failed\r\n");
-			retry_count = 0;
-			wifi_config_step--;
-			return _FAILED;
-		}
-	}
+	esp8266_StepTiming[esp_smStep].duration = now - esp8266_StepTiming[esp_smStep].start;
+	esp8266_StepTiming[esp_smStep].attempts = esp_smRetry;
+	esp8266_SetupTime = now - esp_smStartTick;
+	esp_ModuleConfigured = 0;
+	esp_smState = ESP_SM_FAILED;
+}
 
-	trans_state = _TRANS_DISABLE;
-	HAL_Delay(100);
-	retry_count = 0;		// reset retry count
 
+/**
+  * @brief  Function to register the handlers of the unsolicited result codes of the module.
+  * @retval None
+  */
+void esp8266_Init(void)
+{
+	at_RegisterUrc("WIFI DISCONNECT", esp8266_OnWifiDisconnect);
+	at_RegisterUrc("CLOSED", esp8266_OnClosed);
+	at_RegisterUrc("+IPD,", esp8266_OnReceiveData);
+}
 
-	// Close echo
-	pc_printf("Trying to close echo\r\n");
-	wifi_config_step++;
 
-	while (esp8266_TransmitCmd((uint8_t*) "ATE0", OK_ACK, ESP8266_MAX_TIMEOUT, WITH_NEWLINE) != _SUCCEED)
-	{
-		retry_count++;
-		HAL_Delay(100);
+/**
+  * @brief  Function to start setting up a TCP connection with ESP8266 module.
+  *         The set up is done by polling esp8266_Poll() afterwards.
+  * @retval None
+  */
+void esp8266_StartTCPConnection(void)
+{
+	uint32_t now = HAL_GetTick();
 
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
-		{
-			pc_printf("Close echo failed\r\n");
-			retry_count = 0;
-			wifi_config_step--;
-			return _FAILED;
-		}
+	memset(esp8266_StepTiming, 0, sizeof(esp8266_StepTiming));
+	fmt_Print(esp_ApAck, sizeof(esp_ApAck), "+CWJAP_CUR:\"%s\"", AP_SSID);
+
+	esp_smWakeMode = esp_SleepMode;
+	esp_SleepMode = ESP_SLEEP_NONE;
+
+	// Module was configured before and kept powered, probe what is still set up
+	if (ESP8266_WARM_RECONNECT == 1 && esp_ModuleConfigured)
+	{
+		esp_smPath = ESP_PATH_WARM_TCP;
+
+		if (esp_smWakeMode == ESP_SLEEP_DEEP)
+			esp_smStep = ESP_STEP_WAKE;
+		else if (esp_smWakeMode != ESP_SLEEP_NONE)
+			esp_smStep = ESP_STEP_PROBE_AT;     // transparent mode was left before sleeping
+		else
+			esp_smStep = ESP_STEP_PROBE_TRANS;
+	}
+	else
+	{
+		esp_smPath = ESP_PATH_FULL;
+		esp_smStep = ESP_STEP_FULL_START;
 	}
 
-	HAL_Delay(100);
-	retry_count = 0;		// reset retry count
+	esp_smRetry = 0;
+	esp_smLinkLoss = 0;
+	esp_smCapture = 0;
+	esp_smStartTick = now;
+	esp8266_StepTiming[esp_smStep].start = now;
+	esp_smStepTrace = trace_Now();
+	esp8266_SetupTime = 0;
+	esp_smState = ESP_SM_SEND;
+}
 
 
-	// Set wifi mode 0:AP 1:STA 2:AP+STA
-	pc_printf("Trying to set Wifi mode\r\n");
-	wifi_config_step++;
+/**
+  * @brief  Function to advance the set up of the TCP connection. Never blocks.
+  * @retval _BUSY while set up is ongoing, _SUCCEED or _FAILED once finished
+  */
+WIFI_StateTypeDef esp8266_Poll(void)
+{
+	const ESP_StepTypeDef *step;
+	uint32_t now = HAL_GetTick();
+	WIFI_StateTypeDef check;
 
-	while (esp8266_TransmitCmd((uint8_t*) "AT+CWMODE_CUR=1", OK_ACK, 1000, WITH_NEWLINE) != _SUCCEED)
+	switch (esp_smState)
 	{
-		retry_count++;
-		HAL_Delay(100);
+	case ESP_SM_IDLE:
+		return _UNKNOWN_STATE;
 
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
-		{
-			pc_printf("Set Wifi mode failed\r\n");
-			retry_count = 0;
-			wifi_config_step--;
-			return _FAILED;
-		}
-	}
+	case ESP_SM_DONE:
+		return _SUCCEED;
 
-	HAL_Delay(100);
-	retry_count = 0;		// reset retry count
+	case ESP_SM_FAILED:
+		return _FAILED;
 
+	case ESP_SM_BACKOFF:
+		if ((int32_t)(now - esp_smDeadline) < 0)
+			break;
 
-	// Disable auto connect
-	pc_printf("Trying to close auto connect\r\n");
-	wifi_config_step++;
+		esp_smState = ESP_SM_SEND;
+		/* no break */
 
-	while (esp8266_TransmitCmd((uint8_t*) "AT+CWAUTOCONN=0", OK_ACK, 1000, WITH_NEWLINE) != _SUCCEED)
-	{
-		retry_count++;
-		HAL_Delay(100);
+	case ESP_SM_SEND:
+		step = &esp8266_Steps[esp_smStep];
+
+		pc_printf("Trying to %s\r\n", step->name);
 
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
+		if (step->flags & ESP_STEP_HWRESET)
 		{
-			pc_printf("Close auto connect failed\r\n");
-			retry_count = 0;
-			wifi_config_step--;
-			return _FAILED;
+			// Module boots with the default rate
+			esp8266_SetBaud(ESP8266_BAUD_DEFAULT);
+			WIFI_RST_Enable();
+			esp_smDeadline = now + ESP8266_RESET_PULSE;
+			esp_smState = ESP_SM_RESET_PULSE;
+			break;
 		}
-	}
 
-	HAL_Delay(100);
-	retry_count = 0;		// reset retry count
+		esp8266_SendStep(step);
+		esp_smDeadline = now + step->timeout;
+		esp_smState = ESP_SM_WAIT;
+		break;
 
+	case ESP_SM_RESET_PULSE:
+		if ((int32_t)(now - esp_smDeadline) < 0)
+			break;
 
-	// Connect to AP(Wifi)
-	pc_printf("Trying to connect to AP\r\n");
-	wifi_config_step++;
+		esp8266_ResetReceive(esp8266_Steps[esp_smStep].ack, esp8266_Steps[esp_smStep].flags);
+		WIFI_RST_Disable();
+		esp_smDeadline = now + esp8266_Steps[esp_smStep].timeout;
+		esp_smState = ESP_SM_WAIT;
+		break;
 
-	while (esp8266_ConnectAP() != _ONLINE)
-	{
-		retry_count++;
-		HAL_Delay(100);
+	case ESP_SM_WAIT:
+		step = &esp8266_Steps[esp_smStep];
 
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
+		// Module does not answer this command, step is done after its timeout
+		if (step->ack == NULL)
 		{
-			pc_printf("Connect to AP failed\r\n");
-			retry_count = 0;
-			wifi_config_step--;
-			return _FAILED;
+			if ((int32_t)(now - esp_smDeadline) >= 0)
+				esp8266_NextStep(now);
+			break;
 		}
-	}
-
-	HAL_Delay(100);
-	retry_count = 0;		// reset retry count
 
-
-	// Try to get AP info
-	if (wifi_state == _ONLINE)
-	{
-		while (esp8266_TransmitCmd((uint8_t*) "AT+CWJAP_CUR?", OK_ACK, ESP8266_MAX_TIMEOUT, WITH_NEWLINE) != _SUCCEED)
+		// Check if response was received (set by USART1 IDLE interrupt)
+		if (ESP_RecvEndFlag == 1)
 		{
-			retry_count++;
-			HAL_Delay(100);
+			ESP_RecvEndFlag = 0;
+			check = esp8266_CheckRespond();
 
-			if (retry_count > ESP8266_MAX_RETRY_TIME / 2)
+			if (check == _MATCHOK)
 			{
-				pc_printf("Get AP msg failed\r\n");
-				pc_printf("Connect server process will not be terminated");
-				retry_count = 0;
-				wifi_config_step--;
+				// Keep the character following the ACK, e.g. the digit of "STATUS:"
+				if (step->flags & ESP_STEP_CAPTURE)
+				{
+					esp_smCapture = at_GetCapture();
+					pc_printf("Captured %c\r\n", esp_smCapture);
+				}
+
+				pc_printf("Succeed\r\n");
+				esp8266_NextStep(now);
 				break;
 			}
-		}
-	}
-
-	HAL_Delay(100);
-	retry_count = 0;		// reset retry count
 
+			if (check == _FAILED)
+			{
+				pc_printf("\r\nCmd match failed\r\n");
+				esp8266_StepFailed(now);
+				break;
+			}
 
-	// Try to get IP info
-	if (wifi_state == _ONLINE)
-	{
-		while (esp8266_TransmitCmd((uint8_t*) "	AT+CIPSTA_CUR?", OK_ACK, ESP8266_MAX_TIMEOUT, WITH_NEWLINE) != _SUCCEED)
-		{
-			retry_count++;
-			HAL_Delay(100);
-
-			if (retry_count > ESP8266_MAX_RETRY_TIME / 2)
+			// Link reported lost while waiting, the step cannot succeed any more
+			if ((step->flags & ESP_STEP_LINK) && (wifi_state == _OFFLINE || wifi_state == _DISCONNECTED))
 			{
-				pc_printf("Get IP info failed\r\n");
-				pc_printf("(DBG:) Connect server process will not be terminated");
-				retry_count = 0;
-				wifi_config_step--;
+				esp8266_LinkLost(now);
 				break;
 			}
+
+			// Intermediate output of module, keep on waiting for the expected ACK
 		}
+
+		if ((int32_t)(now - esp_smDeadline) >= 0)
+		{
+			pc_printf("\r\nTimeout\r\n");
+			esp8266_StepFailed(now);
+		}
+		break;
 	}
 
-	HAL_Delay(100);
-	retry_count = 0;		// reset retry count
+	if (esp_smState == ESP_SM_DONE)
+		return _SUCCEED;
+	if (esp_smState == ESP_SM_FAILED)
+		return _FAILED;
 
+	return _BUSY;
+}
 
-	// Set DHCP
-	pc_printf("Trying to set DHCP mode\r\n");
-	wifi_config_step++;
 
-	while (esp8266_TransmitCmd((uint8_t*) "AT+CWDHCP_CUR=1,1", OK_ACK, 1000, WITH_NEWLINE) != _SUCCEED)
-	{
-		retry_count++;
-		HAL_Delay(100);
+/**
+  * @brief  Function to sleep until the set up has to be polled again, i.e. the module
+  *         answered or the deadline of the current state passed.
+  * @retval None
+  */
+void esp8266_PollWait(void)
+{
+	int32_t left = (int32_t)(esp_smDeadline - HAL_GetTick());
 
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
-		{
-			pc_printf("Set DHCP model failed\r\n");
-			retry_count = 0;
-			wifi_config_step--;
-			return _FAILED;
-		}
+	switch (esp_smState)
+	{
+	case ESP_SM_BACKOFF:
+	case ESP_SM_RESET_PULSE:
+		wait_Delay(left > 0 ? left : 0);
+		break;
+
+	case ESP_SM_WAIT:
+		// Output of a command without ACK is not looked at before the deadline
+		if (esp8266_Steps[esp_smStep].ack == NULL)
+			wait_Delay(left > 0 ? left : 0);
+		else
+			wait_Flag(&ESP_RecvEndFlag, left > 0 ? left : 0);
+		break;
+
+	default:
+		break;
 	}
+}
+
 
-	HAL_Delay(100);
-	retry_count = 0;
+/**
+  * @brief  Function to get the step the set up is currently in.
+  * @retval Index of step in the bring-up sequence
+  */
+uint8_t esp8266_GetStep(void)
+{
+	return esp_smStep;
+}
 
 
-	// Set single connection
-	pc_printf("Trying to set single connection\r\n");
-	wifi_config_step++;
+/**
+  * @brief  Function to print the timing of the last set up for latency measurement.
+  * @retval None
+  */
+void esp8266_PrintTiming(void)
+{
+	uint8_t i;
 
-	while (esp8266_TransmitCmd((uint8_t*) "AT+CIPMUX=0", OK_ACK, 1000, WITH_NEWLINE) != _SUCCEED)
+	for (i = 0; i < ESP_STEP_COUNT; i++)
 	{
-		retry_count++;
-		HAL_Delay(100);
+		if (esp8266_StepTiming[i].attempts == 0)
+			continue;
 
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
-		{
-			pc_printf("Set single connection model failed\r\n");
-			retry_count = 0;
-			wifi_config_step--;
-			return _FAILED;
-		}
+		pc_printf("%s: %lu ms, %u attempts\r\n", esp8266_Steps[i].name,
+				esp8266_StepTiming[i].duration, esp8266_StepTiming[i].attempts);
 	}
 
-	HAL_Delay(100);
-	retry_count = 0;
+	pc_printf("Set up took %lu ms on path %u\r\n", esp8266_SetupTime, esp_smPath);
+	pc_printf("Link %lu baud, %lu B/s measured, %lu RTS pauses\r\n", esp_Baud, esp8266_GetThroughput(), ESP_RxPauses);
+}
+
+
+/**
+  * @brief  Function to get the baud rate negotiated with the module, USART1 has to be
+  *         initialized with it after wake up.
+  * @retval Baud rate
+  */
+uint32_t esp8266_GetBaudRate(void)
+{
+	return esp_Baud;
+}
+
+
+/**
+  * @brief  Function to get the measured throughput of the link to the module.
+  * @retval Bytes per second transmitted since the last baud rate change
+  */
+uint32_t esp8266_GetThroughput(void)
+{
+	return uart_TxThroughput(&ESP_TxQueue);
+}
+
+
+/**
+  * @brief  Function to get the path the last set up has taken.
+  * @retval Path
+  */
+ESP_PathTypeDef esp8266_GetPath(void)
+{
+	return esp_smPath;
+}
 
 
-	// Set transparent transmission
-	pc_printf("Trying to set transparent transmission mode\r\n");
-	wifi_config_step++;
+/**
+  * @brief  Function to send a single command and wait for its ACK. Blocks until the ACK,
+  *         an error or the timeout.
+  * @param cmd: AT command without newline
+  * @param ack: Expected ACK of module
+  * @param timeout: ms to wait for ACK
+  * @retval _SUCCEED, _FAILED or _TIMEOUT
+  */
+static WIFI_StateTypeDef esp8266_Command(const char *cmd, const char *ack, uint16_t timeout)
+{
+	uint32_t start = HAL_GetTick();
+	uint32_t elapsed;
+	WIFI_StateTypeDef check;
 
-	while (esp8266_TransmitCmd((uint8_t*) "AT+CIPMODE=1", OK_ACK, 1000, WITH_NEWLINE) != _SUCCEED)
+	esp8266_ResetReceive(ack, 0);
+
+	pc_printf("\r\nTry to send cmd: %s\r\n", cmd);
+	esp_transmit("%s\r\n", cmd);
+
+	while ((elapsed = HAL_GetTick() - start) < timeout)
 	{
-		retry_count++;
-		HAL_Delay(100);
+		ESP_RecvEndFlag = 0;
+		check = esp8266_CheckRespond();
 
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
-		{
-			pc_printf("Set transparent transmission mode failed\r\n");
-			retry_count = 0;
-			wifi_config_step--;
+		if (check == _MATCHOK)
+			return _SUCCEED;
+
+		if (check == _FAILED)
 			return _FAILED;
-		}
+
+		wait_Flag(&ESP_RecvEndFlag, timeout - elapsed);
 	}
 
-	HAL_Delay(100);
-	retry_count = 0;
+	return _TIMEOUT;
+}
+
+
+/**
+  * @brief  Function to send the module to sleep while the MCU is in STOP mode. Light and modem
+  *         sleep keep AP and TCP connection, the next set up only re-enters transparent mode.
+  *         Deep sleep is left by the reset line of the next set up, the module joins the AP
+  *         again on its own.
+  * @param mode: Sleep mode of module
+  * @retval _SUCCEED if module sleeps, otherwise result of sleep command
+  */
+WIFI_StateTypeDef esp8266_EnterSleep(ESP_SleepModeTypeDef mode)
+{
+	WIFI_StateTypeDef result;
 
+	esp_SleepMode = ESP_SLEEP_NONE;
 
-	// Connect to TCP server
-	pc_printf("Trying to connect TCP server\r\n");
-	wifi_config_step++;
+	// Nothing to keep alive, next set up starts from reset anyway
+	if (mode == ESP_SLEEP_NONE || !esp_ModuleConfigured)
+		return _SUCCEED;
 
-	while (esp8266_ConnectServer() != _CONNECTED)
+	// Module only accepts AT commands outside of transparent transmission, TCP connection stays open
+	if (trans_state == _TRANS_ENBALE)
 	{
-		retry_count++;
-		HAL_Delay(100);
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
-		{
-			pc_printf("Connect TCP server failed\r\n");
-			retry_count = 0;
-			wifi_config_step--;
-			return _FAILED;
-		}
+		wait_Delay(ESP8266_TRANS_GUARD);
+		esp_transmit("%s", TRANS_QUIT_CMD);
+		wait_Delay(ESP8266_TRANS_GUARD);
+		trans_state = _TRANS_DISABLE;
 	}
 
-	HAL_Delay(100);
-	retry_count = 0;
-
+	if (mode == ESP_SLEEP_DEEP)
+	{
+		fmt_Print(esp_CmdBuf, ESP8266_CMD_BUFLEN, "AT+GSLP=%lu", ESP8266_DEEP_SLEEP_MS);
+		result = esp8266_Command(esp_CmdBuf, (char*) OK_ACK, 1000);
 
-	// Enable data send (transparent transmission)
-	pc_printf("Trying to enable data send\r\n");
-	wifi_config_step++;
+		if (result == _SUCCEED)
+			wifi_state = _OFFLINE;
+	}
+	else
+	{
+		fmt_Print(esp_CmdBuf, ESP8266_CMD_BUFLEN, "AT+SLEEP=%u", mode);
+		result = esp8266_Command(esp_CmdBuf, (char*) OK_ACK, 1000);
+	}
 
-	while (esp8266_TransmitCmd((uint8_t*) "AT+CIPSEND", OK_ACK, 1000, WITH_NEWLINE) != _SUCCEED)
+	if (result != _SUCCEED)
 	{
-		retry_count++;
-		HAL_Delay(100);
-		if (retry_count > ESP8266_MAX_RETRY_TIME)
-		{
-			pc_printf("Set transparent transmission mode failed\r\n");
-			retry_count = 0;
-			wifi_config_step--;
-			return _FAILED;
-		}
+		pc_printf("Sleep mode %u failed\r\n", mode);
+		return result;
 	}
 
-	trans_state = _TRANS_ENBALE;
-	HAL_Delay(100);
-	retry_count = 0;
+	esp_SleepMode = mode;
+	esp8266_SleepStats[mode].sleeps++;
 
 	return _SUCCEED;
 }
+
+
+/**
+  * @brief  Function to print resume latency and idle current of every sleep mode used so far.
+  * @retval None
+  */
+void esp8266_PrintSleepStats(void)
+{
+	uint8_t i;
+
+	for (i = 0; i < ESP_SLEEP_COUNT; i++)
+	{
+		if (esp8266_SleepStats[i].resumes == 0)
+			continue;
+
+		pc_printf("Sleep mode %u: %u resumes, avg %lu ms, max %lu ms, idle %lu uA\r\n", i,
+				esp8266_SleepStats[i].resumes,
+				esp8266_SleepStats[i].resumeSum / esp8266_SleepStats[i].resumes,
+				esp8266_SleepStats[i].resumeMax, esp8266_IdleCurrent[i]);
+	}
+}
+
+
+/**
+  * @brief  Function to set up a TCP connection with ESP8266 module. Blocks until finished.
+  * @retval Connection state
+  */
+WIFI_StateTypeDef esp8266_SetUpTCPConnection()
+{
+	WIFI_StateTypeDef state;
+
+	esp8266_StartTCPConnection();
+
+	while ((state = esp8266_Poll()) == _BUSY)
+		esp8266_PollWait();
+
+	return state;
+}
@@ -0,0 +1,177 @@
+/**
+  *********************************************************************************
+  * @file           : fmt.c
+  * @brief          : This file contains the bounded formatter of debug output and
+  * 				  AT commands. Output is cut at the buffer size and always
+  * 				  terminated, no memory is allocated.
+  *********************************************************************************
+*/
+
+
+// Includes
+#include "main.h"
+#include "fmt.h"
+
+
+// Private typedefs
+typedef struct __FMT_OutTypeDef {
+	char *buf;
+	uint16_t size;          // bytes of buf including the terminator
+	uint16_t len;
+} FMT_OutTypeDef;
+
+
+
+/**
+  * @brief  Function to append a character, characters beyond the buffer are dropped.
+  * @param out: Output buffer
+  * @param c: Character
+  * @retval None
+  */
+static void fmt_Put(FMT_OutTypeDef *out, char c)
+{
+	if (out->len + 1 < out->size)
+		out->buf[out->len++] = c;
+}
+
+
+/**
+  * @brief  Function to append an unsigned number.
+  * @param out: Output buffer
+  * @param value: Number
+  * @param base: 10 or 16
+  * @param upper: 1 for upper case hex digits
+  * @param width: Minimum number of digits, padded with zeros
+  * @retval None
+  */
+static void fmt_PutUnsigned(FMT_OutTypeDef *out, uint32_t value, uint8_t base, uint8_t upper, uint8_t width)
+{
+	const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char tmp[10];
+	uint8_t n = 0;
+
+	do
+	{
+		tmp[n++] = digits[value % base];
+		value /= base;
+	} while (value != 0);
+
+	while (width > n)
+	{
+		fmt_Put(out, '0');
+		width--;
+	}
+
+	while (n > 0)
+		fmt_Put(out, tmp[--n]);
+}
+
+
+/**
+  * @brief  Function to format into a buffer, like vsnprintf for the conversions of fmt.h.
+  *         Unknown conversions are copied as they are.
+  * @param buf: Output buffer
+  * @param size: Size of buf including the terminator
+  * @param fmt: Format string
+  * @param ap: Arguments
+  * @retval Number of characters written without the terminator
+  */
+uint16_t fmt_Format(char *buf, uint16_t size, const char *fmt, va_list ap)
+{
+	FMT_OutTypeDef out = { buf, size, 0 };
+	const char *s;
+	uint8_t width, isLong;
+	int32_t value;
+
+	if (size == 0)
+		return 0;
+
+	for (; *fmt != '\0'; fmt++)
+	{
+		if (*fmt != '%')
+		{
+			fmt_Put(&out, *fmt);
+			continue;
+		}
+
+		width = 0;
+		isLong = 0;
+
+		// Only a zero padded width is supported, a plain width pads with zeros as well
+		while (*++fmt >= '0' && *fmt <= '9')
+			width = width * 10 + (*fmt - '0');
+
+		if (*fmt == 'l')
+		{
+			isLong = 1;
+			fmt++;
+		}
+
+		switch (*fmt)
+		{
+		case 's':
+			for (s = va_arg(ap, const char*); s != NULL && *s != '\0'; s++)
+				fmt_Put(&out, *s);
+			break;
+
+		case 'c':
+			fmt_Put(&out, (char) va_arg(ap, int));
+			break;
+
+		case 'd':
+		case 'i':
+			value = isLong ? va_arg(ap, long) : va_arg(ap, int);
+			if (value < 0)
+			{
+				fmt_Put(&out, '-');
+				fmt_PutUnsigned(&out, -(uint32_t) value, 10, 0, width);
+			}
+			else
+			{
+				fmt_PutUnsigned(&out, value, 10, 0, width);
+			}
+			break;
+
+		case 'u':
+			fmt_PutUnsigned(&out, isLong ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int), 10, 0, width);
+			break;
+
+		case 'x':
+		case 'X':
+			fmt_PutUnsigned(&out, isLong ? va_arg(ap, unsigned long) : va_arg(ap, unsigned int), 16, *fmt == 'X', width);
+			break;
+
+		case '\0':
+			fmt--;
+			break;
+
+		default:
+			fmt_Put(&out, *fmt);
+			break;
+		}
+	}
+
+	buf[out.len] = '\0';
+
+	return out.len;
+}
+
+
+/**
+  * @brief  Function to format into a buffer, like snprintf for the conversions of fmt.h.
+  * @param buf: Output buffer
+  * @param size: Size of buf including the terminator
+  * @param fmt: Format string
+  * @retval Number of characters written without the terminator
+  */
+uint16_t fmt_Print(char *buf, uint16_t size, const char *fmt, ...)
+{
+	uint16_t len;
+	va_list ap;
+
+	va_start(ap, fmt);
+	len = fmt_Format(buf, size, fmt, ap);
+	va_end(ap);
+
+	return len;
+}
@@ -0,0 +1,101 @@
+/**
+  *******************************************************************************
+  * @file           : log.c
+  * @brief          : This file contains the deferred binary logger. A frame is
+  * 				  SYNC, length, 16 bit string ID and the raw arguments:
+  * 				  4 bytes little endian per integer, length + bytes per string.
+  * 				  Frames are queued on the pc UART and drained by DMA.
+  ********************************************************************************
+*/
+
+
+// Includes
+#include <string.h>
+#include "main.h"
+#include "uart_com.h"
+#include "log.h"
+
+
+/**
+  * @brief  Function to wrap an integer argument.
+  * @param value: Argument
+  * @retval Wrapped argument
+  */
+LOG_ArgTypeDef log_ArgInt(uint32_t value)
+{
+	LOG_ArgTypeDef arg = { value, NULL };
+
+	return arg;
+}
+
+
+/**
+  * @brief  Function to wrap a string argument.
+  * @param str: Argument
+  * @retval Wrapped argument
+  */
+LOG_ArgTypeDef log_ArgStr(const void *str)
+{
+	LOG_ArgTypeDef arg = { 0, (const char*) str };
+
+	if (arg.str == NULL)
+		arg.str = "(null)";
+
+	return arg;
+}
+
+
+/**
+  * @brief  Function to encode a log message and queue it for transmission.
+  *         The string ID is the address of the format string in the .log_str section.
+  * @param fmt: Format string placed in .log_str
+  * @param args: Arguments
+  * @param nargs: Number of arguments
+  * @retval None
+  */
+void log_Write(const char *fmt, const LOG_ArgTypeDef *args, uint8_t nargs)
+{
+	uint8_t frame[LOG_MAX_FRAME];
+	uint16_t id = (uint16_t)(uintptr_t) fmt;
+	uint8_t len = 4;
+	uint8_t i, strLen;
+
+	if (DEBUG_MODE != 1)
+		return;
+
+	frame[0] = LOG_FRAME_SYNC;
+	frame[2] = (uint8_t) id;
+	frame[3] = (uint8_t)(id >> 8);
+
+	for (i = 0; i < nargs && i < LOG_MAX_ARGS; i++)
+	{
+		if (args[i].str == NULL)
+		{
+			if (len + 4 > LOG_MAX_FRAME)
+				break;
+
+			frame[len++] = (uint8_t) args[i].value;
+			frame[len++] = (uint8_t)(args[i].value >> 8);
+			frame[len++] = (uint8_t)(args[i].value >> 16);
+			frame[len++] = (uint8_t)(args[i].value >> 24);
+		}
+		else
+		{
+			if (len + 1 > LOG_MAX_FRAME)
+				break;
+
+			strLen = strnlen(args[i].str, LOG_MAX_STR);
+
+			if (len + 1 + strLen > LOG_MAX_FRAME)
+				strLen = LOG_MAX_FRAME - len - 1;
+
+			frame[len++] = strLen;
+			memcpy(&frame[len], args[i].str, strLen);
+			len += strLen;
+		}
+	}
+
+	frame[1] = len - 2;
+
+	uart_TxEnqueue(&PC_TxQueue, frame, len, NULL, NULL);
+}
@@ -19,15 +19,29 @@
 // Includes
 #include "main.h"
 #include "uart_com.h"
+#include "buf_pool.h"
 #include "esp8266.h"
 #include "mqttclient.h"
+#include "mqttsession.h"
+#include "mqttinflight.h"
+#include "mqttbatch.h"
+#include "mqtttemplate.h"
 #include "net_conf.h"
+#include "trace.h"
+#include "utils.h"
+#include "wait.h"
 
 
 // Private variables
 UART_HandleTypeDef huart1;
 UART_HandleTypeDef huart2;
 DMA_HandleTypeDef hdma_usart1_rx;
+DMA_HandleTypeDef hdma_usart1_tx;
+DMA_HandleTypeDef hdma_usart2_tx;
+TIM_HandleTypeDef htim3;
+
+// Topic of button press, serialized at compile time
+MQTT_TOPIC_DEFINE(mqtt_TopicButton, MQTT_SUBSCRIBE_FOR);
 
 
 // Private function prototypes
@@ -36,26 +50,78 @@ static void MX_GPIO_Init(void);
 static void MX_DMA_Init(void);
 static void MX_USART2_UART_Init(void);
 static void MX_USART1_UART_Init(void);
+static void MX_TIM3_Init(void);
 
 void toggle_LED(uint8_t toggleCNT, int timeout);
 
-uint8_t wakedUp;
+volatile uint8_t wakedUp;
+volatile uint8_t rtcWakedUp;
+
+#if FAST_WAKE == 1
+
+// Callback function after wakeup, the clock is switched over in the main loop by wakeUp()
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+	// A press during an active wake must not restart the trace of the wake in progress
+	if (wakeUp_FromStop())
+		trace_WakeStart();
+	wakeUp_StartClock();
+
+	wakedUp = 1;
+}
+
+
+// Callback function after wakeup by the RTC alarm, time to keep the MQTT session alive
+void rtc_AlarmCallback(void)
+{
+	if (wakeUp_FromStop())
+		trace_WakeStart();
+	wakeUp_StartClock();
+
+	rtcWakedUp = 1;
+}
+
+#else
 
 // Callback function after wakeup
 void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
 {
+	if (wakeUp_FromStop())
+		trace_WakeStart();
+
 	// Enable system tick
 	SystemClock_Config();
 	HAL_ResumeTick();
+	trace_SetClock(SystemCoreClock);
+	trace_Mark(TRACE_STAGE_CLOCK);
+
 	MX_GPIO_Init();
 	MX_DMA_Init();
 	MX_USART2_UART_Init();
 	MX_USART1_UART_Init();
+	trace_Mark(TRACE_STAGE_PERIPH);
 
 	wakedUp = 1;
 }
 
 
+// Callback function after wakeup by the RTC alarm, time to keep the MQTT session alive
+void rtc_AlarmCallback(void)
+{
+	if (wakeUp_FromStop())
+		trace_WakeStart();
+
+	SystemClock_Config();
+	HAL_ResumeTick();
+	trace_SetClock(SystemCoreClock);
+	trace_Mark(TRACE_STAGE_CLOCK);
+
+	rtcWakedUp = 1;
+}
+
+#endif
+
+
 /**
   * @brief  The application entry point.
   * @retval int
@@ -63,7 +129,8 @@ void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
 int main(void)
 {
 	// Local variables
-	uint8_t retry_count, conOK;
+	uint8_t retry_count, conOK, buttonWake;
+	WIFI_StateTypeDef espState;
 
 	// Reset of all peripherals, Initializes the Flash interface and the Systick
 	HAL_Init();
@@ -76,26 +143,55 @@ int main(void)
 	MX_DMA_Init();
 	MX_USART2_UART_Init();
 	MX_USART1_UART_Init();
+	MX_TIM3_Init();
+	uart_TxInit();
+	rtc_Init();
+	trace_Init();
+	wait_Init();
+	esp8266_Init();
 
 	pc_printf("Nucleo started\n\r");
 	toggle_LED(2, 200);
 
 	wakedUp = 0;
+	rtcWakedUp = 0;
 
 	while(1)
 	{
-		if(wakedUp)
+		if(wakedUp || rtcWakedUp)
 		{
-			pc_printf("System waked up\r\n");
+			buttonWake = wakedUp;
+			wakedUp = 0;
+			rtcWakedUp = 0;
+#if FAST_WAKE == 1
+			wakeUp();
+#endif
+			wait_ResetStats();
+
+			if (buttonWake)
+				pc_printf("System waked up\r\n");
+			else
+				pc_printf("System waked up for keepalive\r\n");
 
 			// Reset variables
 			retry_count = 0;
 			conOK = 0;
 
-			// Try to set up TCP connection
+			// Try to set up TCP connection, the state machine moves on as soon as the module answers
 			do
 			{
-				if (esp8266_SetUpTCPConnection() == _SUCCEED)
+				esp8266_StartTCPConnection();
+
+				while ((espState = esp8266_Poll()) == _BUSY)
+				{
+					// Other work can be interleaved here, sleeps until the module answers or a deadline
+					esp8266_PollWait();
+				}
+
+				esp8266_PrintTiming();
+				esp8266_PrintSleepStats();
+
+				if (espState == _SUCCEED)
 				{
 					conOK = 1;
 					break;
@@ -105,26 +201,38 @@ int main(void)
 
 			} while(retry_count < CONNECTION_RETRYS);
 
+			trace_Mark(TRACE_STAGE_ESP_SETUP);
+
 
 			// If the connection was successfully go on, otherwise hang on toggling LED
 			if(!conOK)
 			{
 				pc_printf("TCP connection failed!\n\r");
+				mqtt_SessionClose();
 
-				while (1)
+				// Missed keepalive only costs the session, next button press connects again
+				while (buttonWake)
 				{
 					toggle_LED(1, 1000);
 				}
 			}
+			else if (!buttonWake)
+			{
+				pc_printf("Sending keepalive\r\n");
+
+				if (mqtt_SessionKeepAlive() != 1)
+					pc_printf("Session lost\r\n");
+			}
 			else
 			{
 
 				pc_printf("TCP connection successfully\n\r");
 				toggle_LED(3, 200);
+				trace_Mark(TRACE_STAGE_LED);
 
 
-				// Try to connect to MQTT broker
-				if (mqtt_ConnectServer() != 1)
+				// Try to connect to MQTT broker, a held session is used straight away
+				if (mqtt_SessionOpen() != 1)
 				{
 					pc_printf("Connect to MQTT broker failed!\r\n");
 
@@ -134,20 +242,38 @@ int main(void)
 					}
 				}
 
+				trace_Mark(TRACE_STAGE_MQTT_CONNECT);
+
 				pc_printf("Connection to MQTT broker successfully\n\r");
 				toggle_LED(3, 200);
+				trace_Mark(TRACE_STAGE_LED);
 
 
 				pc_printf("Transmitting publish\r\n");
 
 				// Publish that the button was pressed
-				mqtt_TransmitPublish(MQTT_SUBSCRIBE_FOR, "Pressed");
+				mqtt_SessionPublish(&mqtt_TopicButton, (const uint8_t*) "Pressed", MQTT_STR_LEN("Pressed"));
+				trace_Mark(TRACE_STAGE_PUBLISH);
+				trace_WakeEnd();
+
+				// Latency of this and the previous wake ups goes out on the open connection
+				trace_Print();
+				trace_Publish();
 
-				HAL_Delay(1000);
+				// Batched packets of this wake up are not held over the delay
+				mqtt_BatchFlush();
+				wait_Delay(1000);
 			}
 		}
 
-		// Go to sleep an wait for button press
+		// Hold or close the session and send the Wifi module to sleep
+		mqtt_SessionSleep();
+
+		// Go to sleep an wait for button press or keepalive alarm
+		buf_PrintUsage();
+		wait_PrintStats();
+		mqtt_InflightPrintStats();
+		mqtt_BatchPrintStats();
 		pc_printf("Going to sleep mode\n\r");
 		goToSleep();
 	}
@@ -168,9 +294,9 @@ void toggle_LED(uint8_t toggleCNT, int timeout)
 	for(i = 0; i < toggleCNT; i++)
 	{
 		LED_On();
-		HAL_Delay(timeout);
+		wait_Delay(timeout);
 		LED_Off();
-		HAL_Delay(timeout);
+		wait_Delay(timeout);
 	}
 }
 
@@ -229,12 +355,16 @@ void SystemClock_Config(void)
 static void MX_USART1_UART_Init(void)
 {
 	huart1.Instance = USART1;
-	huart1.Init.BaudRate = 115200;
+	huart1.Init.BaudRate = esp8266_GetBaudRate();    // negotiated rate, kept by the module while MCU sleeps
 	huart1.Init.WordLength = UART_WORDLENGTH_8B;
 	huart1.Init.StopBits = UART_STOPBITS_1;
 	huart1.Init.Parity = UART_PARITY_NONE;
 	huart1.Init.Mode = UART_MODE_TX_RX;
+#if ESP_FLOW_CONTROL == 1
+	huart1.Init.HwFlowCtl = UART_HWCONTROL_CTS;     // RTS follows the receive ring, see esp_RxFlowControl
+#else
 	huart1.Init.HwFlowCtl = UART_HWCONTROL_NONE;
+#endif
 	huart1.Init.OverSampling = UART_OVERSAMPLING_16;
 	huart1.Init.OneBitSampling = UART_ONE_BIT_SAMPLE_DISABLE;
 	huart1.AdvancedInit.AdvFeatureInit = UART_ADVFEATURE_NO_INIT;
@@ -244,7 +374,7 @@ static void MX_USART1_UART_Init(void)
 	}
 
 	__HAL_UART_ENABLE_IT(&huart1, UART_IT_IDLE);
-	HAL_UART_Receive_DMA(&huart1, ESP_RxBUF, ESP_MAX_RECVLEN);
+	esp_RxStart();
 }
 
 
@@ -272,6 +402,26 @@ static void MX_USART2_UART_Init(void)
 }
 
 
+/**
+  * @brief TIM3 Initialization Function (trace time base)
+  * @param None
+  * @retval None
+  */
+static void MX_TIM3_Init(void)
+{
+	htim3.Instance = TIM3;
+	htim3.Init.Prescaler = (SystemCoreClock / TRACE_TICK_HZ) - 1;
+	htim3.Init.CounterMode = TIM_COUNTERMODE_UP;
+	htim3.Init.Period = 0xffff;
+	htim3.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	htim3.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+	if (HAL_TIM_Base_Init(&htim3) != HAL_OK)
+	{
+		Error_Handler();
+	}
+}
+
+
 /**
   * Enable DMA controller clock
   */
@@ -284,6 +434,9 @@ static void MX_DMA_Init(void)
 	/* DMA1_Channel2_3_IRQn interrupt configuration */
 	HAL_NVIC_SetPriority(DMA1_Channel2_3_IRQn, 0, 0);
 	HAL_NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+	/* DMA1_Channel4_5_IRQn interrupt configuration */
+	HAL_NVIC_SetPriority(DMA1_Channel4_5_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(DMA1_Channel4_5_IRQn);
 }
 
 
@@ -19,11 +19,17 @@
 #include "main.h"
 #include "stm32f0xx_it.h"
 #include "uart_com.h"
+#include "trace.h"
+#include "wait.h"
+#include "utils.h"
 
 
 // External variables
 extern DMA_HandleTypeDef hdma_usart1_rx;
+extern DMA_HandleTypeDef hdma_usart1_tx;
+extern DMA_HandleTypeDef hdma_usart2_tx;
 extern UART_HandleTypeDef huart1;
+extern UART_HandleTypeDef huart2;
 
 
 /******************************************************************************/
@@ -73,6 +79,11 @@ void PendSV_Handler(void)
 void SysTick_Handler(void)
 {
 	HAL_IncTick();
+
+#if ESP_FLOW_CONTROL == 1
+	// A burst raises no interrupt until the half of the ring, RTS has to come earlier
+	esp_RxFlowControl();
+#endif
 }
 
 
@@ -83,6 +94,20 @@ void SysTick_Handler(void)
 /* please refer to the startup file (startup_stm32f0xx.s).                    */
 /******************************************************************************/
 
+/**
+  * @brief This function handles RTC interrupts through EXTI line 17 (keepalive alarm)
+  */
+void RTC_IRQHandler(void)
+{
+	if (RTC->ISR & RTC_ISR_ALRAF)
+	{
+		RTC->ISR = ~(RTC_ISR_ALRAF | RTC_ISR_INIT) | (RTC->ISR & RTC_ISR_INIT);
+		rtc_AlarmCallback();
+	}
+
+	EXTI->PR = EXTI_PR_PR17;
+}
+
 /**
   * @brief This function handles EXTI line 4 to 15 interrupts (Push button)
   */
@@ -91,37 +116,60 @@ void EXTI4_15_IRQHandler(void)
 	HAL_GPIO_EXTI_IRQHandler(Button_Pin);
 }
 
+/**
+  * @brief This function handles TIM3 global interrupt (trace time base overflow)
+  */
+void TIM3_IRQHandler(void)
+{
+	HAL_TIM_IRQHandler(&htim3);
+}
+
+/**
+  * @brief This function handles TIM14 global interrupt (deadline of wait_Sleep)
+  */
+void TIM14_IRQHandler(void)
+{
+	// Waking up is all the deadline has to do
+	WAIT_TIM->SR = (uint32_t) ~TIM_SR_UIF;
+}
+
 /**
   * @brief This function handles DMA1 channel 2 and 3 interrupts.
   */
 void DMA1_Channel2_3_IRQHandler(void)
 {
+	HAL_DMA_IRQHandler(&hdma_usart1_tx);
 	HAL_DMA_IRQHandler(&hdma_usart1_rx);
 }
 
+/**
+  * @brief This function handles DMA1 channel 4 and 5 interrupts.
+  */
+void DMA1_Channel4_5_IRQHandler(void)
+{
+	HAL_DMA_IRQHandler(&hdma_usart2_tx);
+}
+
 /**
   * @brief This function handles USART1 global interrupt (ESP8266)
   */
 void USART1_IRQHandler(void)
 {
-	uint32_t tmp_flag = 0;
-	uint32_t temp;
-
-	tmp_flag = __HAL_UART_GET_FLAG(&huart1, UART_FLAG_IDLE);
-
-	if ((tmp_flag != RESET))
+	// Line idle after a frame, publish new bytes of the circular DMA ring
+	if (__HAL_UART_GET_FLAG(&huart1, UART_FLAG_IDLE) != RESET)
 	{
 		__HAL_UART_CLEAR_IDLEFLAG(&huart1);
-		temp = huart1.Instance->ISR;
-		temp = huart1.Instance->RDR;
-		HAL_UART_DMAStop(&huart1);
-		temp = hdma_usart1_rx.Instance->CNDTR;
-		ESP_RxLen = ESP_MAX_RECVLEN - temp;
+		esp_RxUpdateHead();
 		ESP_RecvEndFlag = 1;
 	}
 
-	// Enable interrupt again
-	HAL_UART_Receive_DMA(&huart1, ESP_RxBUF, ESP_MAX_RECVLEN);
-
 	HAL_UART_IRQHandler(&huart1);
 }
+
+/**
+  * @brief This function handles USART2 global interrupt (PC)
+  */
+void USART2_IRQHandler(void)
+{
+	HAL_UART_IRQHandler(&huart2);
+}
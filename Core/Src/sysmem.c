@@ -23,6 +23,9 @@
 /* Includes */
 #include <errno.h>
 #include <stdint.h>
+#include "main.h"
+
+#if NO_HEAP == 0
 
 /**
  * Pointer to the current high watermark of the heap usage
@@ -77,3 +80,4 @@ void *_sbrk(ptrdiff_t incr)
 
   return (void *)prev_heap_end;
 }
+#endif /* NO_HEAP */
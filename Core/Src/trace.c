@@ -0,0 +1,240 @@
+/**
+  *******************************************************************************
+  * @file           : trace.c
+  * @brief          : This file contains the wake-to-publish latency trace.
+  * 				  TIM3 counts microseconds, its update interrupt extends the
+  * 				  count to 32 bit. The timer stops in STOP mode, so only time
+  * 				  awake is measured.
+  ********************************************************************************
+*/
+
+
+// Includes
+#include <string.h>
+#include "main.h"
+#include "trace.h"
+#include "uart_com.h"
+#include <mqtttemplate.h>
+
+
+// Private variables
+static volatile uint32_t trace_Base;    // us at counter value 0
+static uint32_t trace_WakeTime;         // us of last wake up
+static uint32_t trace_MarkTime;         // us of last finished stage
+
+TRACE_ReportTypeDef trace_Report;
+
+MQTT_TOPIC_DEFINE(trace_Topic, TRACE_TOPIC);
+
+// Names for debug output, order of TRACE_StageTypeDef
+static const char * const trace_StageNames[TRACE_STAGE_AT] = {
+	"clock", "peripherals", "ESP set up", "MQTT connect", "publish", "LED", "total"
+};
+
+
+
+/**
+  * @brief  Function to clear the statistics after they were reported.
+  * @retval None
+  */
+static void trace_Clear(void)
+{
+	uint8_t i;
+
+	memset(&trace_Report, 0, sizeof(trace_Report));
+	trace_Report.version = TRACE_REPORT_VERSION;
+	trace_Report.stages = TRACE_STAGE_COUNT;
+
+	for (i = 0; i < TRACE_STAGE_COUNT; i++)
+		trace_Report.stage[i].min = UINT32_MAX;
+}
+
+
+/**
+  * @brief  Function to start the trace timer. TIM3 has to be initialized by the HAL before.
+  *         Update events are only generated by overflows, so the prescaler can be changed
+  *         without an interrupt.
+  * @retval None
+  */
+void trace_Init(void)
+{
+	trace_Clear();
+
+	__HAL_TIM_URS_ENABLE(&htim3);
+	TRACE_TIM->SR = (uint32_t) ~TIM_SR_UIF;
+	trace_Base = 0;
+	HAL_TIM_Base_Start_IT(&htim3);
+}
+
+
+/**
+  * @brief  Function to get the current time of the trace.
+  * @retval us since trace_Init, only counting while not in STOP mode
+  */
+uint32_t trace_Now(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint32_t base, cnt;
+
+	__disable_irq();
+
+	base = trace_Base;
+	cnt = TRACE_TIM->CNT;
+
+	// Overflow happened, interrupt not served yet
+	if (TRACE_TIM->SR & TIM_SR_UIF)
+	{
+		cnt = TRACE_TIM->CNT;
+		base += 0x10000;
+	}
+
+	__set_PRIMASK(primask);
+
+	return base + cnt;
+}
+
+
+/**
+  * @brief  Function to adapt the timer to a new system clock, called before the clock is
+  *         switched to HSI for STOP mode and after the PLL is running again.
+  * @param hz: Timer input clock from now on
+  * @retval None
+  */
+void trace_SetClock(uint32_t hz)
+{
+	uint32_t primask = __get_PRIMASK();
+	uint32_t now;
+
+	__disable_irq();
+
+	now = trace_Now();
+	TRACE_TIM->PSC = (hz / TRACE_TICK_HZ) - 1;
+	TRACE_TIM->EGR = TIM_EGR_UG;    // loads prescaler and clears counter
+	TRACE_TIM->SR = (uint32_t) ~TIM_SR_UIF;    // overflow is already part of now
+	trace_Base = now;
+
+	__set_PRIMASK(primask);
+}
+
+
+/**
+  * @brief  Function to start the trace of a wake up, first thing in the wake up callback.
+  * @retval None
+  */
+void trace_WakeStart(void)
+{
+	trace_WakeTime = trace_Now();
+	trace_MarkTime = trace_WakeTime;
+	trace_Report.wakes++;
+}
+
+
+/**
+  * @brief  Function to record the time since the last mark as duration of a stage.
+  * @param stage: Stage which just finished
+  * @retval None
+  */
+void trace_Mark(TRACE_StageTypeDef stage)
+{
+	uint32_t now = trace_Now();
+
+	trace_Record(stage, now - trace_MarkTime);
+	trace_MarkTime = now;
+}
+
+
+/**
+  * @brief  Function to add a duration to the statistics of a stage.
+  * @param stage: Stage
+  * @param us: Duration
+  * @retval None
+  */
+void trace_Record(TRACE_StageTypeDef stage, uint32_t us)
+{
+	TRACE_StageStatsTypeDef *s;
+	int8_t bucket;
+
+	if (stage >= TRACE_STAGE_COUNT)
+		return;
+
+	s = &trace_Report.stage[stage];
+
+	if (us < s->min)
+		s->min = us;
+	if (us > s->max)
+		s->max = us;
+
+	s->sum = (s->sum + us < s->sum) ? UINT32_MAX : s->sum + us;
+
+	if (s->count < UINT16_MAX)
+		s->count++;
+
+	bucket = (int8_t) (31 - __builtin_clz(us | 1)) - TRACE_HIST_SHIFT;
+	if (bucket < 0)
+		bucket = 0;
+	else if (bucket >= TRACE_HIST_BUCKETS)
+		bucket = TRACE_HIST_BUCKETS - 1;
+
+	if (s->hist[bucket] < UINT8_MAX)
+		s->hist[bucket]++;
+}
+
+
+/**
+  * @brief  Function to finish the trace of a wake up once the publish is queued.
+  * @retval None
+  */
+void trace_WakeEnd(void)
+{
+	trace_Record(TRACE_STAGE_TOTAL, trace_Now() - trace_WakeTime);
+}
+
+
+/**
+  * @brief  Function to publish the statistics and start new ones. Sent straight from RAM, the
+  *         publish waits until it is transmitted.
+  * @retval None
+  */
+void trace_Publish(void)
+{
+	mqtt_TransmitPublishTemplate(&trace_Topic, (const uint8_t*) &trace_Report, sizeof(trace_Report));
+	trace_Clear();
+}
+
+
+/**
+  * @brief  Function to print the statistics of all stages with samples.
+  * @retval None
+  */
+void trace_Print(void)
+{
+	const TRACE_StageStatsTypeDef *s;
+	uint8_t i;
+
+	for (i = 0; i < TRACE_STAGE_COUNT; i++)
+	{
+		s = &trace_Report.stage[i];
+
+		if (s->count == 0)
+			continue;
+
+		if (i < TRACE_STAGE_AT)
+			pc_printf("trace %s: ", trace_StageNames[i]);
+		else
+			pc_printf("trace AT step %u: ", i - TRACE_STAGE_AT);
+
+		pc_printf("n %u min %lu avg %lu max %lu us\r\n", s->count, s->min, s->sum / s->count, s->max);
+	}
+}
+
+
+/**
+  * @brief  Timer update callback, extends the trace timer.
+  * @param htim: Timer handle
+  * @retval None
+  */
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
+{
+	if (htim->Instance == TRACE_TIM)
+		trace_Base += 0x10000;
+}
@@ -9,71 +9,791 @@
 
 
 // Includes
-#include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
 #include "main.h"
 #include "uart_com.h"
+#include "fmt.h"
+#include "trace.h"
+#include "wait.h"
 
 
 // Global variables
-uint8_t PC_TxBUF[PC_MAX_SENDLEN];
-uint8_t PC_RxBUF[PC_MAX_RECVLEN];
-
-uint8_t ESP_TxBUF[ESP_MAX_SENDLEN];
 uint8_t ESP_RxBUF[ESP_MAX_RECVLEN];
-volatile uint8_t ESP_RxLen = 0;
 volatile uint8_t ESP_RecvEndFlag = 0;
+volatile uint8_t ESP_RxOverflow = 0;
+volatile uint8_t ESP_RxPaused = 0;
+volatile uint32_t ESP_RxPauses = 0;
+
+// Transmit queues, drained by DMA
+UART_TxQueueTypeDef PC_TxQueue;
+UART_TxQueueTypeDef ESP_TxQueue;
+
+// Ring buffer indexes of ESP receive path, head is written by the circular DMA
+static volatile uint16_t ESP_RxHead = 0;
+static volatile uint16_t ESP_RxTail = 0;
+static volatile uint32_t ESP_RxProduced = 0;
+static uint32_t ESP_RxConsumed = 0;
+
+// Storage for data copied into the transmit queues
+static uint8_t PC_TxArena[PC_TX_ARENA_SIZE];
+static uint8_t ESP_TxArena[ESP_TX_ARENA_SIZE];
+
+
+
+/**
+  * @brief  Function to initialize a transmit queue.
+  * @param q: Queue
+  * @param huart: UART the queue transmits on, needs a DMA TX channel linked
+  * @param arena: Storage for copied data
+  * @param arenaSize: Size of arena
+  * @param policy: What to do if the queue is full
+  * @retval None
+  */
+void uart_TxQueueInit(UART_TxQueueTypeDef *q, UART_HandleTypeDef *huart, uint8_t *arena, uint16_t arenaSize, UART_TxPolicyTypeDef policy)
+{
+	memset(q, 0, sizeof(UART_TxQueueTypeDef));
+
+	q->huart = huart;
+	q->arena = arena;
+	q->arenaSize = arenaSize;
+	q->policy = policy;
+}
+
+
+/**
+  * @brief  Function to initialize the transmit queues of pc and ESP8266 module.
+  * @retval None
+  */
+void uart_TxInit(void)
+{
+	// Debug output must never delay the application, ESP data must never get lost
+	uart_TxQueueInit(&PC_TxQueue, &pc_uart, PC_TxArena, PC_TX_ARENA_SIZE, UART_TX_DROP);
+	uart_TxQueueInit(&ESP_TxQueue, &esp8266_uart, ESP_TxArena, ESP_TX_ARENA_SIZE, UART_TX_BLOCK);
+}
+
+
+/**
+  * @brief  Function to start the DMA transfer of the oldest entry if the UART is idle.
+  *         Must be called with interrupts disabled or from the UART interrupt.
+  * @param q: Queue
+  * @retval None
+  */
+static void uart_TxKick(UART_TxQueueTypeDef *q)
+{
+	UART_TxDescTypeDef *desc;
+
+	if (q->busy || q->count == 0)
+		return;
+
+	desc = &q->desc[q->tail];
+	q->busy = 1;
+	q->kickUs = trace_Now();
+
+	if (HAL_UART_Transmit_DMA(q->huart, (uint8_t*) desc->data, desc->len) != HAL_OK)
+		q->busy = 0;
+}
+
+
+/**
+  * @brief  Function to reserve space in the arena of a queue.
+  *         Must be called with interrupts disabled.
+  * @param q: Queue
+  * @param len: Number of bytes
+  * @param end: Returns arena offset after the reserved space
+  * @retval Pointer to reserved space, NULL if arena is full
+  */
+static uint8_t *uart_TxArenaAlloc(UART_TxQueueTypeDef *q, uint16_t len, uint16_t *end)
+{
+	uint16_t start;
+
+	if (q->arenaUsed == 0)
+	{
+		q->arenaHead = 0;
+		q->arenaTail = 0;
+	}
+
+	if (q->arenaUsed == 0 || q->arenaHead > q->arenaTail)
+	{
+		// Free space at the end of the arena, otherwise wrap to the start
+		if (q->arenaSize - q->arenaHead >= len)
+			start = q->arenaHead;
+		else if (q->arenaUsed != 0 && q->arenaTail >= len)
+			start = 0;
+		else
+			return NULL;
+	}
+	else if (q->arenaTail - q->arenaHead >= len)
+	{
+		start = q->arenaHead;
+	}
+	else
+	{
+		return NULL;
+	}
+
+	q->arenaHead = start + len;
+	q->arenaUsed++;
+	*end = start + len;
+
+	return &q->arena[start];
+}
+
+
+/**
+  * @brief  Function to get the arena space several allocations in a row can use at least.
+  *         Either the free space behind the head or the one at the start after a wrap.
+  *         Must be called with interrupts disabled.
+  * @param q: Queue
+  * @retval Number of bytes
+  */
+static uint16_t uart_TxArenaFree(UART_TxQueueTypeDef *q)
+{
+	if (q->arenaUsed == 0)
+		return q->arenaSize;
+
+	if (q->arenaHead > q->arenaTail)
+		return (q->arenaSize - q->arenaHead > q->arenaTail) ? q->arenaSize - q->arenaHead : q->arenaTail;
+
+	return q->arenaTail - q->arenaHead;
+}
+
+
+/**
+  * @brief  Function to add an entry to a queue.
+  * @param q: Queue
+  * @param data: Data to transmit
+  * @param len: Length of data
+  * @param copy: 1 to copy data into the arena, 0 to transmit from the caller's memory
+  * @param cb: Called from interrupt when the entry was transmitted, may be NULL
+  * @param ctx: Passed to cb
+  * @retval HAL_OK if queued, HAL_BUSY if the queue was full
+  */
+static HAL_StatusTypeDef uart_TxPush(UART_TxQueueTypeDef *q, const uint8_t *data, uint16_t len, uint8_t copy, UART_TxCallback cb, void *ctx)
+{
+	UART_TxDescTypeDef *desc;
+	uint8_t *dst = NULL;
+	uint16_t end = UART_TX_NO_ARENA;
+	uint32_t start = HAL_GetTick();
+
+	if (len == 0)
+		return HAL_OK;
+
+	if (copy && len > q->arenaSize)
+	{
+		q->dropped++;
+		return HAL_ERROR;
+	}
+
+	while (1)
+	{
+		__disable_irq();
+
+		if (q->count < UART_TX_QUEUE_DEPTH && (!copy || (dst = uart_TxArenaAlloc(q, len, &end)) != NULL))
+			break;
+
+		// Bounded memory, either the entry is dropped or the caller sleeps until DMA made room
+		if (q->policy == UART_TX_DROP || HAL_GetTick() - start > UART_TX_BLOCK_TIMEOUT)
+		{
+			__enable_irq();
+			q->dropped++;
+			return HAL_BUSY;
+		}
+
+		wait_Sleep(UART_TX_BLOCK_TIMEOUT);
+		__enable_irq();
+	}
+
+	if (copy)
+	{
+		memcpy(dst, data, len);
+		data = dst;
+	}
+
+	desc = &q->desc[q->head];
+	desc->data = data;
+	desc->len = len;
+	desc->arenaEnd = end;
+	desc->cb = cb;
+	desc->ctx = ctx;
+
+	q->head = (q->head + 1) % UART_TX_QUEUE_DEPTH;
+	q->count++;
+
+	uart_TxKick(q);
+	__enable_irq();
 
+	return HAL_OK;
+}
+
+
+/**
+  * @brief  Function to wait until a queue can take several entries at once, so data split into
+  *         segments is queued either as a whole or not at all. The interrupt only frees entries,
+  *         the space stays available until the caller queued its segments.
+  * @param q: Queue
+  * @param entries: Number of entries
+  * @param copyLen: Bytes of all entries to be copied into the arena
+  * @retval HAL_OK if there is space, HAL_BUSY if the queue stayed full
+  */
+HAL_StatusTypeDef uart_TxReserve(UART_TxQueueTypeDef *q, uint8_t entries, uint16_t copyLen)
+{
+	uint32_t start = HAL_GetTick();
+
+	if (entries > UART_TX_QUEUE_DEPTH || copyLen > q->arenaSize)
+	{
+		q->dropped++;
+		return HAL_ERROR;
+	}
+
+	while (1)
+	{
+		__disable_irq();
+
+		if (UART_TX_QUEUE_DEPTH - q->count >= entries && uart_TxArenaFree(q) >= copyLen)
+			break;
+
+		if (q->policy == UART_TX_DROP || HAL_GetTick() - start > UART_TX_BLOCK_TIMEOUT)
+		{
+			__enable_irq();
+			q->dropped++;
+			return HAL_BUSY;
+		}
+
+		wait_Sleep(UART_TX_BLOCK_TIMEOUT);
+		__enable_irq();
+	}
+
+	__enable_irq();
+
+	return HAL_OK;
+}
+
+
+/**
+  * @brief  Function to queue data for transmission, data is copied and can be reused immediately.
+  * @param q: Queue
+  * @param data: Data to transmit
+  * @param len: Length of data
+  * @param cb: Called from interrupt when the data was transmitted, may be NULL
+  * @param ctx: Passed to cb
+  * @retval HAL_OK if queued
+  */
+HAL_StatusTypeDef uart_TxEnqueue(UART_TxQueueTypeDef *q, const uint8_t *data, uint16_t len, UART_TxCallback cb, void *ctx)
+{
+	return uart_TxPush(q, data, len, 1, cb, ctx);
+}
+
+
+/**
+  * @brief  Function to queue data for transmission without copying it.
+  *         Data must stay valid until cb was called or the queue is idle.
+  * @param q: Queue
+  * @param data: Data to transmit
+  * @param len: Length of data
+  * @param cb: Called from interrupt when the data was transmitted, may be NULL
+  * @param ctx: Passed to cb
+  * @retval HAL_OK if queued
+  */
+HAL_StatusTypeDef uart_TxEnqueueRef(UART_TxQueueTypeDef *q, const uint8_t *data, uint16_t len, UART_TxCallback cb, void *ctx)
+{
+	return uart_TxPush(q, data, len, 0, cb, ctx);
+}
+
+
+/**
+  * @brief  Function to queue a block of the buffer pool for transmission. The queue owns the
+  *         block from now on and returns it to the pool when it was transmitted.
+  * @param q: Queue
+  * @param block: Block returned by buf_Alloc
+  * @param len: Number of bytes of block to transmit
+  * @retval HAL_OK if queued, the block is freed otherwise
+  */
+HAL_StatusTypeDef uart_TxEnqueueBlock(UART_TxQueueTypeDef *q, uint8_t *block, uint16_t len)
+{
+	HAL_StatusTypeDef status;
+
+	if (len == 0)
+	{
+		buf_Free(block);
+		return HAL_OK;
+	}
+
+	buf_Handover(block, BUF_OWNER_DMA);
+	status = uart_TxPush(q, block, len, 0, buf_FreeCallback, block);
+
+	if (status != HAL_OK)
+		buf_Free(block);
+
+	return status;
+}
+
+
+/**
+  * @brief  Function to check if a queue has transmitted everything.
+  * @param q: Queue
+  * @retval 1 if idle
+  */
+uint8_t uart_TxIdle(UART_TxQueueTypeDef *q)
+{
+	return (q->count == 0 && !q->busy);
+}
 
 
 /**
-  * @brief  Function to transmit to the pc for debug purpose.
+  * @brief  Condition of uart_TxFlush.
+  * @param ctx: Queue
+  * @retval 1 if idle
+  */
+static uint8_t uart_TxIdleCond(void *ctx)
+{
+	return uart_TxIdle((UART_TxQueueTypeDef*) ctx);
+}
+
+
+/**
+  * @brief  Function to wait until a queue has transmitted everything, e.g. before sleep.
+  * @param q: Queue
+  * @param timeout: Max time to wait in ms
+  * @retval 1 if idle
+  */
+uint8_t uart_TxFlush(UART_TxQueueTypeDef *q, uint32_t timeout)
+{
+	return wait_Until(uart_TxIdleCond, q, timeout);
+}
+
+
+/**
+  * @brief  Function to get the measured throughput of a queue, bytes transmitted per second the
+  *         DMA was busy. Shows the speed of the line without the gaps between transfers.
+  * @param q: Queue
+  * @retval Bytes per second, 0 if nothing was transmitted yet
+  */
+uint32_t uart_TxThroughput(UART_TxQueueTypeDef *q)
+{
+	if (q->busyUs == 0)
+		return 0;
+
+	return (uint32_t) (((uint64_t) q->sent * 1000000) / q->busyUs);
+}
+
+
+/**
+  * @brief  Tx transfer complete callback, releases the finished entry and starts the next one.
+  * @param huart: UART handle
+  * @retval None
+  */
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	UART_TxQueueTypeDef *q;
+	UART_TxDescTypeDef *desc;
+
+	if (huart->Instance == pc_uart.Instance)
+		q = &PC_TxQueue;
+	else if (huart->Instance == esp8266_uart.Instance)
+		q = &ESP_TxQueue;
+	else
+		return;
+
+	if (q->count == 0)
+	{
+		q->busy = 0;
+		return;
+	}
+
+	desc = &q->desc[q->tail];
+
+	if (desc->arenaEnd != UART_TX_NO_ARENA)
+	{
+		q->arenaTail = desc->arenaEnd;
+		q->arenaUsed--;
+	}
+
+	q->sent += desc->len;
+	q->busyUs += trace_Now() - q->kickUs;
+	q->tail = (q->tail + 1) % UART_TX_QUEUE_DEPTH;
+	q->count--;
+	q->busy = 0;
+
+	if (desc->cb != NULL)
+		desc->cb(desc->ctx);
+
+	uart_TxKick(q);
+}
+
+
+#if LOG_BINARY == 0
+/**
+  * @brief  Function to transmit to the pc for debug purpose. Returns as soon as the text is queued.
+  *         Text is formatted into a pool block and cut at its size, dropped if the pool runs low.
   * @retval None
   */
 void pc_printf(char *fmt, ...)
 {
 	if(DEBUG_MODE == 1)
 	{
-		uint16_t i;
+		uint16_t len;
 		va_list ap;
+		uint8_t *block = buf_Alloc(BUF_OWNER_LOG);
+
+		if (block == NULL)
+		{
+			PC_TxQueue.dropped++;
+			return;
+		}
 
 		va_start(ap, fmt);
-		vsprintf((char*) PC_TxBUF, fmt, ap);
+		len = fmt_Format((char*) block, BUF_POOL_BLOCK_SIZE, fmt, ap);
 		va_end(ap);
-		i = strlen((const char*) PC_TxBUF);
-		HAL_UART_Transmit(&huart2, PC_TxBUF, i, 100);
 
-		memset(PC_TxBUF, 0, PC_MAX_SENDLEN);
+		uart_TxEnqueueBlock(&PC_TxQueue, block, len);
 	}
 }
+#endif
 
 
 /**
-  * @brief  Function to transmit to the ESP8266 module.
+  * @brief  Function to transmit to the ESP8266 module. Returns as soon as the command is queued.
+  *         The command is formatted into a pool block that is handed to the DMA.
   * @retval None
   */
 void esp_transmit(char *fmt, ...)
 {
-	uint16_t i, j;
+	uint16_t len;
 	va_list ap;
+	uint8_t *block = buf_AllocWait(BUF_OWNER_AT, UART_TX_BLOCK_TIMEOUT);
+
+	ESP_RecvEndFlag = 0;
+
+	if (block == NULL)
+	{
+		ESP_TxQueue.dropped++;
+		return;
+	}
+
 	va_start(ap, fmt);
-	vsprintf((char*) ESP_TxBUF, fmt, ap);
+	len = fmt_Format((char*) block, BUF_POOL_BLOCK_SIZE, fmt, ap);
 	va_end(ap);
 
-	for (i = 0; i < ESP_MAX_SENDLEN; i++) {
-		j = i + 1;
-		if (ESP_TxBUF[i] == '\00') {
-			for (; j < ESP_MAX_SENDLEN; j++) {
-				ESP_TxBUF[j - 1] = ESP_TxBUF[j];
-			}
-		}
+	uart_TxEnqueueBlock(&ESP_TxQueue, block, len);
+}
+
+
+/**
+  * @brief  Function to start the continuously running circular DMA reception of the ESP8266 module.
+  * @retval None
+  */
+void esp_RxStart(void)
+{
+	// A reception left running, e.g. by a re-init after wakeup, would not restart at index 0
+	HAL_UART_AbortReceive(&esp8266_uart);
+
+	ESP_RxHead = 0;
+	ESP_RxTail = 0;
+	ESP_RxProduced = 0;
+	ESP_RxConsumed = 0;
+	ESP_RxOverflow = 0;
+
+	HAL_UART_Receive_DMA(&esp8266_uart, ESP_RxBUF, ESP_MAX_RECVLEN);
+	esp_RxFlowControl();
+}
+
+
+/**
+  * @brief  Function to update the producer index from the DMA counter.
+  *         Called on IDLE, half transfer and transfer complete events.
+  * @retval Number of new bytes since last update
+  */
+uint16_t esp_RxUpdateHead(void)
+{
+	uint16_t head = ESP_MAX_RECVLEN - __HAL_DMA_GET_COUNTER(esp8266_uart.hdmarx);
+	uint16_t newBytes;
+
+	if (head >= ESP_MAX_RECVLEN)
+		head = 0;
+
+	newBytes = (head - ESP_RxHead + ESP_MAX_RECVLEN) % ESP_MAX_RECVLEN;
+
+	ESP_RxHead = head;
+	ESP_RxProduced += newBytes;
+
+	// Producer lapped the consumer, oldest data is lost
+	if (ESP_RxProduced - ESP_RxConsumed > ESP_MAX_RECVLEN)
+		ESP_RxOverflow = 1;
+
+	esp_RxFlowControl();
+
+	return newBytes;
+}
+
+
+/**
+  * @brief  Function to get the number of received bytes not consumed yet.
+  * @retval Number of bytes
+  */
+uint16_t esp_RxAvailable(void)
+{
+	return (ESP_RxHead - ESP_RxTail + ESP_MAX_RECVLEN) % ESP_MAX_RECVLEN;
+}
+
+
+/**
+  * @brief  Function to get the next contiguous span of received bytes without copying them.
+  *         A span ends at the end of the ring, the remaining bytes are returned by the next call.
+  * @param span: Returns pointer to first unread byte
+  * @retval Length of span
+  */
+uint16_t esp_RxPeekSpan(const uint8_t **span)
+{
+	uint16_t head = ESP_RxHead;
+	uint16_t tail = ESP_RxTail;
+
+	*span = &ESP_RxBUF[tail];
+
+	if (head >= tail)
+		return head - tail;
+
+	return ESP_MAX_RECVLEN - tail;
+}
+
+
+/**
+  * @brief  Function to release bytes returned by esp_RxPeekSpan.
+  * @param len: Number of bytes to release
+  * @retval None
+  */
+void esp_RxConsume(uint16_t len)
+{
+	ESP_RxTail = (ESP_RxTail + len) % ESP_MAX_RECVLEN;
+	ESP_RxConsumed += len;
+
+	if (ESP_RxPaused)
+		esp_RxFlowControl();
+}
+
+
+/**
+  * @brief  Function to copy the first received bytes into a buffer without consuming them, e.g.
+  *         to check a header before the whole packet is there.
+  * @param buf: Destination buffer
+  * @param len: Max number of bytes to copy
+  * @retval Number of bytes copied, less than len if less are available
+  */
+uint16_t esp_RxPeek(uint8_t *buf, uint16_t len)
+{
+	uint16_t available = esp_RxAvailable();
+	uint16_t tail = ESP_RxTail;
+	uint16_t i;
+
+	if (len > available)
+		len = available;
+
+	for (i = 0; i < len; i++)
+		buf[i] = ESP_RxBUF[(tail + i) % ESP_MAX_RECVLEN];
+
+	return len;
+}
+
+
+/**
+  * @brief  Function to copy received bytes into a buffer, used where a linear packet is needed.
+  * @param buf: Destination buffer
+  * @param len: Number of bytes to read
+  * @retval Number of bytes read, 0 if less than len bytes are available
+  */
+uint16_t esp_RxRead(uint8_t *buf, uint16_t len)
+{
+	const uint8_t *span;
+	uint16_t spanLen, copied = 0;
+
+	if (esp_RxAvailable() < len)
+		return 0;
+
+	while (copied < len)
+	{
+		spanLen = esp_RxPeekSpan(&span);
+		if (spanLen > len - copied)
+			spanLen = len - copied;
+
+		memcpy(&buf[copied], span, spanLen);
+		esp_RxConsume(spanLen);
+		copied += spanLen;
 	}
 
-	i = strlen((const char*) ESP_TxBUF);
+	return copied;
+}
 
-	HAL_UART_Transmit(&huart1, ESP_TxBUF, i, 100);
 
-	memset(ESP_TxBUF, 0, ESP_MAX_SENDLEN);
-	memset(ESP_RxBUF, 0, ESP_MAX_RECVLEN);
+/**
+  * @brief  Function to drop all received bytes not consumed yet.
+  * @retval None
+  */
+void esp_RxFlush(void)
+{
+	__disable_irq();
+	ESP_RxTail = ESP_RxHead;
+	ESP_RxConsumed = ESP_RxProduced;
+	__enable_irq();
+	ESP_RxOverflow = 0;
 	ESP_RecvEndFlag = 0;
+
+	esp_RxFlowControl();
+}
+
+
+#if ESP_FLOW_CONTROL == 1
+/**
+  * @brief  Function to get the bytes in the ring including those not announced by an interrupt
+  *         yet. The counters tell a full ring from an empty one, the DMA counter adds the bytes
+  *         written since the last update. Has to be called with interrupts disabled.
+  * @param head: Returns the write position of the DMA
+  * @retval Number of bytes, more than the ring if it was overrun
+  */
+static uint32_t esp_RxFill(uint16_t *head)
+{
+	*head = ESP_MAX_RECVLEN - __HAL_DMA_GET_COUNTER(esp8266_uart.hdmarx);
+	if (*head >= ESP_MAX_RECVLEN)
+		*head = 0;
+
+	return (ESP_RxProduced - ESP_RxConsumed) + (*head - ESP_RxHead + ESP_MAX_RECVLEN) % ESP_MAX_RECVLEN;
+}
+#endif
+
+
+/**
+  * @brief  Function to apply back-pressure to the ESP8266 module. RTS is raised when the ring
+  *         fills up and released once it was drained, the fill level is taken from the DMA
+  *         counter so bytes not announced by an interrupt yet are included.
+  *         Called from the ring functions, from SysTick while data is streaming in and after
+  *         every sleep of the CPU.
+  * @retval None
+  */
+void esp_RxFlowControl(void)
+{
+#if ESP_FLOW_CONTROL == 1
+	uint32_t primask = __get_PRIMASK();
+	uint32_t fill;
+	uint16_t head;
+
+	__disable_irq();
+
+	fill = esp_RxFill(&head);
+
+	if (!ESP_RxPaused && fill >= ESP_RX_RTS_HIGH)
+	{
+		WIFI_RTS_Pause();
+		ESP_RxPaused = 1;
+		ESP_RxPauses++;
+	}
+	else if (ESP_RxPaused && fill <= ESP_RX_RTS_LOW)
+	{
+		WIFI_RTS_Resume();
+		ESP_RxPaused = 0;
+	}
+
+	__set_PRIMASK(primask);
+#endif
+}
+
+
+/**
+  * @brief  Function to get how long the CPU may sleep without a look at the ring. Half transfer
+  *         and transfer complete interrupts wake it every half ring, a sleep only has to end
+  *         earlier if the ring could reach ESP_RX_RTS_HIGH before the next of them.
+  * @retval Max sleep in us, 0xffffffff if the next DMA interrupt comes first
+  */
+uint32_t esp_RxFlowDeadline(void)
+{
+#if ESP_FLOW_CONTROL == 1
+	uint32_t primask = __get_PRIMASK();
+	uint32_t fill;
+	uint16_t head, toInterrupt;
+
+	__disable_irq();
+	fill = esp_RxFill(&head);
+	__set_PRIMASK(primask);
+
+	toInterrupt = ESP_MAX_RECVLEN / 2 - head % (ESP_MAX_RECVLEN / 2);
+
+	if (ESP_RxPaused || fill + toInterrupt < ESP_RX_RTS_HIGH)
+		return 0xffffffff;
+
+	if (fill >= ESP_RX_RTS_HIGH)
+		return 0;
+
+	// 10 bit times per byte, rounded down to wake up early
+	return (ESP_RX_RTS_HIGH - fill) * (10000000UL / esp8266_uart.Init.BaudRate);
+#else
+	return 0xffffffff;
+#endif
+}
+
+
+/**
+  * @brief  Function to change the baud rate of the ESP8266 UART. Waits until the queued data
+  *         left the UART with the old rate, the reception restarts with an empty ring.
+  *         Throughput of the queue is measured from now on.
+  * @param baud: New baud rate
+  * @retval HAL_OK if the UART runs with the new rate
+  */
+HAL_StatusTypeDef esp_SetBaudRate(uint32_t baud)
+{
+	uint32_t start = HAL_GetTick();
+	HAL_StatusTypeDef status;
+
+	uart_TxFlush(&ESP_TxQueue, UART_TX_BLOCK_TIMEOUT);
+
+	// Last byte has to leave the shift register before the rate changes
+	while (__HAL_UART_GET_FLAG(&esp8266_uart, UART_FLAG_TC) == RESET && HAL_GetTick() - start < 2)
+	{
+	}
+
+	HAL_UART_AbortReceive(&esp8266_uart);
+
+	esp8266_uart.Init.BaudRate = baud;
+	status = HAL_UART_Init(&esp8266_uart);
+
+	__HAL_UART_ENABLE_IT(&esp8266_uart, UART_IT_IDLE);
+	esp_RxStart();
+
+	ESP_TxQueue.sent = 0;
+	ESP_TxQueue.busyUs = 0;
+
+	return status;
+}
+
+
+/**
+  * @brief  Rx half transfer callback, keeps track of the ring producer index.
+  * @param huart: UART handle
+  * @retval None
+  */
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+	if (huart->Instance == esp8266_uart.Instance)
+		esp_RxUpdateHead();
+}
+
+
+/**
+  * @brief  Rx transfer complete callback, DMA wraps around to the start of the ring.
+  * @param huart: UART handle
+  * @retval None
+  */
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+	if (huart->Instance == esp8266_uart.Instance)
+		esp_RxUpdateHead();
+}
+
+
+/**
+  * @brief  UART error callback, HAL aborts the reception on errors so the ring is restarted.
+  * @param huart: UART handle
+  * @retval None
+  */
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	if (huart->Instance == esp8266_uart.Instance && huart->RxState == HAL_UART_STATE_READY)
+		esp_RxStart();
 }
@@ -6,11 +6,17 @@
 */
 
 #include "main.h"
+#include "utils.h"
 #include "uart_com.h"
 #include "esp8266.h"
+#include "trace.h"
 #include <mqttclient.h>
 #include <net_conf.h>
 
+// Private variables
+static uint32_t sleep_ClockCfgr;    // RCC->CFGR before STOP, wake up resets the clock switch to HSI
+
+
 // Function to switch off nRF24L01+ module and set system to sleep
 void goToSleep(void)
 {
@@ -30,34 +36,199 @@ void goToSleep(void)
 //	GPIO_InitStruct.Pull = GPIO_NOPULL;
 //	HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
 
+	// Let queued output finish, DMA stops in STOP mode
+	uart_TxFlush(&PC_TxQueue, 100);
+	uart_TxFlush(&ESP_TxQueue, 100);
+
 	// Disable system tick
 	HAL_SuspendTick();
 
+	// System wakes up on HSI, trace timer has to count at its rate
+	trace_SetClock(HSI_VALUE);
+	sleep_ClockCfgr = RCC->CFGR;
+
 	// Send system to sleep
 	HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
 }
 
 
-// Function which is executed after wakeup from sleep. Starts nRF24L01+ module again and initializes it
+// Function to check in a wake up interrupt if the system woke from STOP mode, which leaves the
+// CPU on HSI. An interrupt during an active wake, e.g. in a wait in SLEEP mode, finds the PLL.
+uint8_t wakeUp_FromStop(void)
+{
+	return (RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL;
+}
+
+
+// Function to start the PLL from the wake up interrupt. STOP mode only switched off the PLL and
+// selected HSI, prescalers and PLL factors are restored and the CPU goes on with HSI meanwhile.
+void wakeUp_StartClock(void)
+{
+	// Not woken from STOP, e.g. the button was pressed during a wait in SLEEP mode
+	if (!wakeUp_FromStop())
+		return;
+
+	RCC->CFGR = sleep_ClockCfgr & ~RCC_CFGR_SW;
+	RCC->CR |= RCC_CR_PLLON;
+}
+
+
+// Function which is executed in the main loop after wakeup from sleep. Switches to the PLL once
+// locked, GPIO, DMA and USART kept their registers in STOP mode and are not initialized again.
 void wakeUp(void)
 {
+	if ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL)
+	{
+		wakeUp_StartClock();
 
+		while ((RCC->CR & RCC_CR_PLLRDY) == 0)
+		{
+		}
 
+		RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_PLL;
 
-//	RFon();
-//
-//	// Wait some time for nRF24 module to start up
-//	wait();
-//
-//	// Set chip-select high -> not selected
-//	nRF24_CSN_H();
-//
-//	// Set CE low -> RX/TX disabled
-//	nRF24_CE_L();
-//
-//	// Initialize the nRF24L01+ module and configure it as receiver
-//	nRF24_Init();
-//
-//	wait();
+		while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL)
+		{
+		}
+	}
+
+	// SysTick reload and SystemCoreClock still hold for the PLL
+	HAL_ResumeTick();
+	trace_SetClock(SystemCoreClock);
+	trace_Mark(TRACE_STAGE_CLOCK);
+
+	// Module output during STOP mode was lost, only its errors are left
+	__HAL_UART_CLEAR_FLAG(&esp8266_uart, UART_CLEAR_OREF | UART_CLEAR_NEF | UART_CLEAR_FEF);
+
+	if (esp8266_uart.RxState != HAL_UART_STATE_BUSY_RX)
+		esp_RxStart();
+
+	trace_Mark(TRACE_STAGE_PERIPH);
+}
+
+
+// Function to convert a value of 0 - 99 to BCD
+static uint32_t rtc_ToBcd(uint32_t value)
+{
+	return ((value / 10) << 4) | (value % 10);
+}
+
+
+// Function to convert a BCD value to binary
+static uint32_t rtc_FromBcd(uint32_t value)
+{
+	return ((value >> 4) * 10) + (value & 0x0f);
+}
+
+
+// Function to start the RTC on LSI, used as time base and wake up source while in STOP mode. The
+// HAL RTC driver is not part of the project, registers are written directly.
+void rtc_Init(void)
+{
+	__HAL_RCC_PWR_CLK_ENABLE();
+	PWR->CR |= PWR_CR_DBP;
 
+	RCC->CSR |= RCC_CSR_LSION;
+	while ((RCC->CSR & RCC_CSR_LSIRDY) == 0)
+	{
+	}
+
+	// Backup domain keeps running over a system reset, only set up once
+	if ((RCC->BDCR & RCC_BDCR_RTCEN) == 0)
+	{
+		RCC->BDCR = (RCC->BDCR & ~RCC_BDCR_RTCSEL) | RCC_BDCR_RTCSEL_LSI | RCC_BDCR_RTCEN;
+
+		RTC->WPR = 0xca;
+		RTC->WPR = 0x53;
+
+		RTC->ISR |= RTC_ISR_INIT;
+		while ((RTC->ISR & RTC_ISR_INITF) == 0)
+		{
+		}
+
+		// Prescaler needs two separate writes, 1 Hz calendar clock
+		RTC->PRER = RTC_SYNC_PREDIV;
+		RTC->PRER |= (uint32_t) RTC_ASYNC_PREDIV << 16;
+		RTC->TR = 0;
+
+		RTC->ISR &= ~RTC_ISR_INIT;
+		RTC->WPR = 0xff;
+	}
+
+	// Alarm is routed through EXTI line 17, wakes up from STOP mode
+	EXTI->IMR |= EXTI_IMR_MR17;
+	EXTI->RTSR |= EXTI_RTSR_TR17;
+
+	HAL_NVIC_SetPriority(RTC_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(RTC_IRQn);
+}
+
+
+// Function to get the seconds since the start of the calendar, 1 Jan 2000. Counts on over
+// midnight, so time spans of more than one day are measured correctly.
+uint32_t rtc_GetTime(void)
+{
+	static const uint16_t daysBefore[12] = { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+	uint32_t tr, dr, year, month, days;
+
+	// Shadow registers are not updated in STOP mode, wait for the next synchronization
+	RTC->ISR = ~(RTC_ISR_RSF | RTC_ISR_INIT) | (RTC->ISR & RTC_ISR_INIT);
+	while ((RTC->ISR & RTC_ISR_RSF) == 0)
+	{
+	}
+
+	tr = RTC->TR;
+	dr = RTC->DR;    // unlocks the shadow registers again
+
+	year = rtc_FromBcd((dr >> 16) & 0xff);
+	month = rtc_FromBcd((dr >> 8) & 0x1f);
+
+	// Every fourth year from 2000 on is a leap year
+	days = year * 365 + (year + 3) / 4 + daysBefore[(month - 1) % 12] + rtc_FromBcd(dr & 0x3f) - 1;
+	if ((year % 4) == 0 && month > 2)
+		days++;
+
+	return days * RTC_SECONDS_PER_DAY
+			+ rtc_FromBcd((tr >> 16) & 0x3f) * 3600 + rtc_FromBcd((tr >> 8) & 0x7f) * 60 + rtc_FromBcd(tr & 0x7f);
+}
+
+
+// Function to get the seconds of the current day
+uint32_t rtc_GetSeconds(void)
+{
+	return rtc_GetTime() % RTC_SECONDS_PER_DAY;
+}
+
+
+// Function to set the alarm which wakes up the system in the given number of seconds (< 1 day)
+void rtc_SetAlarm(uint32_t seconds)
+{
+	uint32_t t = (rtc_GetSeconds() + seconds) % RTC_SECONDS_PER_DAY;
+
+	RTC->WPR = 0xca;
+	RTC->WPR = 0x53;
+
+	RTC->CR &= ~(RTC_CR_ALRAE | RTC_CR_ALRAIE);
+	while ((RTC->ISR & RTC_ISR_ALRAWF) == 0)
+	{
+	}
+
+	// Date is ignored, alarm fires on the next match of hours, minutes and seconds
+	RTC->ALRMAR = RTC_ALRMAR_MSK4 | (rtc_ToBcd(t / 3600) << 16) | (rtc_ToBcd((t / 60) % 60) << 8) | rtc_ToBcd(t % 60);
+	RTC->ISR = ~(RTC_ISR_ALRAF | RTC_ISR_INIT) | (RTC->ISR & RTC_ISR_INIT);
+	RTC->CR |= RTC_CR_ALRAE | RTC_CR_ALRAIE;
+
+	RTC->WPR = 0xff;
+
+	EXTI->PR = EXTI_PR_PR17;
+}
+
+
+// Function to disable the wake up alarm
+void rtc_CancelAlarm(void)
+{
+	RTC->WPR = 0xca;
+	RTC->WPR = 0x53;
+	RTC->CR &= ~(RTC_CR_ALRAE | RTC_CR_ALRAIE);
+	RTC->WPR = 0xff;
 }
@@ -0,0 +1,206 @@
+/**
+  *********************************************************************************
+  * @file           : wait.c
+  * @brief          : This file contains the tickless wait of AT commands, MQTT
+  * 				  packets and UART transmissions. The MCU sleeps in SLEEP
+  * 				  mode, STOP mode would stop the USART and DMA the module is
+  * 				  waited for. TIM14 runs as one-shot timer of the deadline.
+  *********************************************************************************
+*/
+
+
+// Includes
+#include "main.h"
+#include "wait.h"
+#include "trace.h"
+#include "uart_com.h"
+
+
+// Private variables
+static WAIT_StatsTypeDef wait_Stats;
+static uint32_t wait_TickUs = 0;        // part of a ms slept not added to the tick yet
+
+
+
+/**
+  * @brief  Function to set up the deadline timer. Update events are only generated by
+  *         the overflow, the prescaler can be loaded without an interrupt.
+  * @retval None
+  */
+void wait_Init(void)
+{
+	__HAL_RCC_TIM14_CLK_ENABLE();
+
+	WAIT_TIM->CR1 = TIM_CR1_URS | TIM_CR1_OPM;
+	WAIT_TIM->DIER = TIM_DIER_UIE;
+	WAIT_TIM->SR = (uint32_t) ~TIM_SR_UIF;
+
+	HAL_NVIC_SetPriority(WAIT_TIM_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(WAIT_TIM_IRQn);
+
+	wait_ResetStats();
+}
+
+
+/**
+  * @brief  Function to sleep until any interrupt or the timeout. Has to be called with
+  *         interrupts disabled right after the wait condition was checked, an interrupt
+  *         pending meanwhile ends the sleep at once. Interrupts stay disabled, the handler
+  *         runs once the caller enables them again. SysTick does not check the receive ring
+  *         meanwhile, the sleep ends before the ring could pass the RTS mark unchecked.
+  * @param timeout: Max time to sleep in ms
+  * @retval None
+  */
+void wait_Sleep(uint32_t timeout)
+{
+	uint32_t start, slept, ticks, flowUs;
+
+	// Interrupts of the same priority could not end the sleep in a handler, keep polling
+	if (timeout == 0 || __get_IPSR() != 0)
+		return;
+	if (timeout > WAIT_MAX_SLEEP)
+		timeout = WAIT_MAX_SLEEP;
+
+	ticks = timeout * (WAIT_TICK_HZ / 1000);
+
+	// Flow control of the module is checked again once the ring could reach the RTS mark
+	flowUs = esp_RxFlowDeadline();
+	if (flowUs / (1000000UL / WAIT_TICK_HZ) < ticks)
+	{
+		ticks = flowUs / (1000000UL / WAIT_TICK_HZ);
+		wait_Stats.flowChecks++;
+
+		if (ticks == 0)
+		{
+			esp_RxFlowControl();
+			return;
+		}
+	}
+
+	WAIT_TIM->PSC = (SystemCoreClock / WAIT_TICK_HZ) - 1;
+	WAIT_TIM->ARR = ticks - 1;
+	WAIT_TIM->EGR = TIM_EGR_UG;             // loads prescaler and clears counter
+	WAIT_TIM->SR = (uint32_t) ~TIM_SR_UIF;
+	WAIT_TIM->CR1 |= TIM_CR1_CEN;
+
+	start = trace_Now();
+	HAL_SuspendTick();
+
+	HAL_PWR_EnterSLEEPMode(PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI);
+
+	slept = trace_Now() - start;
+
+	// One-pulse mode stops the counter at the deadline
+	if (!(WAIT_TIM->CR1 & TIM_CR1_CEN))
+		wait_Stats.deadlines++;
+
+	WAIT_TIM->CR1 &= ~TIM_CR1_CEN;
+	WAIT_TIM->SR = (uint32_t) ~TIM_SR_UIF;
+
+	// SysTick did not count while suspended, the remainder is carried to the next sleep
+	wait_TickUs += slept;
+	uwTick += wait_TickUs / 1000;
+	wait_TickUs %= 1000;
+	HAL_ResumeTick();
+
+	esp_RxFlowControl();
+
+	wait_Stats.asleepUs += slept;
+	wait_Stats.sleeps++;
+}
+
+
+/**
+  * @brief  Function to sleep until a condition is true or the timeout.
+  * @param cond: Checked with interrupts disabled after every wake up, NULL to wait for the timeout
+  * @param ctx: Passed to cond
+  * @param timeout: Max time to wait in ms
+  * @retval 1 if the condition is true, 0 on timeout
+  */
+uint8_t wait_Until(WAIT_CondTypeDef cond, void *ctx, uint32_t timeout)
+{
+	uint32_t start = HAL_GetTick();
+	uint32_t elapsed;
+	uint8_t ready;
+
+	while (1)
+	{
+		__disable_irq();
+
+		ready = cond != NULL && cond(ctx);
+		elapsed = HAL_GetTick() - start;
+
+		if (ready || elapsed >= timeout)
+			break;
+
+		wait_Sleep(timeout - elapsed);
+		__enable_irq();
+	}
+
+	__enable_irq();
+
+	return ready;
+}
+
+
+/**
+  * @brief  Condition of wait_Flag.
+  * @param ctx: Flag
+  * @retval 1 if the flag is set
+  */
+static uint8_t wait_FlagSet(void *ctx)
+{
+	return *(volatile uint8_t*) ctx != 0;
+}
+
+
+/**
+  * @brief  Function to sleep until a flag set by an interrupt, e.g. ESP_RecvEndFlag, or the
+  *         timeout. The flag is not cleared.
+  * @param flag: Flag
+  * @param timeout: Max time to wait in ms
+  * @retval 1 if the flag is set, 0 on timeout
+  */
+uint8_t wait_Flag(volatile uint8_t *flag, uint32_t timeout)
+{
+	return wait_Until(wait_FlagSet, (void*) flag, timeout);
+}
+
+
+/**
+  * @brief  Function to sleep for a time, replaces HAL_Delay which polls SysTick.
+  * @param ms: Time to sleep in ms
+  * @retval None
+  */
+void wait_Delay(uint32_t ms)
+{
+	wait_Until(NULL, NULL, ms);
+}
+
+
+/**
+  * @brief  Function to start counting the time asleep and awake, e.g. at a wake up.
+  * @retval None
+  */
+void wait_ResetStats(void)
+{
+	wait_Stats.startUs = trace_Now();
+	wait_Stats.asleepUs = 0;
+	wait_Stats.sleeps = 0;
+	wait_Stats.deadlines = 0;
+	wait_Stats.flowChecks = 0;
+}
+
+
+/**
+  * @brief  Function to print the time asleep and awake since wait_ResetStats.
+  * @retval None
+  */
+void wait_PrintStats(void)
+{
+	uint32_t total = trace_Now() - wait_Stats.startUs;
+
+	pc_printf("Wait: %lu ms asleep, %lu ms awake, %lu sleeps, %lu ended by deadline, %lu shortened for flow control\r\n",
+			wait_Stats.asleepUs / 1000, (total - wait_Stats.asleepUs) / 1000,
+			wait_Stats.sleeps, wait_Stats.deadlines, wait_Stats.flowChecks);
+}
@@ -0,0 +1,707 @@
+/**
+  ************************************************************************************************
+  * @file           : mqtt_bench.c
+  * @brief          : Host micro-benchmark of the MQTT packet code.
+  *                   Runs each workload over a mix of packets for a fixed number of rounds and
+  *                   prints ns per packet. The callback decoder of the remaining length is kept
+  *                   here as reference for MQTTPacket_decodeLen, the two-pass serializers as
+  *                   reference for the single-pass ones. Batched publishes are rated by an
+  *                   802.11g air time model of the TCP segments the module sends.
+  ************************************************************************************************
+*/
+
+
+// Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "MQTTPacket.h"
+
+
+// Defines
+#define BENCH_ROUNDS          200000
+#define BENCH_PACKETS         8
+#define BENCH_PACKET_SIZE     256
+#define BENCH_TOPIC           "NucleoButton/state"    // topic of the publishes
+
+// Batching as in mqttbatch.c, every block is one transmission of the DMA
+#define BENCH_BATCH_MAX       32
+#define BENCH_BATCH_BLOCK     128                     // BUF_POOL_BLOCK_SIZE
+#define BENCH_BATCH_THRESHOLD 96                      // MQTT_BATCH_THRESHOLD
+#define BENCH_BATCH_PAYLOAD   "Pressed"
+
+// Air time of a TCP segment, 802.11g at 54 Mbit/s
+#define BENCH_AIR_MSS         1460                    // TCP payload of a segment
+#define BENCH_AIR_HEADERS     76                      // IPv4 20, TCP 20, MAC 24, LLC/SNAP 8, FCS 4
+#define BENCH_AIR_PREAMBLE_US 20.0
+#define BENCH_AIR_SYMBOL_US   4.0
+#define BENCH_AIR_SYMBOL_BITS 216
+#define BENCH_AIR_SERVICE_BITS 22                     // service and tail bits of the PSDU
+#define BENCH_AIR_ACCESS_US   133.5                   // DIFS 28, mean backoff 67.5, SIFS 10, ACK 28
+
+_Static_assert(BENCH_BATCH_BLOCK <= BENCH_AIR_MSS, "A block has to fit into one TCP segment");
+
+
+// Typedefs
+typedef int (*BENCH_FuncTypeDef)(unsigned char *buf, int len);
+
+typedef enum {
+	BENCH_TWO_PASS = 0,         // length computed first, then written
+	BENCH_SINGLE_PASS,          // packet starts at the returned offset
+	BENCH_SINGLE_PASS_MOVED,    // packet moved to the start of the buffer
+	BENCH_MODES
+} BENCH_ModeTypeDef;
+
+typedef int (*BENCH_SerializeTypeDef)(unsigned char *out, int i, BENCH_ModeTypeDef mode, unsigned char **packet);
+
+typedef struct __BENCH_PacketTypeDef {
+	unsigned char buf[BENCH_PACKET_SIZE];
+	int len;
+} BENCH_PacketTypeDef;
+
+
+// Private variables
+static BENCH_PacketTypeDef bench_Packets[BENCH_PACKETS];
+static unsigned char *bench_BufPtr;
+static volatile int bench_Sink;
+static unsigned char bench_Payload[BENCH_PACKET_SIZE];
+static const int bench_PayloadLens[] = { 7, 60, 130, 200 };
+static const char *bench_ModeNames[BENCH_MODES] = { "two-pass", "single-pass", "single-pass moved" };
+
+// Subscribed topics, the one of the packet mix last
+static char *bench_TopicNames[] = { "NucleoButton/cmd", "NucleoButton/config", "NucleoTrace/report", BENCH_TOPIC };
+static const MQTTTopic bench_TopicCmd = MQTTTopic_initializer("NucleoButton/cmd");
+static const MQTTTopic bench_TopicConfig = MQTTTopic_initializer("NucleoButton/config");
+static const MQTTTopic bench_TopicReport = MQTTTopic_initializer("NucleoTrace/report");
+static const MQTTTopic bench_TopicState = MQTTTopic_initializer(BENCH_TOPIC);
+static const MQTTTopic *const bench_Topics[] = { &bench_TopicCmd, &bench_TopicConfig, &bench_TopicReport, &bench_TopicState };
+static const struct __attribute__((packed)) { unsigned char len[2]; char str[MQTTTOPIC_LITERAL_LEN(BENCH_TOPIC)]; } bench_StateBytes =
+		{ { 0, MQTTTOPIC_LITERAL_LEN(BENCH_TOPIC) }, BENCH_TOPIC };
+static const MQTTTopic bench_TopicStatePrefixed = { bench_StateBytes.str, (const unsigned char*) &bench_StateBytes,
+		MQTTTOPIC_LITERAL_LEN(BENCH_TOPIC), MQTTTOPIC_HASH_LITERAL(BENCH_TOPIC) };
+static MQTTString bench_Received[BENCH_PACKETS];
+
+
+
+/**
+  * @brief  Reference reader of the callback decoder, the cursor is file-static.
+  * @param c: Returns the next byte
+  * @param count: Number of bytes
+  * @retval count
+  */
+static int bench_BufChar(unsigned char *c, int count)
+{
+	int i;
+
+	for (i = 0; i < count; ++i)
+		*c = *bench_BufPtr++;
+	return count;
+}
+
+
+/**
+  * @brief  Remaining length through MQTTPacket_decode and a reader callback, as before.
+  * @param buf: Packet
+  * @param len: Length of packet
+  * @retval Remaining length
+  */
+static int bench_DecodeCallback(unsigned char *buf, int len)
+{
+	int value;
+
+	bench_BufPtr = buf + 1;
+	MQTTPacket_decode(bench_BufChar, &value);
+	return value;
+}
+
+
+/**
+  * @brief  Remaining length through MQTTPacket_decodeLen.
+  * @param buf: Packet
+  * @param len: Length of packet
+  * @retval Remaining length
+  */
+static int bench_DecodeDirect(unsigned char *buf, int len)
+{
+	unsigned char *ptr = buf + 1;
+	int value;
+
+	MQTTPacket_decodeLen(&ptr, buf + len, &value);
+	return value;
+}
+
+
+/**
+  * @brief  Full deserialization of a packet, the way the client reads what the broker sent.
+  * @param buf: Packet
+  * @param len: Length of packet
+  * @retval 1 if the packet was deserialized
+  */
+static int bench_Deserialize(unsigned char *buf, int len)
+{
+	unsigned char dup, retained, type, sessionPresent, connackRc;
+	unsigned short packetId;
+	MQTTString topic;
+	unsigned char *payload;
+	int qos, payloadLen, count, granted[4];
+
+	switch (buf[0] >> 4)
+	{
+	case PUBLISH:
+		return MQTTDeserialize_publish(&dup, &qos, &retained, &packetId, &topic, &payload, &payloadLen, buf, len);
+
+	case CONNACK:
+		return MQTTDeserialize_connack(&sessionPresent, &connackRc, buf, len);
+
+	case SUBACK:
+		return MQTTDeserialize_suback(&packetId, 4, &count, granted, buf, len);
+
+	default:
+		return MQTTDeserialize_ack(&type, &dup, &packetId, buf, len);
+	}
+}
+
+
+/**
+  * @brief  CONNECT of the client with user name and password.
+  * @param out: Output buffer of BENCH_PACKET_SIZE bytes
+  * @param i: Packet number
+  * @param mode: Serializer
+  * @param packet: Returns the start of the packet in out
+  * @retval Length of packet
+  */
+static int bench_Connect(unsigned char *out, int i, BENCH_ModeTypeDef mode, unsigned char **packet)
+{
+	MQTTPacket_connectData options = MQTTPacket_connectData_initializer;
+
+	options.clientID.cstring = "NucleoF030R8";
+	options.username.cstring = "nucleo";
+	options.password.cstring = "secret";
+	options.keepAliveInterval = 60 + i;
+	*packet = out;
+
+	switch (mode)
+	{
+	case BENCH_TWO_PASS:
+		return MQTTSerialize_connect(out, BENCH_PACKET_SIZE, &options);
+	case BENCH_SINGLE_PASS:
+		return MQTTSerialize_connectSinglePass(out, BENCH_PACKET_SIZE, &options, packet);
+	default:
+		return MQTTSerialize_connectSinglePass(out, BENCH_PACKET_SIZE, &options, NULL);
+	}
+}
+
+
+/**
+  * @brief  PUBLISH with the payload lengths of the packet mix, QoS 0 and 1.
+  * @param out: Output buffer of BENCH_PACKET_SIZE bytes
+  * @param i: Packet number
+  * @param mode: Serializer
+  * @param packet: Returns the start of the packet in out
+  * @retval Length of packet
+  */
+static int bench_Publish(unsigned char *out, int i, BENCH_ModeTypeDef mode, unsigned char **packet)
+{
+	MQTTString topic = MQTTString_initializer;
+	int payloadLen = bench_PayloadLens[i & 3];
+
+	topic.cstring = BENCH_TOPIC;
+	*packet = out;
+
+	switch (mode)
+	{
+	case BENCH_TWO_PASS:
+		return MQTTSerialize_publish(out, BENCH_PACKET_SIZE, 0, i & 1, 0, 10 + i, topic, bench_Payload, payloadLen);
+	case BENCH_SINGLE_PASS:
+		return MQTTSerialize_publishSinglePass(out, BENCH_PACKET_SIZE, 0, i & 1, 0, 10 + i, topic, bench_Payload, payloadLen, packet);
+	default:
+		return MQTTSerialize_publishSinglePass(out, BENCH_PACKET_SIZE, 0, i & 1, 0, 10 + i, topic, bench_Payload, payloadLen, NULL);
+	}
+}
+
+
+/**
+  * @brief  SUBSCRIBE to two topic filters.
+  * @param out: Output buffer of BENCH_PACKET_SIZE bytes
+  * @param i: Packet number
+  * @param mode: Serializer
+  * @param packet: Returns the start of the packet in out
+  * @retval Length of packet
+  */
+static int bench_Subscribe(unsigned char *out, int i, BENCH_ModeTypeDef mode, unsigned char **packet)
+{
+	MQTTString topics[2] = { MQTTString_initializer, MQTTString_initializer };
+	int qoss[2] = { 0, 1 };
+
+	topics[0].cstring = "NucleoButton/cmd";
+	topics[1].cstring = "NucleoButton/config/#";
+	*packet = out;
+
+	switch (mode)
+	{
+	case BENCH_TWO_PASS:
+		return MQTTSerialize_subscribe(out, BENCH_PACKET_SIZE, 0, 20 + i, 2, topics, qoss);
+	case BENCH_SINGLE_PASS:
+		return MQTTSerialize_subscribeSinglePass(out, BENCH_PACKET_SIZE, 0, 20 + i, 2, topics, qoss, packet);
+	default:
+		return MQTTSerialize_subscribeSinglePass(out, BENCH_PACKET_SIZE, 0, 20 + i, 2, topics, qoss, NULL);
+	}
+}
+
+
+static const struct {
+	const char *name;
+	BENCH_SerializeTypeDef func;
+} bench_Serializers[] = {
+	{ "CONNECT", bench_Connect },
+	{ "PUBLISH", bench_Publish },
+	{ "SUBSCRIBE", bench_Subscribe },
+};
+
+
+/**
+  * @brief  Topic of a received publish matched with MQTTPacket_equals, which measures each
+  *         subscribed topic again.
+  * @param i: Packet number
+  * @retval Index of the topic
+  */
+static int bench_MatchEquals(int i)
+{
+	int k;
+
+	for (k = 0; k < 4; k++)
+		if (MQTTPacket_equals(&bench_Received[i], bench_TopicNames[k]))
+			return k;
+	return -1;
+}
+
+
+/**
+  * @brief  Topic of a received publish matched with MQTTTopic_find over the descriptors.
+  * @param i: Packet number
+  * @retval Index of the topic
+  */
+static int bench_MatchTopic(int i)
+{
+	return MQTTTopic_find(bench_Topics, 4, &bench_Received[i]);
+}
+
+
+/**
+  * @brief  PUBLISH of a C string topic, measured twice.
+  * @param i: Packet number
+  * @retval Length of packet
+  */
+static int bench_PublishString(int i)
+{
+	static unsigned char out[BENCH_PACKET_SIZE];
+	MQTTString topic = MQTTString_initializer;
+
+	topic.cstring = BENCH_TOPIC;
+	return MQTTSerialize_publish(out, BENCH_PACKET_SIZE, 0, 0, 0, 0, topic, bench_Payload, bench_PayloadLens[i & 3]);
+}
+
+
+/**
+  * @brief  PUBLISH of a topic descriptor with length prefix, written in place.
+  * @param i: Packet number
+  * @retval Length of packet
+  */
+static int bench_PublishTopic(int i)
+{
+	static unsigned char out[BENCH_PACKET_SIZE];
+
+	return MQTTSerialize_publishTopic(out, BENCH_PACKET_SIZE, 0, 0, 0, 0, &bench_TopicStatePrefixed, bench_Payload, bench_PayloadLens[i & 3]);
+}
+
+
+/**
+  * @brief  Function to batch QoS 1 publishes for the four topics like mqtt_BatchPublish: a
+  *         block is sent once it is filled to the threshold or the next packet does not fit.
+  * @param n: Number of publishes
+  * @param out: Blocks in sending order
+  * @param blockLens: Returns the length of each block
+  * @param blocks: Number of blocks
+  * @retval Bytes of all blocks, -1 if a publish did not fit into a block
+  */
+static int bench_BatchPack(int n, unsigned char *out, int *blockLens, int *blocks)
+{
+	unsigned char block[BENCH_BATCH_BLOCK];
+	int i, tries, packetLen = 0, fill = 0, len = 0;
+
+	*blocks = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		for (tries = 0; tries < 2; tries++)
+		{
+			packetLen = MQTTSerialize_publishTopic(block + fill, BENCH_BATCH_BLOCK - fill, 0, 1, 0, i + 1, bench_Topics[i & 3],
+					(const unsigned char*) BENCH_BATCH_PAYLOAD, strlen(BENCH_BATCH_PAYLOAD));
+
+			if (packetLen > 0 || fill == 0)
+				break;
+
+			memcpy(out + len, block, fill);
+			len += fill;
+			blockLens[(*blocks)++] = fill;
+			fill = 0;
+		}
+
+		if (packetLen <= 0)
+			return -1;
+
+		fill += packetLen;
+
+		if (fill >= BENCH_BATCH_THRESHOLD || i == n - 1)
+		{
+			memcpy(out + len, block, fill);
+			len += fill;
+			blockLens[(*blocks)++] = fill;
+			fill = 0;
+		}
+	}
+
+	return len;
+}
+
+
+/**
+  * @brief  Function to get the air time of a frame and the channel access around it.
+  * @param bytes: MPDU length
+  * @retval us on air
+  */
+static double bench_AirFrame(int bytes)
+{
+	int symbols = (BENCH_AIR_SERVICE_BITS + 8 * bytes + BENCH_AIR_SYMBOL_BITS - 1) / BENCH_AIR_SYMBOL_BITS;
+
+	return BENCH_AIR_PREAMBLE_US + symbols * BENCH_AIR_SYMBOL_US + BENCH_AIR_ACCESS_US;
+}
+
+
+/**
+  * @brief  Function to fill the packet mix: acknowledgements with a 1 byte length and
+  *         publishes with 1 and 2 byte lengths.
+  * @retval None
+  */
+static void bench_BuildPackets(void)
+{
+	MQTTString topic = MQTTString_initializer;
+	unsigned char dup, retained, *data;
+	unsigned short packetId;
+	int granted = 1, qos, dataLen;
+	int i = 0, j;
+
+	memset(bench_Payload, 'x', sizeof(bench_Payload));
+	topic.cstring = BENCH_TOPIC;
+
+	for (j = 0; j < 4; j++, i++)
+		bench_Packets[i].len = MQTTSerialize_publish(bench_Packets[i].buf, BENCH_PACKET_SIZE, 0, j & 1, 0, 10 + j, topic, bench_Payload, bench_PayloadLens[j]);
+
+	bench_Packets[i].len = MQTTSerialize_connack(bench_Packets[i].buf, BENCH_PACKET_SIZE, 0, 1);
+	i++;
+	bench_Packets[i].len = MQTTSerialize_puback(bench_Packets[i].buf, BENCH_PACKET_SIZE, 11);
+	i++;
+	bench_Packets[i].len = MQTTSerialize_pubcomp(bench_Packets[i].buf, BENCH_PACKET_SIZE, 12);
+	i++;
+	bench_Packets[i].len = MQTTSerialize_suback(bench_Packets[i].buf, BENCH_PACKET_SIZE, 13, 1, &granted);
+
+	for (i = 0; i < BENCH_PACKETS; i++)
+	{
+		if (bench_Packets[i].len <= 0)
+		{
+			fprintf(stderr, "packet %d could not be serialized\n", i);
+			exit(1);
+		}
+	}
+
+	// Topics of the publishes as deserialized, in place in the packet
+	for (i = 0; i < BENCH_PACKETS; i++)
+		MQTTDeserialize_publish(&dup, &qos, &retained, &packetId, &bench_Received[i], &data, &dataLen,
+				bench_Packets[i & 3].buf, bench_Packets[i & 3].len);
+}
+
+
+/**
+  * @brief  Function to run a workload over the packet mix and print its time per packet.
+  * @param name: Name of the workload
+  * @param func: Called once per packet
+  * @retval ns per packet
+  */
+static double bench_Run(const char *name, BENCH_FuncTypeDef func)
+{
+	struct timespec start, end;
+	double ns;
+	int round, i, sum = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (round = 0; round < BENCH_ROUNDS; round++)
+		for (i = 0; i < BENCH_PACKETS; i++)
+			sum += func(bench_Packets[i].buf, bench_Packets[i].len);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	bench_Sink = sum;
+
+	ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ((double) BENCH_ROUNDS * BENCH_PACKETS);
+	printf("%-32s %8.2f ns/packet\n", name, ns);
+
+	return ns;
+}
+
+
+/**
+  * @brief  Function to run a topic workload for as many packets as bench_Run and print its time per packet.
+  * @param name: Name of the workload
+  * @param func: Called with the packet number
+  * @retval ns per packet
+  */
+static double bench_RunTopic(const char *name, int (*func)(int i))
+{
+	struct timespec start, end;
+	double ns;
+	int round, i, sum = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (round = 0; round < BENCH_ROUNDS; round++)
+		for (i = 0; i < BENCH_PACKETS; i++)
+			sum += func(i);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	bench_Sink = sum;
+
+	ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ((double) BENCH_ROUNDS * BENCH_PACKETS);
+	printf("%-32s %8.2f ns/packet\n", name, ns);
+
+	return ns;
+}
+
+
+/**
+  * @brief  Function to run a serializer for as many packets as bench_Run and print its time per packet.
+  * @param name: Name of the packet type
+  * @param func: Serializer
+  * @param mode: Variant of the serializer
+  * @retval ns per packet
+  */
+static double bench_RunSerialize(const char *name, BENCH_SerializeTypeDef func, BENCH_ModeTypeDef mode)
+{
+	static unsigned char out[BENCH_PACKET_SIZE];
+	struct timespec start, end;
+	unsigned char *packet;
+	char label[48];
+	double ns;
+	int round, i, sum = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (round = 0; round < BENCH_ROUNDS; round++)
+		for (i = 0; i < BENCH_PACKETS; i++)
+			sum += func(out, i, mode, &packet) + packet[1];
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	bench_Sink = sum;
+
+	ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / ((double) BENCH_ROUNDS * BENCH_PACKETS);
+	snprintf(label, sizeof(label), "%s, %s", name, bench_ModeNames[mode]);
+	printf("%-32s %8.2f ns/packet\n", label, ns);
+
+	return ns;
+}
+
+
+/**
+  * @brief  Function to print bytes and air time per publish for batch sizes up to BENCH_BATCH_MAX.
+  *         Each block is counted as its own TCP segment. The module may merge blocks reaching it
+  *         within its packetizer gap, nothing guarantees that, so the gain is the lower bound.
+  *         Each segment is acknowledged by a TCP segment of the broker.
+  * @retval 0 if the publishes of every batch could be read back
+  */
+static int bench_RunBatch(void)
+{
+	static unsigned char out[BENCH_BATCH_MAX * BENCH_BATCH_BLOCK];
+	int blockLens[BENCH_BATCH_MAX];
+	unsigned char *ptr;
+	double air, single = 0;
+	int n, len, blocks, segments, seg, count, value;
+
+	printf("%-8s %6s %8s %11s %11s %11s %8s\n", "batch", "blocks", "segments", "MQTT B/msg", "wire B/msg", "air us/msg", "air gain");
+
+	for (n = 1; n <= BENCH_BATCH_MAX; n *= 2)
+	{
+		len = bench_BatchPack(n, out, blockLens, &blocks);
+
+		// Packets have to follow each other without gap
+		for (ptr = out, count = 0; len > 0 && ptr < out + len; count++)
+		{
+			ptr++;
+			if (MQTTPacket_decodeLen(&ptr, out + len, &value) == MQTTPACKET_READ_ERROR)
+				break;
+			ptr += value;
+		}
+
+		if (len <= 0 || count != n || ptr != out + len)
+		{
+			fprintf(stderr, "batch of %d publishes not read back\n", n);
+			return 1;
+		}
+
+		// One segment per block, see the check of BENCH_BATCH_BLOCK
+		segments = blocks;
+		air = 0;
+
+		for (seg = 0; seg < segments; seg++)
+			air += bench_AirFrame(blockLens[seg] + BENCH_AIR_HEADERS) + bench_AirFrame(BENCH_AIR_HEADERS);
+
+		air /= n;
+		if (n == 1)
+			single = air;
+
+		printf("%-8d %6d %8d %11.1f %11.1f %11.1f %7.1fx\n", n, blocks, segments, (double) len / n,
+				(double) (len + segments * BENCH_AIR_HEADERS) / n, air, single / air);
+	}
+
+	return 0;
+}
+
+
+/**
+  * @brief  Function to check that both decoders agree and reject a truncated length.
+  * @retval 0 if they do
+  */
+static int bench_Check(void)
+{
+	unsigned char truncated[] = { 0x30, 0x80, 0x80 };
+	unsigned char *ptr = &truncated[1];
+	int i, value;
+
+	for (i = 0; i < BENCH_PACKETS; i++)
+	{
+		if (bench_DecodeCallback(bench_Packets[i].buf, bench_Packets[i].len) != bench_DecodeDirect(bench_Packets[i].buf, bench_Packets[i].len)
+				|| bench_Deserialize(bench_Packets[i].buf, bench_Packets[i].len) != 1)
+		{
+			fprintf(stderr, "packet %d decoded differently\n", i);
+			return 1;
+		}
+	}
+
+	if (MQTTPacket_decodeLen(&ptr, truncated + sizeof(truncated), &value) != MQTTPACKET_READ_ERROR || ptr != &truncated[1])
+	{
+		fprintf(stderr, "truncated length not rejected\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/**
+  * @brief  Function to check that the single-pass serializers write the same bytes as the
+  *         two-pass ones and refuse a buffer that is one byte too short.
+  * @retval 0 if they do
+  */
+static int bench_CheckSerialize(void)
+{
+	unsigned char ref[BENCH_PACKET_SIZE], out[BENCH_PACKET_SIZE];
+	unsigned char *packet;
+	int s, i, mode, refLen, len;
+
+	for (s = 0; s < (int) (sizeof(bench_Serializers) / sizeof(bench_Serializers[0])); s++)
+	{
+		for (i = 0; i < BENCH_PACKETS; i++)
+		{
+			refLen = bench_Serializers[s].func(ref, i, BENCH_TWO_PASS, &packet);
+
+			for (mode = BENCH_SINGLE_PASS; mode < BENCH_MODES; mode++)
+			{
+				memset(out, 0xAA, sizeof(out));
+				len = bench_Serializers[s].func(out, i, mode, &packet);
+
+				if (refLen <= 0 || len != refLen || memcmp(packet, ref, len) != 0)
+				{
+					fprintf(stderr, "%s %d serialized differently by %s\n", bench_Serializers[s].name, i, bench_ModeNames[mode]);
+					return 1;
+				}
+			}
+		}
+	}
+
+	// Descriptor topics have to serialize like C string topics and hash like the compiler does
+	for (i = 0; i < BENCH_PACKETS; i++)
+	{
+		refLen = MQTTSerialize_publish(ref, BENCH_PACKET_SIZE, 0, 0, 0, 0, (MQTTString) { BENCH_TOPIC, { 0, NULL } },
+				bench_Payload, bench_PayloadLens[i & 3]);
+		len = MQTTSerialize_publishTopic(out, BENCH_PACKET_SIZE, 0, 0, 0, 0, &bench_TopicStatePrefixed,
+				bench_Payload, bench_PayloadLens[i & 3]);
+
+		if (len != refLen || memcmp(out, ref, len) != 0 || bench_MatchEquals(i) != 3 || bench_MatchTopic(i) != 3)
+		{
+			fprintf(stderr, "topic descriptor of publish %d differs\n", i);
+			return 1;
+		}
+
+		// Written in place, a buffer of exactly the packet length has to be enough
+		if (MQTTSerialize_publishTopic(out, refLen, 0, 0, 0, 0, &bench_TopicStatePrefixed, bench_Payload, bench_PayloadLens[i & 3]) != refLen
+				|| MQTTSerialize_publishTopic(out, refLen - 1, 0, 0, 0, 0, &bench_TopicStatePrefixed, bench_Payload,
+						bench_PayloadLens[i & 3]) != MQTTPACKET_BUFFER_TOO_SHORT)
+		{
+			fprintf(stderr, "bound of descriptor publish %d wrong\n", i);
+			return 1;
+		}
+	}
+
+	for (s = 0; s < 4; s++)
+	{
+		if (bench_Topics[s]->hash != MQTTTopic_hash(bench_TopicNames[s], strlen(bench_TopicNames[s])))
+		{
+			fprintf(stderr, "hash of %s differs\n", bench_TopicNames[s]);
+			return 1;
+		}
+	}
+
+	// The single-pass writer needs the header slot in front, so its bound is the slot plus the body
+	if (MQTTSerialize_publishSinglePass(out, MQTTPACKET_HEADER_SLOT + 3, 0, 1, 0, 1, (MQTTString) MQTTString_initializer,
+			bench_Payload, 0, &packet) != MQTTPACKET_BUFFER_TOO_SHORT)
+	{
+		fprintf(stderr, "short buffer not refused\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+
+int main(void)
+{
+	double callback, direct, twoPass, singlePass;
+	int s;
+
+	bench_BuildPackets();
+
+	if (bench_Check() != 0 || bench_CheckSerialize() != 0)
+		return 1;
+
+	printf("%d packets x %d rounds\n", BENCH_PACKETS, BENCH_ROUNDS);
+	callback = bench_Run("remaining length, callback", bench_DecodeCallback);
+	direct = bench_Run("remaining length, decodeLen", bench_DecodeDirect);
+	bench_Run("deserialize", bench_Deserialize);
+	printf("decodeLen speed-up %.1fx\n", callback / direct);
+
+	for (s = 0; s < (int) (sizeof(bench_Serializers) / sizeof(bench_Serializers[0])); s++)
+	{
+		twoPass = bench_RunSerialize(bench_Serializers[s].name, bench_Serializers[s].func, BENCH_TWO_PASS);
+		singlePass = bench_RunSerialize(bench_Serializers[s].name, bench_Serializers[s].func, BENCH_SINGLE_PASS);
+		bench_RunSerialize(bench_Serializers[s].name, bench_Serializers[s].func, BENCH_SINGLE_PASS_MOVED);
+		printf("%s single-pass speed-up %.2fx\n", bench_Serializers[s].name, twoPass / singlePass);
+	}
+
+	twoPass = bench_RunTopic("PUBLISH, C string topic", bench_PublishString);
+	singlePass = bench_RunTopic("PUBLISH, topic descriptor", bench_PublishTopic);
+	printf("PUBLISH descriptor speed-up %.2fx\n", twoPass / singlePass);
+	twoPass = bench_RunTopic("topic match, MQTTPacket_equals", bench_MatchEquals);
+	singlePass = bench_RunTopic("topic match, MQTTTopic_find", bench_MatchTopic);
+	printf("topic match speed-up %.2fx\n", twoPass / singlePass);
+
+	return bench_RunBatch();
+}
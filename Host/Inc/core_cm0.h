@@ -0,0 +1,90 @@
+/**
+  ************************************************************************************************
+  * @file           : core_cm0.h
+  * @brief          : Host replacement of the CMSIS Cortex-M0 core header.
+  *                   Provides the core register types as plain memory and the intrinsics as
+  *                   calls into the host shim, so the device header can be used unchanged.
+  ************************************************************************************************
+*/
+
+
+#ifndef __CORE_CM0_H
+#define __CORE_CM0_H
+
+
+#include <stdint.h>
+
+
+// Access qualifiers
+#define __I      volatile const
+#define __O      volatile
+#define __IO     volatile
+#define __IM     volatile const
+#define __OM     volatile
+#define __IOM    volatile
+
+#ifndef __STATIC_INLINE
+#define __STATIC_INLINE static inline
+#endif
+
+
+// Core registers used by the firmware
+typedef struct {
+	__IM uint32_t CPUID;
+	__IOM uint32_t ICSR;
+	uint32_t RESERVED0;
+	__IOM uint32_t AIRCR;
+	__IOM uint32_t SCR;
+	__IOM uint32_t CCR;
+	uint32_t RESERVED1;
+	__IOM uint32_t SHP[2U];
+	__IOM uint32_t SHCSR;
+} SCB_Type;
+
+typedef struct {
+	__IOM uint32_t CTRL;
+	__IOM uint32_t LOAD;
+	__IOM uint32_t VAL;
+	__IM uint32_t CALIB;
+} SysTick_Type;
+
+#define SCB_SCR_SLEEPONEXIT_Msk         (1UL << 1)
+#define SCB_SCR_SLEEPDEEP_Msk           (1UL << 2)
+#define SCB_SCR_SEVONPEND_Msk           (1UL << 4)
+
+#define SysTick_CTRL_ENABLE_Msk         (1UL << 0)
+#define SysTick_CTRL_TICKINT_Msk        (1UL << 1)
+#define SysTick_CTRL_CLKSOURCE_Msk      (1UL << 2)
+#define SysTick_CTRL_COUNTFLAG_Msk      (1UL << 16)
+#define SysTick_LOAD_RELOAD_Msk         (0xffffffUL)
+
+extern SCB_Type host_Scb;
+extern SysTick_Type host_SysTick;
+
+#define SCB        (&host_Scb)
+#define SysTick    (&host_SysTick)
+
+
+// Intrinsics, interrupts are delivered by the shim only while not masked
+extern void host_DisableIrq(void);
+extern void host_EnableIrq(void);
+extern uint32_t host_GetPrimask(void);
+extern void host_SetPrimask(uint32_t primask);
+extern void host_WaitForInterrupt(void);
+extern uint32_t host_GetIpsr(void);
+
+#define __disable_irq()       host_DisableIrq()
+#define __enable_irq()        host_EnableIrq()
+#define __get_PRIMASK()       host_GetPrimask()
+#define __set_PRIMASK(m)      host_SetPrimask(m)
+#define __get_IPSR()          host_GetIpsr()
+#define __WFI()               host_WaitForInterrupt()
+#define __WFE()               host_WaitForInterrupt()
+#define __SEV()               do { } while (0)
+#define __NOP()               do { } while (0)
+#define __DSB()               __sync_synchronize()
+#define __ISB()               __sync_synchronize()
+#define __DMB()               __sync_synchronize()
+
+
+#endif
@@ -0,0 +1,19 @@
+/**
+  ************************************************************************************************
+  * @file           : host_pty.h
+  * @brief          : Header for host_pty.c file.
+  *                   Kept apart from the HAL shim, termios.h defines names that clash with the
+  *                   register names of the device header.
+  ************************************************************************************************
+*/
+
+
+#ifndef __HOST_PTY_H
+#define __HOST_PTY_H
+
+
+// Function exports
+extern int host_OpenPty(const char *link, const char *sim, int *ctrl);
+
+
+#endif
@@ -0,0 +1,73 @@
+/**
+  ************************************************************************************************
+  * @file           : stm32f0xx.h
+  * @brief          : Host wrapper of the CMSIS device header.
+  *                   Types and bit definitions come from the real header, the peripheral
+  *                   pointers are redirected to plain memory owned by the host shim.
+  ************************************************************************************************
+*/
+
+
+#ifndef __HOST_STM32F0XX_H
+#define __HOST_STM32F0XX_H
+
+
+#include_next <stm32f0xx.h>
+
+
+// Peripherals simulated by Host/Src/hal_shim.c
+extern USART_TypeDef host_Usart[2];
+extern DMA_Channel_TypeDef host_DmaChannel[5];
+extern GPIO_TypeDef host_Gpio[6];
+extern RCC_TypeDef host_Rcc;
+extern PWR_TypeDef host_Pwr;
+extern EXTI_TypeDef host_Exti;
+extern TIM_TypeDef host_Tim[17];
+extern RCC_TypeDef *host_RccSync(void);
+extern RTC_TypeDef *host_RtcSync(void);
+extern TIM_TypeDef *host_TimSync(uint8_t n);
+
+#undef USART1
+#undef USART2
+#undef DMA1_Channel1
+#undef DMA1_Channel2
+#undef DMA1_Channel3
+#undef DMA1_Channel4
+#undef DMA1_Channel5
+#undef GPIOA
+#undef GPIOB
+#undef GPIOC
+#undef GPIOD
+#undef GPIOF
+#undef RCC
+#undef PWR
+#undef EXTI
+#undef RTC
+#undef TIM3
+#undef TIM14
+#undef TIM16
+
+#define USART1           (&host_Usart[0])
+#define USART2           (&host_Usart[1])
+#define DMA1_Channel1    (&host_DmaChannel[0])
+#define DMA1_Channel2    (&host_DmaChannel[1])
+#define DMA1_Channel3    (&host_DmaChannel[2])
+#define DMA1_Channel4    (&host_DmaChannel[3])
+#define DMA1_Channel5    (&host_DmaChannel[4])
+#define GPIOA            (&host_Gpio[0])
+#define GPIOB            (&host_Gpio[1])
+#define GPIOC            (&host_Gpio[2])
+#define GPIOD            (&host_Gpio[3])
+#define GPIOF            (&host_Gpio[5])
+#define PWR              (&host_Pwr)
+#define EXTI             (&host_Exti)
+
+// Status bits of these are set by the hardware, every access updates them first
+#define RCC              (host_RccSync())
+#define RTC              (host_RtcSync())
+#define TIM3             (host_TimSync(3))
+#define TIM14            (host_TimSync(14))
+#define TIM16            (host_TimSync(16))
+
+
+#endif
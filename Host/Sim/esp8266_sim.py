@@ -0,0 +1,711 @@
+#!/usr/bin/env python3
+"""
+ESP8266 AT firmware simulator for the host build of the firmware (Host/Makefile).
+
+Speaks the AT subset used by Core/Src/esp8266.c on a pseudo terminal: the
+"ready" banner after reset, AT, ATE0/1, AT+RST, CWMODE, CWAUTOCONN, CWJAP,
+CWDHCP, CIPSTA?, CIPSTATUS, CIPMUX, CIPMODE, CIPSTART, CIPSEND, CIPCLOSE,
+SLEEP, GSLP, UART and "+++". Transparent transmission is bridged to a real TCP
+socket, by default to a loopback MQTT broker built into this script.
+
+Module latencies come from a JSON profile (see Host/Sim/profiles) so the
+connect path can be benchmarked reproducibly:
+
+    boot_ms           reset until "ready"
+    ap_join_ms        CWJAP until "WIFI CONNECTED"
+    dhcp_ms           "WIFI CONNECTED" until "WIFI GOT IP"
+    tcp_connect_ms    CIPSTART until "CONNECT"
+    latency_ms        {"default": ms, "<CMD>": ms} before an answer starts
+    jitter_ms         random extra latency 0..jitter_ms per answer
+    inject            {"<CMD>": {"fail": p, "busy": p, "drop": p, "disconnect": p}},
+                      "disconnect" loses the AP instead of answering, auto connect
+                      joins it again after ap_join_ms. "PUBLISH": {"drop": p} makes the
+                      broker leave a QoS 1/2 publish unacknowledged.
+    seed              seed of the random generator used for jitter and inject
+    ssid, password    credentials the AP accepts, null accepts any
+    max_baud          highest UART rate that still works, e.g. limited by the wiring
+    server            "broker" (default), "direct" or "host:port" to connect to
+
+<CMD> is the command without "AT+" and "_CUR"/"_DEF", e.g. "CWJAP".
+
+Started by the host build, the simulator gets a control socket in HOST_CTRL_FD.
+Latencies are then announced to the shim, which lets the virtual time pass,
+instead of being slept, and the module reset line is followed. Standalone, e.g.
+on a tty of socat, latencies are slept in real time.
+
+Usage:
+    esp8266_sim.py [--profile FILE] [--broker-port N] [--verbose] PTY
+    make -C Host run SIM="python3 Sim/esp8266_sim.py --profile Sim/profiles/default.json"
+"""
+
+import argparse
+import json
+import os
+import random
+import select
+import socket
+import struct
+import sys
+import time
+import tty
+
+DEFAULT_PROFILE = {
+    "boot_ms": 300,
+    "ap_join_ms": 2500,
+    "dhcp_ms": 800,
+    "tcp_connect_ms": 150,
+    "latency_ms": {"default": 5},
+    "jitter_ms": 0,
+    "inject": {},
+    "seed": 1,
+    "ssid": None,
+    "password": None,
+    "server": "broker",
+    "max_baud": 4608000,
+}
+
+STATUS_GOT_IP = 2
+STATUS_CONNECTED = 3
+STATUS_DISCONNECTED = 4
+STATUS_NO_AP = 5
+
+
+def log(verbose, fmt, *args):
+    """Prints a trace line to stderr, stdout belongs to the firmware."""
+    if verbose:
+        sys.stderr.write("[sim] " + (fmt % args) + "\n")
+        sys.stderr.flush()
+
+
+def load_profile(path):
+    """Returns the profile of a JSON file merged over the defaults."""
+    profile = dict(DEFAULT_PROFILE)
+    if path:
+        with open(path) as f:
+            profile.update(json.load(f))
+    return profile
+
+
+class Host:
+    """Link to the HAL shim of the host build, falls back to real time without it."""
+
+    def __init__(self, pending):
+        fd = os.environ.get("HOST_CTRL_FD")
+        self.ctrl = socket.socket(fileno=int(fd)) if fd else None
+        self.lines = b""
+        self.resets = 0
+        self.pending = pending
+        self.start = time.monotonic()
+        if self.ctrl:
+            self.ctrl.sendall(b"hello\n")
+
+    def _request(self, line, reply):
+        """Sends a request to the shim and waits for its reply, keeps draining the pty meanwhile."""
+        self.ctrl.sendall(line + b"\n")
+        while True:
+            while b"\n" in self.lines:
+                msg, self.lines = self.lines.split(b"\n", 1)
+                if msg.startswith(reply):
+                    return msg[len(reply):].strip()
+                self.event(msg)
+            if self.pending.poll_pty(self.ctrl):
+                self.read()
+
+    def read(self):
+        """Appends what the shim sent to the received lines, ends with the host build."""
+        try:
+            data = self.ctrl.recv(256, socket.MSG_DONTWAIT)
+        except BlockingIOError:
+            return
+        if data == b"":
+            sys.exit(0)
+        self.lines += data
+
+    def event(self, msg):
+        """Handles a line the shim sent on its own."""
+        if msg == b"reset":
+            self.resets += 1
+        elif msg.startswith(b"baud "):
+            self.pending.host_baud = int(msg[5:])
+
+    def read_events(self):
+        """Handles the lines the shim sent while the simulator was idle."""
+        self.read()
+        while b"\n" in self.lines:
+            msg, self.lines = self.lines.split(b"\n", 1)
+            self.event(msg)
+
+    def delay(self, ms):
+        """Lets ms of module time pass."""
+        if ms <= 0:
+            return
+        if self.ctrl:
+            self._request(b"delay %d" % ms, b"ok")
+        else:
+            time.sleep(ms / 1000.0)
+
+    def now(self):
+        """Returns the ms since start, virtual when run by the host build."""
+        if self.ctrl:
+            return int(self._request(b"time", b"time "))
+        return int((time.monotonic() - self.start) * 1000)
+
+
+class Broker:
+    """Minimal MQTT 3.1.1 broker on the loopback interface, answers everything the client expects."""
+
+    def __init__(self, port, profile, verbose):
+        self.listen = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listen.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listen.bind(("127.0.0.1", port))
+        self.listen.listen(4)
+        self.port = self.listen.getsockname()[1]
+        self.clients = {}
+        self.sessions = set()
+        self.verbose = verbose
+        self.drop_ack = profile["inject"].get("PUBLISH", {}).get("drop", 0)
+        self.random = random.Random(profile["seed"] + 1)
+        self.stats = {"connects": 0, "publishes": 0, "pings": 0, "dropped": 0}
+
+    def sockets(self):
+        return [self.listen] + list(self.clients)
+
+    def handle(self, sock):
+        """Serves a readable socket of the broker."""
+        if sock is self.listen:
+            conn, _ = self.listen.accept()
+            self.clients[conn] = {"buf": b"", "subs": [], "id": None}
+            return
+
+        client = self.clients[sock]
+        try:
+            data = sock.recv(4096)
+        except ConnectionError:
+            data = b""
+        if not data:
+            self.drop(sock)
+            return
+
+        client["buf"] += data
+        while True:
+            packet = self.split(client)
+            if packet is None:
+                break
+            if not self.serve(sock, client, *packet):
+                self.drop(sock)
+                break
+
+    def drop(self, sock):
+        self.clients.pop(sock, None)
+        sock.close()
+
+    @staticmethod
+    def split(client):
+        """Returns (type, flags, body) of the next complete packet in the buffer."""
+        buf = client["buf"]
+        length, mult, pos = 0, 1, 1
+        while True:
+            if pos >= len(buf):
+                return None
+            length += (buf[pos] & 0x7F) * mult
+            mult *= 128
+            pos += 1
+            if not buf[pos - 1] & 0x80:
+                break
+        if len(buf) < pos + length:
+            return None
+        client["buf"] = buf[pos + length:]
+        return buf[0] >> 4, buf[0] & 0x0F, buf[pos:pos + length]
+
+    @staticmethod
+    def string(body, pos):
+        n, = struct.unpack_from(">H", body, pos)
+        return body[pos + 2:pos + 2 + n], pos + 2 + n
+
+    @staticmethod
+    def matches(pattern, topic):
+        p, t = pattern.split(b"/"), topic.split(b"/")
+        for i, level in enumerate(p):
+            if level == b"#":
+                return True
+            if i >= len(t) or (level != b"+" and level != t[i]):
+                return False
+        return len(p) == len(t)
+
+    def serve(self, sock, client, ptype, flags, body):
+        """Answers one packet, returns False if the connection ends."""
+        if ptype == 1:                      # CONNECT
+            _, pos = self.string(body, 0)
+            clean = body[pos + 1] & 0x02
+            client["id"], _ = self.string(body, pos + 4)
+            present = 1 if not clean and client["id"] in self.sessions else 0
+            if not clean:
+                self.sessions.add(client["id"])
+            self.stats["connects"] += 1
+            log(self.verbose, "broker: CONNECT %s", client["id"].decode(errors="replace"))
+            sock.sendall(bytes([0x20, 2, present, 0]))
+        elif ptype == 3:                    # PUBLISH
+            qos = (flags >> 1) & 3
+            topic, pos = self.string(body, 0)
+            packet_id = body[pos:pos + 2]
+            payload = body[pos + (2 if qos else 0):]
+            self.stats["publishes"] += 1
+            log(self.verbose, "broker: PUBLISH %s %r qos %d dup %d", topic.decode(errors="replace"), payload, qos, flags >> 3)
+            if qos and self.random.random() < self.drop_ack:
+                self.stats["dropped"] += 1
+                log(self.verbose, "broker: PUBLISH not acknowledged")
+            elif qos == 1:
+                sock.sendall(b"\x40\x02" + packet_id)
+            elif qos == 2:
+                sock.sendall(b"\x50\x02" + packet_id)
+            for other, c in self.clients.items():
+                if any(self.matches(s, topic) for s in c["subs"]):
+                    out = bytes([0x30]) + self.remaining(2 + len(topic) + len(payload))
+                    other.sendall(out + struct.pack(">H", len(topic)) + topic + payload)
+        elif ptype == 6:                    # PUBREL
+            sock.sendall(b"\x70\x02" + body[:2])
+        elif ptype == 8:                    # SUBSCRIBE
+            pos, granted = 2, b""
+            while pos < len(body):
+                topic, pos = self.string(body, pos)
+                client["subs"].append(topic)
+                granted += b"\x00"
+                pos += 1
+            sock.sendall(bytes([0x90]) + self.remaining(2 + len(granted)) + body[:2] + granted)
+        elif ptype == 10:                   # UNSUBSCRIBE
+            sock.sendall(b"\xb0\x02" + body[:2])
+        elif ptype == 12:                   # PINGREQ
+            self.stats["pings"] += 1
+            sock.sendall(b"\xd0\x00")
+        elif ptype == 14:                   # DISCONNECT
+            log(self.verbose, "broker: DISCONNECT")
+            return False
+        return True
+
+    @staticmethod
+    def remaining(n):
+        out = b""
+        while True:
+            byte, n = n % 128, n // 128
+            out += bytes([byte | (0x80 if n else 0)])
+            if not n:
+                return out
+
+
+class Module:
+    """State of the simulated ESP8266 and its AT command interpreter."""
+
+    def __init__(self, pty, profile, broker, verbose):
+        self.pty = pty
+        self.profile = profile
+        self.broker = broker
+        self.verbose = verbose
+        self.random = random.Random(profile["seed"])
+        self.input = b""
+        self.pty_buf = b""
+        self.host = Host(self)
+        # Settings kept in flash by the _DEF commands
+        self.stored_ap = None
+        self.autoconn = True
+        self.mode = 1
+        self.stored_baud = 115200
+        # Rate of USART1, told by the shim
+        self.host_baud = 115200
+        self.sock = None
+        self.boot()
+
+    # Output
+
+    def link_ok(self):
+        """Returns False while module and USART1 use different rates or the rate is too high."""
+        return self.baud == self.host_baud and self.baud <= self.profile["max_baud"]
+
+    def write(self, data):
+        if not self.link_ok():
+            data = b"\xf8" * len(data)
+        os.write(self.pty, data)
+
+    def answer(self, text, ms=0):
+        """Sends text to the firmware after ms of module time."""
+        self.host.delay(ms)
+        if text:
+            log(self.verbose, "< %r", text)
+            self.write(text)
+
+    def poll_pty(self, ctrl):
+        """Keeps the pty drained while waiting for the shim, returns True if the shim answered."""
+        r, _, _ = select.select([self.pty, ctrl], [], [])
+        if self.pty in r:
+            self.pty_buf += os.read(self.pty, 4096)
+        return ctrl in r
+
+    # Module states
+
+    def boot(self):
+        """Starts the firmware of the module as after power on or reset."""
+        self.close(quiet=True)
+        self.echo = True
+        self.baud = self.stored_baud
+        self.cipmode = 0
+        self.trans = False
+        self.sleep = 0
+        self.deep = False
+        self.input = b""
+        self.pty_buf = b""
+        self.ap = None
+        self.ip_at = None
+        self.joined_at = None
+        self.announced = 0
+        self.answer(bytes(self.random.randrange(256) for _ in range(16)) + b"\r\nready\r\n",
+                    self.profile["boot_ms"])
+        if self.autoconn and self.stored_ap:
+            now = self.host.now()
+            self.ap = self.stored_ap
+            self.joined_at = now + self.profile["ap_join_ms"]
+            self.ip_at = self.joined_at + self.profile["dhcp_ms"]
+
+    def link_state(self, now):
+        """Returns the CIPSTATUS code, reports an auto join finished by now."""
+        if self.ap is None or self.joined_at is None or now < self.joined_at:
+            return STATUS_NO_AP
+        if self.announced < 1:
+            self.answer(b"WIFI CONNECTED\r\n")
+            self.announced = 1
+        if now < self.ip_at:
+            return STATUS_NO_AP
+        if self.announced < 2:
+            self.answer(b"WIFI GOT IP\r\n")
+            self.announced = 2
+        return STATUS_CONNECTED if self.sock else STATUS_GOT_IP
+
+    def close(self, quiet=False):
+        if self.sock:
+            self.sock.close()
+            self.sock = None
+            if not quiet:
+                self.answer(b"CLOSED\r\n")
+        self.trans = False
+
+    def server(self, host, port):
+        """Returns the address CIPSTART connects to."""
+        target = self.profile["server"]
+        if target == "broker":
+            return ("127.0.0.1", self.broker.port)
+        if target == "direct":
+            return (host, port)
+        h, p = target.rsplit(":", 1)
+        return (h, int(p))
+
+    # Input
+
+    def receive(self, data):
+        """Handles bytes written by the firmware."""
+        if self.deep:
+            return
+        if self.host.ctrl:
+            self.host.read_events()
+        if not self.link_ok():
+            log(self.verbose, "garbled at %d baud, USART1 at %d", self.baud, self.host_baud)
+            return
+        if self.trans:
+            # "+++" alone after the guard time ends transparent transmission. Time of the host
+            # may be skipped during the guard, so the last packet can arrive in the same read.
+            end = data.rfind(b"+++")
+            if end < 0 or not (data[end + 3:] == b"" or data[end + 3:].startswith(b"AT")):
+                if self.sock:
+                    self.sock.sendall(data)
+                return
+            if end > 0 and self.sock:
+                self.sock.sendall(data[:end])
+            log(self.verbose, "> +++")
+            self.trans = False
+            data = data[end + 3:]
+        # Echo is per character, like the UART of the module
+        if self.echo:
+            self.write(data)
+        self.input += data
+        while True:
+            end = self.input.find(b"\n")
+            if end < 0:
+                return
+            line, self.input = self.input[:end].rstrip(b"\r"), self.input[end + 1:]
+            # Anything before the "AT" of a line, e.g. "+++" outside transparent mode, is skipped
+            if b"AT" in line:
+                line = line[line.find(b"AT"):]
+            if line:
+                self.command(line.decode(errors="replace"))
+            if self.trans or self.deep:
+                if self.input and not self.deep:
+                    rest, self.input = self.input, b""
+                    self.receive(rest)
+                return
+
+    def key(self, cmd):
+        """Returns the name of a command used in the profile, e.g. CWJAP for AT+CWJAP_DEF=..."""
+        name = cmd[3:] if cmd.startswith("AT+") else cmd
+        for sep in "=?":
+            name = name.split(sep)[0]
+        for suffix in ("_CUR", "_DEF"):
+            if name.endswith(suffix):
+                name = name[:-len(suffix)]
+        return name
+
+    def latency(self, key):
+        lat = self.profile["latency_ms"]
+        jitter = self.profile["jitter_ms"]
+        return lat.get(key, lat.get("default", 0)) + (self.random.randint(0, jitter) if jitter else 0)
+
+    def command(self, cmd):
+        key = self.key(cmd)
+        log(self.verbose, "> %s", cmd)
+
+        inject = self.profile["inject"].get(key, {})
+        roll = self.random.random()
+        for kind in ("drop", "busy", "fail", "disconnect"):
+            p = inject.get(kind, 0)
+            if roll < p:
+                log(self.verbose, "inject %s on %s", kind, key)
+                if kind == "busy":
+                    self.answer(b"busy p...\r\n", self.latency(key))
+                elif kind == "fail":
+                    self.answer(b"\r\nFAIL\r\n" if key == "CWJAP" else b"\r\nERROR\r\n", self.latency(key))
+                elif kind == "disconnect":
+                    self.close()
+                    self.answer(b"WIFI DISCONNECT\r\n", self.latency(key))
+                    if self.ap and self.autoconn:
+                        self.joined_at = self.host.now() + self.profile["ap_join_ms"]
+                        self.ip_at = self.joined_at + self.profile["dhcp_ms"]
+                        self.announced = 0
+                return
+            roll -= p
+
+        handler = getattr(self, "cmd_" + key.replace("+", "_"), None)
+        arg = cmd.split("=", 1)[1] if "=" in cmd else None
+        query = cmd.endswith("?")
+        if key == "AT":
+            self.answer(b"\r\nOK\r\n", self.latency(key))
+        elif key in ("ATE0", "ATE1"):
+            self.echo = key == "ATE1"
+            self.answer(b"\r\nOK\r\n", self.latency(key))
+        elif handler is None:
+            self.answer(b"\r\nERROR\r\n", self.latency(key))
+        else:
+            self.host.delay(self.latency(key))
+            handler(arg, query, cmd)
+
+    # Commands, named cmd_<KEY>
+
+    def cmd_RST(self, arg, query, cmd):
+        self.answer(b"\r\nOK\r\n")
+        self.boot()
+
+    def cmd_GMR(self, arg, query, cmd):
+        self.answer(b"AT version:1.2.0.0(simulated)\r\nSDK version:2.0.0\r\n\r\nOK\r\n")
+
+    def cmd_CWMODE(self, arg, query, cmd):
+        if query:
+            self.answer(b"+CWMODE_CUR:%d\r\n\r\nOK\r\n" % self.mode)
+            return
+        self.mode = int(arg)
+        self.answer(b"\r\nOK\r\n")
+
+    def cmd_CWAUTOCONN(self, arg, query, cmd):
+        self.autoconn = arg == "1"
+        self.answer(b"\r\nOK\r\n")
+
+    def cmd_CWDHCP(self, arg, query, cmd):
+        self.answer(b"\r\nOK\r\n")
+
+    def cmd_CIPMUX(self, arg, query, cmd):
+        self.answer(b"link is builded\r\n\r\nERROR\r\n" if self.sock else b"\r\nOK\r\n")
+
+    def cmd_CIPMODE(self, arg, query, cmd):
+        self.cipmode = int(arg)
+        self.answer(b"\r\nOK\r\n")
+
+    def cmd_UART(self, arg, query, cmd):
+        try:
+            fields = [int(f) for f in arg.split(",")]
+            baud, flow = fields[0], fields[4]
+        except (AttributeError, ValueError, IndexError):
+            baud, flow = 0, 0
+        if not 110 <= baud <= 4608000 or not 0 <= flow <= 3:
+            self.answer(b"\r\nERROR\r\n")
+            return
+        # Answer still uses the old rate
+        self.answer(b"\r\nOK\r\n")
+        self.baud = baud
+        if "_DEF" in cmd:
+            self.stored_baud = baud
+
+    def cmd_CWJAP(self, arg, query, cmd):
+        now = self.host.now()
+        if query:
+            if self.link_state(now) != STATUS_NO_AP:
+                self.answer(b'+CWJAP_CUR:"%s","18:fe:34:00:00:01",6,-58\r\n\r\nOK\r\n' % self.ap.encode())
+            else:
+                self.answer(b"No AP\r\n\r\nOK\r\n")
+            return
+
+        ssid, _, password = arg.partition(",")
+        ssid, password = ssid.strip('"'), password.strip('"')
+        if self.mode not in (1, 3):
+            self.answer(b"\r\nERROR\r\n")
+            return
+        if self.ap and self.joined_at is not None and now >= self.joined_at:
+            self.answer(b"WIFI DISCONNECT\r\n")
+        self.close(quiet=True)
+        self.ap = None
+        if ((self.profile["ssid"] is not None and ssid != self.profile["ssid"]) or
+                (self.profile["password"] is not None and password != self.profile["password"])):
+            self.answer(b"+CWJAP:3\r\n\r\nFAIL\r\n", self.profile["ap_join_ms"])
+            return
+        if "_DEF" in cmd or "_" not in cmd.split("=")[0]:
+            self.stored_ap = ssid
+        self.answer(b"WIFI CONNECTED\r\n", self.profile["ap_join_ms"])
+        self.answer(b"WIFI GOT IP\r\n", self.profile["dhcp_ms"])
+        self.answer(b"\r\nOK\r\n")
+        self.ap = ssid
+        self.joined_at = self.ip_at = self.host.now()
+        self.announced = 2
+
+    def cmd_CIPSTA(self, arg, query, cmd):
+        if self.link_state(self.host.now()) == STATUS_NO_AP:
+            self.answer(b'+CIPSTA_CUR:ip:"0.0.0.0"\r\n\r\nOK\r\n')
+        else:
+            self.answer(b'+CIPSTA_CUR:ip:"192.168.1.50"\r\n+CIPSTA_CUR:gateway:"192.168.1.1"\r\n'
+                        b'+CIPSTA_CUR:netmask:"255.255.255.0"\r\n\r\nOK\r\n')
+
+    def cmd_CIPSTATUS(self, arg, query, cmd):
+        state = self.link_state(self.host.now())
+        text = b"STATUS:%d\r\n" % state
+        if state == STATUS_CONNECTED:
+            text += b'+CIPSTATUS:0,"TCP","%s",%d,4096,0\r\n' % (
+                self.sock.getpeername()[0].encode(), self.sock.getpeername()[1])
+        self.answer(text + b"\r\nOK\r\n")
+
+    def cmd_CIPSTART(self, arg, query, cmd):
+        if self.link_state(self.host.now()) == STATUS_NO_AP:
+            self.answer(b"no ip\r\n\r\nERROR\r\n")
+            return
+        if self.sock:
+            self.answer(b"ALREADY CONNECTED\r\n\r\nERROR\r\n")
+            return
+        parts = [p.strip('"') for p in arg.split(",")]
+        try:
+            address = self.server(parts[1], int(parts[2]) if parts[2].isdigit() else 0)
+            self.sock = socket.create_connection(address, timeout=2)
+            self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        except (OSError, ValueError, IndexError) as e:
+            log(self.verbose, "connect failed: %s", e)
+            self.answer(b"ERROR\r\nCLOSED\r\n", self.profile["tcp_connect_ms"])
+            return
+        self.answer(b"CONNECT\r\n\r\nOK\r\n", self.profile["tcp_connect_ms"])
+
+    def cmd_CIPSEND(self, arg, query, cmd):
+        if not self.sock:
+            self.answer(b"link is not valid\r\n\r\nERROR\r\n")
+        elif self.cipmode != 1 or arg is not None:
+            # Only transparent transmission is used by the firmware
+            self.answer(b"\r\nERROR\r\n")
+        else:
+            self.answer(b"\r\nOK\r\n\r\n>")
+            self.trans = True
+
+    def cmd_CIPCLOSE(self, arg, query, cmd):
+        if not self.sock:
+            self.answer(b"\r\nERROR\r\n")
+            return
+        self.close()
+        self.answer(b"\r\nOK\r\n")
+
+    def cmd_SLEEP(self, arg, query, cmd):
+        if query:
+            self.answer(b"+SLEEP:%d\r\n\r\nOK\r\n" % self.sleep)
+            return
+        self.sleep = int(arg)
+        self.answer(b"\r\nOK\r\n")
+
+    def cmd_GSLP(self, arg, query, cmd):
+        self.answer(b"\r\nOK\r\n")
+        # Connections are lost, only the reset line brings the module back
+        self.close(quiet=True)
+        self.ap = None
+        self.joined_at = None
+        self.deep = True
+
+    # Main loop
+
+    def run(self):
+        while True:
+            for _ in range(self.host.resets):
+                log(self.verbose, "reset")
+                self.boot()
+            self.host.resets = 0
+
+            if self.pty_buf:
+                data, self.pty_buf = self.pty_buf, b""
+                self.receive(data)
+                continue
+
+            watch = [self.pty] + self.broker.sockets()
+            if self.host.ctrl:
+                watch.append(self.host.ctrl)
+            if self.sock:
+                watch.append(self.sock)
+            r, _, _ = select.select(watch, [], [], 1.0)
+
+            if self.host.ctrl in r:
+                self.host.read_events()
+            if self.pty in r:
+                try:
+                    self.receive(os.read(self.pty, 4096))
+                except OSError:
+                    return
+            if self.sock and self.sock in r:
+                try:
+                    data = self.sock.recv(4096)
+                except OSError:
+                    data = b""
+                if not data:
+                    log(self.verbose, "server closed connection")
+                    was_trans = self.trans
+                    self.sock.close()
+                    self.sock = None
+                    self.trans = False
+                    if not was_trans and not self.deep:
+                        self.answer(b"CLOSED\r\n")
+                elif self.cipmode == 1 and not self.deep:
+                    self.write(data)
+                elif not self.deep:
+                    self.write(b"\r\n+IPD,%d:" % len(data) + data)
+            for sock in r:
+                if sock is self.broker.listen or sock in self.broker.clients:
+                    self.broker.handle(sock)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="ESP8266 AT firmware simulator")
+    parser.add_argument("pty", help="terminal the firmware's USART1 is connected to")
+    parser.add_argument("--profile", help="JSON file with latencies and injected failures")
+    parser.add_argument("--broker-port", type=int, default=0, help="port of the loopback broker, 0: any")
+    parser.add_argument("--verbose", action="store_true", help="trace AT traffic on stderr")
+    args = parser.parse_args()
+
+    pty = os.open(args.pty, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(pty)
+
+    profile = load_profile(args.profile)
+    broker = Broker(args.broker_port, profile, args.verbose)
+    module = Module(pty, profile, broker, args.verbose)
+    try:
+        module.run()
+    except (KeyboardInterrupt, SystemExit):
+        pass
+    log(args.verbose, "broker: %d connects, %d publishes, %d pings, %d acks dropped",
+        broker.stats["connects"], broker.stats["publishes"], broker.stats["pings"], broker.stats["dropped"])
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,1240 @@
+/**
+  ************************************************************************************************
+  * @file           : hal_shim.c
+  * @brief          : Host implementation of the HAL functions used by the firmware.
+  *                   USART1 (ESP8266) is mapped to a pseudo terminal, USART2 (PC) to stdout.
+  *                   HAL_GetTick and HAL_Delay run on a virtual clock, delays and STOP mode are
+  *                   skipped instead of waited for. Interrupts are delivered by calling the
+  *                   handlers of stm32f0xx_it.c whenever the firmware polls the tick, waits or
+  *                   sleeps and interrupts are not masked.
+  *
+  *                   Environment:
+  *                   HOST_SIM        command to start the module simulator, pty path is appended,
+  *                                   see Host/Sim/esp8266_sim.py
+  *                   HOST_PTY_LINK   symlink to create for the pty
+  *                   HOST_PRESSES    number of button presses to inject, 0: interactive
+  *                   HOST_PRESS_MS   ms of virtual time between presses (default 10000)
+  *                   HOST_END_MS     ms of virtual time to stop after (default one interval
+  *                                   after the last press)
+  *                   HOST_REALTIME   1: delays and sleep take real time
+  *                   HOST_QUIET_MS   ms of real time without module traffic after which busy
+  *                                   waiting of the firmware fast-forwards virtual time
+  *                                   (default 50)
+  *
+  *                   Interactive presses are injected by SIGUSR1 or a line on stdin.
+  ************************************************************************************************
+*/
+
+
+#define _GNU_SOURCE
+
+// Includes
+#include "main.h"
+#include "stm32f0xx_it.h"
+#include "host_pty.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+// Defines
+#define HOST_IRQ_COUNT         32
+#define HOST_DEFAULT_PRESS_MS  10000
+#define HOST_STUCK_MS          120000    // ms of virtual time the firmware may stay awake at most
+#define HOST_IDLE_POLL_MS      10        // ms to block while sleeping without known next event
+#define HOST_DEFAULT_QUIET_MS  50
+#define HOST_FAST_FORWARD_US   1000      // virtual time added per poll while the module is quiet
+
+#define HOST_DMA_HT            0x01
+#define HOST_DMA_TC            0x02
+
+
+// Typedefs
+typedef enum __HOST_WakeReasonTypeDef {
+	HOST_WAKE_NONE = 0,
+	HOST_WAKE_BUTTON,
+	HOST_WAKE_RTC
+} HOST_WakeReasonTypeDef;
+
+typedef struct __HOST_RxDmaTypeDef {
+	UART_HandleTypeDef *huart;
+	uint8_t *buf;
+	uint16_t size;
+	uint16_t pos;
+} HOST_RxDmaTypeDef;
+
+typedef struct __HOST_CountersTypeDef {
+	uint64_t espTx;
+	uint64_t espRx;
+	uint64_t pcTx;
+} HOST_CountersTypeDef;
+
+
+// Simulated peripherals
+USART_TypeDef host_Usart[2];
+DMA_Channel_TypeDef host_DmaChannel[5];
+GPIO_TypeDef host_Gpio[6];
+RCC_TypeDef host_Rcc;
+PWR_TypeDef host_Pwr;
+EXTI_TypeDef host_Exti;
+TIM_TypeDef host_Tim[17];
+SCB_Type host_Scb;
+SysTick_Type host_SysTick;
+__IO uint32_t uwTick = 0;                   // only what the firmware adds, HAL_GetTick is virtual time
+uint32_t SystemCoreClock = 8000000;
+
+static RTC_TypeDef host_Rtc;
+
+
+// Private variables
+static int host_PtyFd = -1;
+static int host_CtrlFd = -1;
+static uint64_t host_QuietUs = 0;
+static uint64_t host_LastIoUs = 0;
+static char host_CtrlLine[32];
+static uint8_t host_CtrlLen = 0;
+static uint8_t host_IrqMasked = 0;
+static uint8_t host_InIsr = 0;
+static uint8_t host_IrqEnabled[HOST_IRQ_COUNT];
+static uint32_t host_IrqCount = 0;
+
+static uint64_t host_StartUs = 0;
+static uint64_t host_SkippedUs = 0;
+static uint64_t host_TickPausedUs = 0;
+static uint64_t host_TickPauseStart = 0;
+static uint8_t host_TickSuspended = 0;
+static uint8_t host_Realtime = 0;
+
+static uint32_t host_Presses = 0;
+static uint32_t host_PressesDone = 0;
+static uint64_t host_PressIntervalUs = 0;
+static uint64_t host_EndUs = 0;
+static volatile sig_atomic_t host_PressRequest = 0;
+
+static uint32_t host_RtcLastSecond = 0;
+
+static uint64_t host_StopUs = 0;            // virtual time spent in STOP mode, timers do not count
+static uint32_t host_TimClock = 8000000;    // Hz, HSI after reset and wake up
+static uint64_t host_TimLastUs[17];
+static uint64_t host_TimFrac[17];
+static uint32_t host_TimOverflows[17];      // update events not delivered as interrupt yet
+
+static DMA_HandleTypeDef *host_DmaHandle[5];
+static uint8_t host_DmaPending[5];
+static uint64_t host_TxDoneUs[5];          // virtual time the running TX transfer left the UART
+static uint32_t host_CtrlBaud = 115200;     // rate of USART1 the simulator was told
+static HOST_RxDmaTypeDef host_RxDma;
+
+static HOST_CountersTypeDef host_Count;
+static HOST_CountersTypeDef host_WakeCount;
+static HOST_WakeReasonTypeDef host_WakeReason = HOST_WAKE_NONE;
+static uint32_t host_Wakes = 0;
+static uint64_t host_WakeStartUs = 0;
+static uint64_t host_WakeStartCpuNs = 0;
+static uint64_t host_WakeTotalUs = 0;
+static uint64_t host_WakeMaxUs = 0;
+
+
+
+static void host_PollDma(void);
+
+
+// Function to get the real monotonic time in us
+static uint64_t host_RealUs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+// Function to get the CPU time of the process in ns
+static uint64_t host_CpuNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// Function to get the virtual time in us, real time plus all skipped delays
+uint64_t host_NowUs(void)
+{
+	return host_RealUs() - host_StartUs + host_SkippedUs;
+}
+
+
+// Function to let virtual time pass without waiting for it. A transmission ending meanwhile
+// completes at its time, not at the end of the skipped time.
+static void host_Skip(uint64_t us)
+{
+	uint64_t now, part;
+	uint8_t ch;
+
+	if (host_Realtime)
+	{
+		usleep(us);
+		return;
+	}
+
+	for (ch = 0; ch < 5 && !host_InIsr && !host_IrqMasked; ch++)
+	{
+		now = host_NowUs();
+
+		if (host_TxDoneUs[ch] == 0 || host_TxDoneUs[ch] >= now + us)
+			continue;
+
+		part = (host_TxDoneUs[ch] > now) ? host_TxDoneUs[ch] - now : 0;
+		host_SkippedUs += part;
+		us -= part;
+		host_PollDma();
+	}
+
+	host_SkippedUs += us;
+}
+
+
+// Function to convert a value of 0 - 99 to BCD
+static uint32_t host_ToBcd(uint32_t value)
+{
+	return ((value / 10) << 4) | (value % 10);
+}
+
+
+// Function to convert a BCD value to binary
+static uint32_t host_FromBcd(uint32_t value)
+{
+	return ((value >> 4) * 10) + (value & 0x0f);
+}
+
+
+// Function to get the second of day of the RTC
+static uint32_t host_RtcSecond(void)
+{
+	return (uint32_t) ((host_NowUs() / 1000000) % 86400);
+}
+
+
+// Function to get the calendar date of the RTC in the BCD layout of DR, starting on 1 Jan 2000
+static uint32_t host_RtcDate(void)
+{
+	static const uint8_t monthDays[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	uint32_t days = (uint32_t) (host_NowUs() / 1000000 / 86400);
+	uint32_t year = 0, month = 0, len;
+
+	while (days >= (len = (year % 4) == 0 ? 366 : 365))
+	{
+		days -= len;
+		year++;
+	}
+
+	while (days >= (len = monthDays[month] + (month == 1 && (year % 4) == 0)))
+	{
+		days -= len;
+		month++;
+	}
+
+	return (host_ToBcd(year) << 16) | (host_ToBcd(month + 1) << 8) | host_ToBcd(days + 1);
+}
+
+
+// Function to get the second of day the RTC alarm is set to, -1 if disabled
+static int32_t host_RtcAlarmSecond(void)
+{
+	uint32_t a = host_Rtc.ALRMAR;
+
+	if ((host_Rtc.CR & (RTC_CR_ALRAE | RTC_CR_ALRAIE)) != (RTC_CR_ALRAE | RTC_CR_ALRAIE))
+		return -1;
+
+	return host_FromBcd((a >> 16) & 0x3f) * 3600 + host_FromBcd((a >> 8) & 0x7f) * 60 + host_FromBcd(a & 0x7f);
+}
+
+
+// Function to update the status bits of RCC, oscillators are ready at once
+RCC_TypeDef *host_RccSync(void)
+{
+	if (host_Rcc.CR & RCC_CR_HSION)
+		host_Rcc.CR |= RCC_CR_HSIRDY;
+	if (host_Rcc.CR & RCC_CR_HSEON)
+		host_Rcc.CR |= RCC_CR_HSERDY;
+	if (host_Rcc.CR & RCC_CR_PLLON)
+		host_Rcc.CR |= RCC_CR_PLLRDY;
+	else
+		host_Rcc.CR &= ~RCC_CR_PLLRDY;
+	if (host_Rcc.CSR & RCC_CSR_LSION)
+		host_Rcc.CSR |= RCC_CSR_LSIRDY;
+
+	// Clock switch follows at once, the PLL of SystemClock_Config is the only one used
+	if ((host_Rcc.CFGR & RCC_CFGR_SW) != RCC_CFGR_SW_PLL || (host_Rcc.CR & RCC_CR_PLLRDY))
+		host_Rcc.CFGR = (host_Rcc.CFGR & ~RCC_CFGR_SWS) | ((host_Rcc.CFGR & RCC_CFGR_SW) << 2);
+	host_TimClock = ((host_Rcc.CFGR & RCC_CFGR_SWS) == RCC_CFGR_SWS_PLL) ? 48000000 : HSI_VALUE;
+
+	return &host_Rcc;
+}
+
+
+// Function to advance a timer by the virtual time it was clocked since the last access
+TIM_TypeDef *host_TimSync(uint8_t n)
+{
+	TIM_TypeDef *tim = &host_Tim[n];
+	uint64_t now = host_NowUs() - host_StopUs;
+	uint64_t cycles, ticks, period;
+
+	// Update generation reloads the prescaler and clears the counter
+	if (tim->EGR & TIM_EGR_UG)
+	{
+		tim->EGR = 0;
+		tim->CNT = 0;
+		host_TimFrac[n] = 0;
+		host_TimOverflows[n] = 0;
+	}
+
+	if (tim->CR1 & TIM_CR1_CEN)
+	{
+		// Input clock cycles times 10^6, the remainder is kept for the next access
+		cycles = host_TimFrac[n] + (now - host_TimLastUs[n]) * host_TimClock;
+		ticks = cycles / (1000000ULL * (tim->PSC + 1));
+		host_TimFrac[n] = cycles % (1000000ULL * (tim->PSC + 1));
+
+		period = (uint64_t) tim->ARR + 1;
+		ticks += tim->CNT;
+
+		if (ticks >= period && (tim->CR1 & TIM_CR1_OPM))
+		{
+			// One-pulse mode stops at the first update
+			host_TimOverflows[n]++;
+			tim->SR |= TIM_SR_UIF;
+			tim->CR1 &= ~TIM_CR1_CEN;
+			ticks = 0;
+		}
+		else if (ticks >= period)
+		{
+			host_TimOverflows[n] += ticks / period;
+			tim->SR |= TIM_SR_UIF;
+		}
+
+		tim->CNT = ticks % period;
+	}
+
+	host_TimLastUs[n] = now;
+
+	return tim;
+}
+
+
+// Function to get the virtual time of the next update interrupt of a timer, 0 if none
+static uint64_t host_TimNextUs(uint8_t n)
+{
+	TIM_TypeDef *tim = host_TimSync(n);
+	uint64_t cycles;
+
+	if (!(tim->CR1 & TIM_CR1_CEN) || !(tim->DIER & TIM_DIER_UIE))
+		return 0;
+
+	cycles = ((uint64_t) tim->ARR + 1 - tim->CNT) * (tim->PSC + 1) * 1000000ULL - host_TimFrac[n];
+
+	return host_NowUs() + (cycles + host_TimClock - 1) / host_TimClock;
+}
+
+
+// Function to update the status bits and calendar of the RTC from the virtual clock
+RTC_TypeDef *host_RtcSync(void)
+{
+	uint32_t s = host_RtcSecond();
+
+	if (host_Rtc.ISR & RTC_ISR_INIT)
+		host_Rtc.ISR |= RTC_ISR_INITF;
+	else
+		host_Rtc.ISR &= ~RTC_ISR_INITF;
+
+	host_Rtc.ISR |= RTC_ISR_RSF | RTC_ISR_ALRAWF;
+	host_Rtc.TR = (host_ToBcd(s / 3600) << 16) | (host_ToBcd((s / 60) % 60) << 8) | host_ToBcd(s % 60);
+	host_Rtc.DR = host_RtcDate();
+
+	return &host_Rtc;
+}
+
+
+// Function to call an interrupt handler if the interrupt is enabled
+static void host_Irq(IRQn_Type irq, void (*handler)(void))
+{
+	if (!host_IrqEnabled[irq])
+		return;
+
+	host_InIsr = 1;
+	handler();
+	host_InIsr = 0;
+
+	host_IrqCount++;
+}
+
+
+// Function to print the numbers of the wake up that just ended
+static void host_WakeEnd(void)
+{
+	uint64_t us = host_NowUs() - host_WakeStartUs;
+
+	if (host_WakeReason == HOST_WAKE_NONE)
+		return;
+
+	host_Wakes++;
+	host_WakeTotalUs += us;
+	if (us > host_WakeMaxUs)
+		host_WakeMaxUs = us;
+
+	fprintf(stderr, "[host] wake %u (%s): %llu.%03llu ms awake, %llu us cpu, esp tx %llu B rx %llu B, pc tx %llu B\n",
+			host_Wakes, host_WakeReason == HOST_WAKE_BUTTON ? "button" : "rtc",
+			(unsigned long long) us / 1000, (unsigned long long) us % 1000,
+			(unsigned long long) (host_CpuNs() - host_WakeStartCpuNs) / 1000,
+			(unsigned long long) (host_Count.espTx - host_WakeCount.espTx),
+			(unsigned long long) (host_Count.espRx - host_WakeCount.espRx),
+			(unsigned long long) (host_Count.pcTx - host_WakeCount.pcTx));
+
+	host_WakeReason = HOST_WAKE_NONE;
+}
+
+
+// Function to note the start of a wake up
+static void host_WakeStart(HOST_WakeReasonTypeDef reason)
+{
+	host_WakeEnd();
+
+	host_WakeReason = reason;
+	host_WakeStartUs = host_NowUs();
+	host_WakeStartCpuNs = host_CpuNs();
+	host_WakeCount = host_Count;
+}
+
+
+// Function to print the summary and leave
+static void host_Exit(int code)
+{
+	host_WakeEnd();
+
+	fprintf(stderr, "[host] %u wakes, avg %llu us, max %llu us awake, esp tx %llu B rx %llu B, pc tx %llu B\n",
+			host_Wakes, (unsigned long long) (host_Wakes ? host_WakeTotalUs / host_Wakes : 0),
+			(unsigned long long) host_WakeMaxUs, (unsigned long long) host_Count.espTx,
+			(unsigned long long) host_Count.espRx, (unsigned long long) host_Count.pcTx);
+
+	exit(code);
+}
+
+
+// Function to inject a button press
+static void host_PressButton(void)
+{
+	host_WakeStart(HOST_WAKE_BUTTON);
+	host_PressesDone++;
+
+	host_Exti.PR |= Button_Pin;
+	host_Irq(EXTI4_15_IRQn, EXTI4_15_IRQHandler);
+}
+
+
+// Function to get the virtual time of the next injected button press, 0 if none
+static uint64_t host_NextPress(void)
+{
+	if (host_Presses == 0 || host_PressesDone >= host_Presses)
+		return 0;
+
+	return (host_PressesDone + 1) * host_PressIntervalUs;
+}
+
+
+// Function to read bytes of the module into the receive DMA buffer
+static uint8_t host_PollRx(void)
+{
+	HOST_RxDmaTypeDef *rx = &host_RxDma;
+	DMA_HandleTypeDef *hdma;
+	uint8_t received = 0;
+	uint16_t half;
+	ssize_t n;
+
+	if (rx->buf == NULL)
+		return 0;
+
+#if ESP_FLOW_CONTROL == 1
+	// RTS raised, the module holds its data back, it waits in the pseudo terminal
+	if (WIFI_RTS_GPIO_Port->ODR & WIFI_RTS_Pin)
+		return 0;
+#endif
+
+	hdma = rx->huart->hdmarx;
+	half = rx->size / 2;
+
+	while ((n = read(host_PtyFd, &rx->buf[rx->pos], rx->size - rx->pos)) > 0)
+	{
+		uint16_t before = rx->pos;
+
+		rx->pos += n;
+		host_Count.espRx += n;
+		received = 1;
+
+		if (before < half && rx->pos >= half)
+			host_DmaPending[hdma->Instance - host_DmaChannel] |= HOST_DMA_HT;
+
+		if (rx->pos == rx->size)
+		{
+			host_DmaPending[hdma->Instance - host_DmaChannel] |= HOST_DMA_TC;
+			rx->pos = 0;
+
+			if (hdma->Init.Mode != DMA_CIRCULAR)
+			{
+				hdma->Instance->CNDTR = 0;
+				rx->buf = NULL;
+				break;
+			}
+		}
+
+		hdma->Instance->CNDTR = rx->size - rx->pos;
+	}
+
+	return received;
+}
+
+
+// Function to deliver the pending DMA interrupts
+static void host_PollDma(void)
+{
+	uint8_t ch;
+
+	for (ch = 0; ch < 5; ch++)
+	{
+		// Transfer is complete once the last byte was shifted out
+		if (host_TxDoneUs[ch] != 0 && host_NowUs() >= host_TxDoneUs[ch])
+		{
+			host_TxDoneUs[ch] = 0;
+			host_DmaPending[ch] |= HOST_DMA_TC;
+		}
+
+		if (host_DmaPending[ch] == 0)
+			continue;
+
+		if (ch == 1 || ch == 2)
+			host_Irq(DMA1_Channel2_3_IRQn, DMA1_Channel2_3_IRQHandler);
+		else if (ch == 3 || ch == 4)
+			host_Irq(DMA1_Channel4_5_IRQn, DMA1_Channel4_5_IRQHandler);
+	}
+}
+
+
+// Function to check the RTC alarm
+static void host_PollRtc(void)
+{
+	uint32_t now = host_RtcSecond();
+	int32_t alarm = host_RtcAlarmSecond();
+	uint32_t last = host_RtcLastSecond;
+
+	host_RtcLastSecond = now;
+
+	if (alarm < 0 || now == last)
+		return;
+
+	// Alarm second was passed since the last check
+	if ((uint32_t) ((alarm - last + 86400) % 86400) <= (now - last + 86400) % 86400 && (uint32_t) alarm != last)
+	{
+		host_Rtc.ISR |= RTC_ISR_ALRAF;
+		host_Exti.PR |= EXTI_PR_PR17;
+
+		if (host_Exti.IMR & EXTI_IMR_MR17)
+		{
+			host_WakeStart(HOST_WAKE_RTC);
+			host_Irq(RTC_IRQn, RTC_IRQHandler);
+		}
+	}
+}
+
+
+static void host_Write(int fd, const uint8_t *data, uint16_t len);
+
+
+// Function to apply the latency the simulator announces on the control socket before an answer.
+// The module keeps running while the MCU is stopped, e.g. booting after start of the simulator.
+static void host_PollCtrl(uint8_t stopped)
+{
+	uint64_t us;
+
+	char c;
+
+	while (host_CtrlFd >= 0 && read(host_CtrlFd, &c, 1) == 1)
+	{
+		if (c != '\n')
+		{
+			if (host_CtrlLen < sizeof(host_CtrlLine) - 1)
+				host_CtrlLine[host_CtrlLen++] = c;
+			continue;
+		}
+
+		host_CtrlLine[host_CtrlLen] = '\0';
+		host_CtrlLen = 0;
+
+		if (strncmp(host_CtrlLine, "delay ", 6) == 0)
+		{
+			us = strtoull(&host_CtrlLine[6], NULL, 0) * 1000;
+			if (stopped)
+				host_StopUs += us;
+			host_Skip(us);
+			host_LastIoUs = host_RealUs();
+			host_Write(host_CtrlFd, (const uint8_t*) "ok\n", 3);
+		}
+		else if (strcmp(host_CtrlLine, "time") == 0)
+		{
+			char reply[32];
+			int n = snprintf(reply, sizeof(reply), "time %llu\n", (unsigned long long) (host_NowUs() / 1000));
+
+			host_Write(host_CtrlFd, (const uint8_t*) reply, n);
+		}
+	}
+}
+
+
+// Function to deliver everything that happened since the last call
+static void host_Poll(uint8_t stopped)
+{
+	uint64_t press;
+
+	if (host_InIsr || host_IrqMasked)
+		return;
+
+	if (host_PressRequest || ((press = host_NextPress()) != 0 && host_NowUs() >= press))
+	{
+		host_PressRequest = 0;
+		host_PressButton();
+	}
+
+	host_PollRtc();
+	host_PollCtrl(stopped);
+
+	// Peripherals are not clocked in STOP mode
+	if (stopped)
+		return;
+
+	if (host_PollRx())
+	{
+		host_LastIoUs = host_RealUs();
+
+		host_PollDma();
+
+		// Line went idle after the received bytes
+		host_Usart[0].ISR |= USART_ISR_IDLE;
+		if (host_Usart[0].CR1 & USART_CR1_IDLEIE)
+			host_Irq(USART1_IRQn, USART1_IRQHandler);
+	}
+
+	host_PollDma();
+
+	// Firmware waits for a module which does not answer, no need to wait in real time
+	if (!host_Realtime && host_RealUs() - host_LastIoUs > host_QuietUs)
+		host_SkippedUs += HOST_FAST_FORWARD_US;
+
+	// Every overflow is an interrupt, also when time was skipped over several periods
+	host_TimSync(3);
+	while (host_TimOverflows[3] > 0 && (host_Tim[3].DIER & TIM_DIER_UIE))
+	{
+		host_TimOverflows[3]--;
+		host_Tim[3].SR |= TIM_SR_UIF;
+		host_Irq(TIM3_IRQn, TIM3_IRQHandler);
+	}
+
+	host_TimSync(14);
+	if (host_TimOverflows[14] > 0 && (host_Tim[14].DIER & TIM_DIER_UIE))
+	{
+		host_TimOverflows[14] = 0;
+		host_Irq(TIM14_IRQn, TIM14_IRQHandler);
+	}
+
+	if (host_EndUs != 0 && host_NowUs() > host_EndUs + HOST_STUCK_MS * 1000ULL)
+	{
+		fprintf(stderr, "[host] firmware did not go to sleep\n");
+		host_Exit(1);
+	}
+}
+
+
+// Function to wait for an interrupt, stopped: only EXTI lines wake up
+static void host_Sleep(uint8_t stopped)
+{
+	uint32_t count = host_IrqCount;
+	uint64_t now, next, press, timer;
+	int32_t alarm, timeout;
+	struct pollfd pfd[3];
+	char line[32];
+
+	if (stopped)
+		host_WakeEnd();
+
+	while (host_IrqCount == count)
+	{
+		host_Poll(stopped);
+
+		if (host_IrqCount != count)
+			break;
+
+		now = host_NowUs();
+		next = 0;
+
+		if ((press = host_NextPress()) != 0)
+			next = press;
+
+		if ((alarm = host_RtcAlarmSecond()) >= 0)
+		{
+			uint64_t s = now / 1000000;
+			uint64_t at = (s + ((alarm - (int32_t) (s % 86400) + 86400) % 86400)) * 1000000;
+
+			if (at <= now)
+				at += 86400ULL * 1000000;
+			if (next == 0 || at < next)
+				next = at;
+		}
+
+		if (stopped && host_EndUs != 0 && (next == 0 || next > host_EndUs))
+			host_Exit(0);
+
+		// Nothing can happen before the next event, skip the time in between
+		if (next != 0 && (stopped || host_PtyFd < 0))
+		{
+			if (stopped)
+				host_StopUs += next - now;
+			host_Skip(next - now);
+			continue;
+		}
+
+		timeout = HOST_IDLE_POLL_MS;
+
+		// Deadline of a sleep in SLEEP mode, skipped to once the module is quiet
+		if (!stopped && (timer = host_TimNextUs(14)) != 0 && (next == 0 || timer < next))
+		{
+			if (timer <= now)
+				continue;
+
+			if (!host_Realtime && host_RealUs() - host_LastIoUs > host_QuietUs)
+			{
+				host_Skip(timer - now);
+				continue;
+			}
+
+			if ((timer - now + 999) / 1000 < HOST_IDLE_POLL_MS)
+				timeout = (timer - now + 999) / 1000;
+		}
+
+		pfd[0].fd = stopped ? -1 : host_PtyFd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = host_Presses == 0 ? STDIN_FILENO : -1;
+		pfd[1].events = POLLIN;
+		pfd[2].fd = host_CtrlFd;
+		pfd[2].events = POLLIN;
+
+		if (poll(pfd, 3, timeout) > 0 && (pfd[1].revents & POLLIN))
+		{
+			if (fgets(line, sizeof(line), stdin) == NULL)
+				host_Exit(0);
+
+			host_PressRequest = 1;
+		}
+	}
+}
+
+
+// Function to handle SIGUSR1, presses the button
+static void host_Signal(int sig)
+{
+	(void) sig;
+	host_PressRequest = 1;
+}
+
+
+// Function to set up the host environment before the firmware's main runs
+__attribute__((constructor)) static void host_Init(void)
+{
+	const char *env;
+
+	host_StartUs = host_RealUs();
+	host_Realtime = (env = getenv("HOST_REALTIME")) != NULL && atoi(env) == 1;
+	host_Presses = (env = getenv("HOST_PRESSES")) != NULL ? strtoul(env, NULL, 0) : 0;
+	host_PressIntervalUs = ((env = getenv("HOST_PRESS_MS")) != NULL ? strtoull(env, NULL, 0) : HOST_DEFAULT_PRESS_MS) * 1000;
+
+	if ((env = getenv("HOST_END_MS")) != NULL)
+		host_EndUs = strtoull(env, NULL, 0) * 1000;
+	else if (host_Presses > 0)
+		host_EndUs = (host_Presses + 1) * host_PressIntervalUs;
+
+	setvbuf(stdout, NULL, _IONBF, 0);
+	signal(SIGUSR1, host_Signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	host_QuietUs = ((env = getenv("HOST_QUIET_MS")) != NULL ? strtoull(env, NULL, 0) : HOST_DEFAULT_QUIET_MS) * 1000;
+	host_PtyFd = host_OpenPty(getenv("HOST_PTY_LINK"), getenv("HOST_SIM"), &host_CtrlFd);
+}
+
+
+// Function to write all bytes to a descriptor, waits while the pty is full
+static void host_Write(int fd, const uint8_t *data, uint16_t len)
+{
+	ssize_t n;
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+
+	while (len > 0)
+	{
+		n = write(fd, data, len);
+
+		if (n < 0 && errno == EAGAIN)
+		{
+			poll(&pfd, 1, HOST_IDLE_POLL_MS);
+			continue;
+		}
+
+		if (n <= 0)
+			return;
+
+		data += n;
+		len -= n;
+	}
+}
+
+
+/* Intrinsics ---------------------------------------------------------------------------------- */
+
+void host_DisableIrq(void)
+{
+	host_IrqMasked = 1;
+}
+
+void host_EnableIrq(void)
+{
+	host_IrqMasked = 0;
+}
+
+uint32_t host_GetPrimask(void)
+{
+	return host_IrqMasked;
+}
+
+void host_SetPrimask(uint32_t primask)
+{
+	host_IrqMasked = primask & 1;
+}
+
+// WFI also wakes up with interrupts masked, the handler runs at once instead of after unmasking
+void host_WaitForInterrupt(void)
+{
+	uint8_t masked = host_IrqMasked;
+
+	host_IrqMasked = 0;
+	host_Sleep((host_Scb.SCR & SCB_SCR_SLEEPDEEP_Msk) != 0);
+	host_IrqMasked = masked;
+}
+
+uint32_t host_GetIpsr(void)
+{
+	return host_InIsr;
+}
+
+
+/* HAL ----------------------------------------------------------------------------------------- */
+
+HAL_StatusTypeDef HAL_Init(void)
+{
+	HAL_MspInit();
+	return HAL_OK;
+}
+
+void HAL_IncTick(void)
+{
+}
+
+uint32_t HAL_GetTick(void)
+{
+	uint64_t now;
+
+	host_Poll(0);
+
+	now = host_NowUs() - host_TickPausedUs;
+	if (host_TickSuspended)
+		now -= host_NowUs() - host_TickPauseStart;
+
+	// Firmware adds the time SysTick was suspended for
+	return (uint32_t) (now / 1000) + uwTick;
+}
+
+void HAL_Delay(uint32_t Delay)
+{
+	host_Poll(0);
+	host_Skip((uint64_t) Delay * 1000);
+	host_Poll(0);
+}
+
+void HAL_SuspendTick(void)
+{
+	if (host_TickSuspended)
+		return;
+
+	host_TickSuspended = 1;
+	host_TickPauseStart = host_NowUs();
+}
+
+void HAL_ResumeTick(void)
+{
+	if (!host_TickSuspended)
+		return;
+
+	host_TickSuspended = 0;
+	host_TickPausedUs += host_NowUs() - host_TickPauseStart;
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority)
+{
+	(void) IRQn;
+	(void) PreemptPriority;
+	(void) SubPriority;
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn)
+{
+	host_IrqEnabled[IRQn] = 1;
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn)
+{
+	host_IrqEnabled[IRQn] = 0;
+}
+
+HAL_StatusTypeDef HAL_RCC_OscConfig(RCC_OscInitTypeDef *RCC_OscInitStruct)
+{
+	(void) RCC_OscInitStruct;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCC_ClockConfig(RCC_ClkInitTypeDef *RCC_ClkInitStruct, uint32_t FLatency)
+{
+	(void) RCC_ClkInitStruct;
+	(void) FLatency;
+	SystemCoreClock = 48000000;
+	host_Rcc.CR |= RCC_CR_PLLON;
+	host_Rcc.CFGR = (host_Rcc.CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_PLL;
+	host_RccSync();
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_RCCEx_PeriphCLKConfig(RCC_PeriphCLKInitTypeDef *PeriphClkInit)
+{
+	(void) PeriphClkInit;
+	return HAL_OK;
+}
+
+uint32_t HAL_RCC_GetHCLKFreq(void)
+{
+	return SystemCoreClock;
+}
+
+void HAL_PWR_EnterSTOPMode(uint32_t Regulator, uint8_t STOPEntry)
+{
+	(void) Regulator;
+	(void) STOPEntry;
+
+	// System clock is HSI after wake up, the PLL is off
+	host_Rcc.CR &= ~RCC_CR_PLLON;
+	host_Rcc.CFGR &= ~RCC_CFGR_SW;
+	host_RccSync();
+	host_Sleep(1);
+}
+
+void HAL_PWR_EnterSLEEPMode(uint32_t Regulator, uint8_t SLEEPEntry)
+{
+	(void) Regulator;
+	(void) SLEEPEntry;
+
+	host_Scb.SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+	host_WaitForInterrupt();
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init)
+{
+	(void) GPIOx;
+
+	if (GPIO_Init->Mode & EXTI_IT)
+		host_Exti.IMR |= GPIO_Init->Pin;
+}
+
+void HAL_GPIO_DeInit(GPIO_TypeDef *GPIOx, uint32_t GPIO_Pin)
+{
+	(void) GPIOx;
+	(void) GPIO_Pin;
+}
+
+GPIO_PinState HAL_GPIO_ReadPin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	return (GPIOx->IDR & GPIO_Pin) ? GPIO_PIN_SET : GPIO_PIN_RESET;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState)
+{
+	// Module leaves reset, the simulator boots
+	if (GPIOx == WIFI_RST_GPIO_Port && (GPIO_Pin & WIFI_RST_Pin) && PinState != GPIO_PIN_RESET
+			&& !(GPIOx->ODR & WIFI_RST_Pin) && host_CtrlFd >= 0)
+	{
+		host_Write(host_CtrlFd, (const uint8_t*) "reset\n", 6);
+		host_LastIoUs = host_RealUs();
+	}
+
+	if (PinState != GPIO_PIN_RESET)
+		GPIOx->ODR |= GPIO_Pin;
+	else
+		GPIOx->ODR &= ~GPIO_Pin;
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+	GPIOx->ODR ^= GPIO_Pin;
+}
+
+void HAL_GPIO_EXTI_IRQHandler(uint16_t GPIO_Pin)
+{
+	if (host_Exti.PR & GPIO_Pin)
+	{
+		host_Exti.PR &= ~GPIO_Pin;
+		HAL_GPIO_EXTI_Callback(GPIO_Pin);
+	}
+}
+
+HAL_StatusTypeDef HAL_DMA_Init(DMA_HandleTypeDef *hdma)
+{
+	host_DmaHandle[hdma->Instance - host_DmaChannel] = hdma;
+	hdma->State = HAL_DMA_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_DMA_DeInit(DMA_HandleTypeDef *hdma)
+{
+	host_DmaHandle[hdma->Instance - host_DmaChannel] = NULL;
+	hdma->State = HAL_DMA_STATE_RESET;
+	return HAL_OK;
+}
+
+void HAL_DMA_IRQHandler(DMA_HandleTypeDef *hdma)
+{
+	uint8_t ch = hdma->Instance - host_DmaChannel;
+	uint8_t pending = host_DmaPending[ch];
+	UART_HandleTypeDef *huart = (UART_HandleTypeDef*) hdma->Parent;
+
+	host_DmaPending[ch] = 0;
+
+	if (pending == 0 || huart == NULL)
+		return;
+
+	if (huart->hdmatx == hdma)
+	{
+		huart->gState = HAL_UART_STATE_READY;
+		HAL_UART_TxCpltCallback(huart);
+		return;
+	}
+
+	if (pending & HOST_DMA_HT)
+		HAL_UART_RxHalfCpltCallback(huart);
+
+	if (pending & HOST_DMA_TC)
+	{
+		if (hdma->Init.Mode != DMA_CIRCULAR)
+			huart->RxState = HAL_UART_STATE_READY;
+
+		HAL_UART_RxCpltCallback(huart);
+	}
+}
+
+HAL_StatusTypeDef HAL_UART_Init(UART_HandleTypeDef *huart)
+{
+	if (huart->gState == HAL_UART_STATE_RESET)
+		HAL_UART_MspInit(huart);
+
+	huart->gState = HAL_UART_STATE_READY;
+	huart->RxState = HAL_UART_STATE_READY;
+	huart->Instance->CR1 |= USART_CR1_UE;
+	huart->Instance->ISR |= USART_ISR_TC;
+
+	// Simulator garbles the line while both sides disagree on the rate
+	if (huart->Instance == USART1 && huart->Init.BaudRate != host_CtrlBaud && host_CtrlFd >= 0)
+	{
+		char msg[24];
+		int n = snprintf(msg, sizeof(msg), "baud %lu\n", (unsigned long) huart->Init.BaudRate);
+
+		host_Write(host_CtrlFd, (const uint8_t*) msg, n);
+		host_CtrlBaud = huart->Init.BaudRate;
+	}
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_DeInit(UART_HandleTypeDef *huart)
+{
+	HAL_UART_MspDeInit(huart);
+	huart->gState = HAL_UART_STATE_RESET;
+	huart->RxState = HAL_UART_STATE_RESET;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout)
+{
+	(void) Timeout;
+
+	if (huart->Instance == USART1)
+	{
+		host_LastIoUs = host_RealUs();
+		host_Write(host_PtyFd, pData, Size);
+		host_Count.espTx += Size;
+	}
+	else
+	{
+		host_Write(STDOUT_FILENO, pData, Size);
+		host_Count.pcTx += Size;
+	}
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	if (huart->gState != HAL_UART_STATE_READY)
+		return HAL_BUSY;
+
+	huart->gState = HAL_UART_STATE_BUSY_TX;
+	HAL_UART_Transmit(huart, pData, Size, 0);
+
+	// Completion is signalled by the DMA interrupt once the bytes took their time on the line,
+	// debug output is not slowed down
+	if (huart->Instance == USART1 && huart->Init.BaudRate != 0)
+		host_TxDoneUs[huart->hdmatx->Instance - host_DmaChannel] = host_NowUs() + 1
+				+ (uint64_t) Size * 10 * 1000000 / huart->Init.BaudRate;
+	else
+		host_DmaPending[huart->hdmatx->Instance - host_DmaChannel] |= HOST_DMA_TC;
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size)
+{
+	if (huart->RxState != HAL_UART_STATE_READY)
+		return HAL_BUSY;
+
+	huart->RxState = HAL_UART_STATE_BUSY_RX;
+	huart->hdmarx->Instance->CNDTR = Size;
+
+	// Only USART1 receives
+	if (huart->Instance == USART1)
+	{
+		host_RxDma.huart = huart;
+		host_RxDma.buf = pData;
+		host_RxDma.size = Size;
+		host_RxDma.pos = 0;
+	}
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive(UART_HandleTypeDef *huart)
+{
+	if (huart->Instance == USART1)
+		host_RxDma.buf = NULL;
+
+	huart->RxState = HAL_UART_STATE_READY;
+	return HAL_OK;
+}
+
+void HAL_UART_IRQHandler(UART_HandleTypeDef *huart)
+{
+	// Flags written to the clear register are cleared in the status register
+	huart->Instance->ISR &= ~huart->Instance->ICR;
+	huart->Instance->ICR = 0;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef *htim)
+{
+	HAL_TIM_Base_MspInit(htim);
+
+	htim->Instance->PSC = htim->Init.Prescaler;
+	htim->Instance->ARR = htim->Init.Period;
+	htim->Instance->EGR = TIM_EGR_UG;
+	htim->State = HAL_TIM_STATE_READY;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim)
+{
+	htim->Instance->DIER |= TIM_DIER_UIE;
+	htim->Instance->CR1 |= TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Stop_IT(TIM_HandleTypeDef *htim)
+{
+	htim->Instance->DIER &= ~TIM_DIER_UIE;
+	htim->Instance->CR1 &= ~TIM_CR1_CEN;
+	return HAL_OK;
+}
+
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim)
+{
+	if ((htim->Instance->SR & TIM_SR_UIF) && (htim->Instance->DIER & TIM_DIER_UIE))
+	{
+		htim->Instance->SR &= ~TIM_SR_UIF;
+		HAL_TIM_PeriodElapsedCallback(htim);
+	}
+}
+
+
+/* Weak callbacks not implemented by the firmware ---------------------------------------------- */
+
+__weak void HAL_MspInit(void)
+{
+}
+
+__weak void HAL_UART_MspInit(UART_HandleTypeDef *huart)
+{
+	(void) huart;
+}
+
+__weak void HAL_UART_MspDeInit(UART_HandleTypeDef *huart)
+{
+	(void) huart;
+}
+
+__weak void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	(void) huart;
+}
+
+__weak void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+	(void) huart;
+}
+
+__weak void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+	(void) huart;
+}
+
+__weak void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	(void) huart;
+}
+
+__weak void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+	(void) GPIO_Pin;
+}
+
+__weak void HAL_TIM_Base_MspInit(TIM_HandleTypeDef *htim)
+{
+	(void) htim;
+}
+
+__weak void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
+{
+	(void) htim;
+}
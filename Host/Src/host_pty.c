@@ -0,0 +1,120 @@
+/**
+  ************************************************************************************************
+  * @file           : host_pty.c
+  * @brief          : This file opens the pseudo terminal USART1 of the host build is mapped to
+  *                   and starts the module simulator on its other end
+  ************************************************************************************************
+*/
+
+
+#define _GNU_SOURCE
+
+// Includes
+#include "host_pty.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+// Private defines
+#define HOST_SIM_START_MS    5000
+
+
+// Private variables
+static int host_PtySlaveFd = -1;
+
+
+
+/**
+  * @brief  Function to open the pseudo terminal and start the simulator. The simulator gets one
+  *         end of a control socket in HOST_CTRL_FD and announces itself with "hello". It sends
+  *         "delay <ms>" before a delayed answer and waits for "ok", by then the shim has let the
+  *         virtual time pass, "time" is answered with the virtual ms since start. The shim
+  *         sends "reset" on a rising edge of the module reset line.
+  * @param link: Path of a symlink to the pty, NULL for none
+  * @param sim: Command of the simulator, the pty path is appended, NULL for none
+  * @param ctrl: Returns the non-blocking shim end of the control socket, -1 without simulator
+  * @retval Non-blocking descriptor of the master side
+  */
+int host_OpenPty(const char *link, const char *sim, int *ctrl)
+{
+	struct termios tio;
+	struct pollfd pfd;
+	char *cmd;
+	char *name;
+	char env[16];
+	char c = 0;
+	int sv[2];
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0)
+	{
+		perror("[host] pty");
+		exit(1);
+	}
+
+	name = ptsname(fd);
+
+	// Keep slave side open and raw, so nothing is lost before the simulator attaches
+	host_PtySlaveFd = open(name, O_RDWR | O_NOCTTY);
+	tcgetattr(host_PtySlaveFd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(host_PtySlaveFd, TCSANOW, &tio);
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	fprintf(stderr, "[host] USART1 on %s\n", name);
+
+	if (link != NULL && *link != '\0')
+	{
+		unlink(link);
+		if (symlink(name, link) != 0)
+			perror("[host] symlink");
+	}
+
+	*ctrl = -1;
+
+	if (sim == NULL || *sim == '\0' || asprintf(&cmd, "%s %s", sim, name) < 0)
+		return fd;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+	{
+		perror("[host] socketpair");
+		exit(1);
+	}
+
+	if (fork() == 0)
+	{
+		close(sv[0]);
+		snprintf(env, sizeof(env), "%d", sv[1]);
+		setenv("HOST_CTRL_FD", env, 1);
+		execl("/bin/sh", "sh", "-c", cmd, (char*) NULL);
+		_exit(127);
+	}
+
+	close(sv[1]);
+	free(cmd);
+
+	// Firmware starts with a module reset, the simulator has to listen by then
+	pfd.fd = sv[0];
+	pfd.events = POLLIN;
+	// Only the greeting is consumed, requests may follow right behind it
+	while (c != '\n')
+	{
+		if (poll(&pfd, 1, HOST_SIM_START_MS) <= 0 || read(sv[0], &c, 1) != 1)
+		{
+			fprintf(stderr, "[host] simulator did not start\n");
+			exit(1);
+		}
+	}
+
+	fcntl(sv[0], F_SETFL, fcntl(sv[0], F_GETFL) | O_NONBLOCK);
+	*ctrl = sv[0];
+
+	return fd;
+}
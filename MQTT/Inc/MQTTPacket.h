@@ -88,6 +88,44 @@ typedef struct
 
 int MQTTstrlen(MQTTString mqttstring);
 
+/**
+ * Topic descriptor, set up once so that serializing and comparing the topic needs no strlen.
+ */
+typedef struct
+{
+	const char* data;	/**< the topic, not terminated */
+	const unsigned char* prefixed;	/**< big-endian length followed by the topic, or NULL */
+	int len;	/**< length of the topic */
+	unsigned int hash;	/**< MQTTTopic_hash of the topic */
+} MQTTTopic;
+
+#define MQTTTOPIC_HASH_SPAN 32	/* characters hashed, counted from the end where topics differ */
+#define MQTTTOPIC_HASH_BASIS 2166136261u
+#define MQTTTOPIC_HASH_PRIME 16777619u
+
+/* FNV-1a step of MQTTTopic_hash for character i from the end of a string literal, a no-op beyond its start */
+#define MQTTTOPIC_LITERAL_LEN(s) (sizeof(s) - 1)
+#define MQTTTOPIC_HASH_STEP(h, s, i) \
+	(((h) ^ ((i) < MQTTTOPIC_LITERAL_LEN(s) ? (unsigned char)(s)[(i) < MQTTTOPIC_LITERAL_LEN(s) ? MQTTTOPIC_LITERAL_LEN(s) - 1 - (i) : 0] : 0u)) \
+		* ((i) < MQTTTOPIC_LITERAL_LEN(s) ? MQTTTOPIC_HASH_PRIME : 1u))
+#define MQTTTOPIC_HASH_STEP4(h, s, i) \
+	MQTTTOPIC_HASH_STEP(MQTTTOPIC_HASH_STEP(MQTTTOPIC_HASH_STEP(MQTTTOPIC_HASH_STEP(h, s, i), s, (i) + 1), s, (i) + 2), s, (i) + 3)
+#define MQTTTOPIC_HASH_STEP16(h, s, i) \
+	MQTTTOPIC_HASH_STEP4(MQTTTOPIC_HASH_STEP4(MQTTTOPIC_HASH_STEP4(MQTTTOPIC_HASH_STEP4(h, s, i), s, (i) + 4), s, (i) + 8), s, (i) + 12)
+
+/* MQTTTopic_hash of a string literal, evaluated by the compiler */
+#define MQTTTOPIC_HASH_LITERAL(s) \
+	((unsigned int)MQTTTOPIC_HASH_STEP16(MQTTTOPIC_HASH_STEP16(MQTTTOPIC_HASH_BASIS, s, 0), s, 16))
+
+/* Descriptor of a string literal topic without length prefix */
+#define MQTTTopic_initializer(s) {s, NULL, MQTTTOPIC_LITERAL_LEN(s), MQTTTOPIC_HASH_LITERAL(s)}
+
+unsigned int MQTTTopic_hash(const char* data, int len);
+void MQTTTopic_init(MQTTTopic* topic, const char* data, int len);
+DLLExport int MQTTTopic_equals(const MQTTTopic* a, const MQTTTopic* b);
+DLLExport int MQTTTopic_equalsString(const MQTTTopic* topic, MQTTString* name);
+DLLExport int MQTTTopic_find(const MQTTTopic* const topics[], int count, MQTTString* name);
+
 #include <MQTTConnect.h>
 #include <MQTTPublish.h>
 #include <MQTTSubscribe.h>
@@ -103,6 +141,7 @@ DLLExport int MQTTPacket_equals(MQTTString* a, char* b);
 DLLExport int MQTTPacket_encode(unsigned char* buf, int length);
 int MQTTPacket_decode(int (*getcharfn)(unsigned char*, int), int* value);
 int MQTTPacket_decodeBuf(unsigned char* buf, int* value);
+int MQTTPacket_decodeLen(unsigned char** pptr, unsigned char* enddata, int* value);
 
 int readInt(unsigned char** pptr);
 char readChar(unsigned char** pptr);
@@ -112,6 +151,28 @@ int readMQTTLenString(MQTTString* mqttstring, unsigned char** pptr, unsigned cha
 void writeCString(unsigned char** pptr, const char* string);
 void writeMQTTString(unsigned char** pptr, MQTTString mqttstring);
 
+#define MQTTPACKET_HEADER_SLOT 5 /* header byte and the longest remaining length */
+
+/**
+ * Output of a single-pass serializer. The variable header and payload follow a slot of
+ * MQTTPACKET_HEADER_SLOT bytes, the fixed header is patched into the slot at the end.
+ */
+typedef struct
+{
+	unsigned char* buf;	/**< start of the output buffer */
+	unsigned char* ptr;	/**< next byte of the variable header or payload */
+	unsigned char* end;	/**< end of the output buffer */
+	int rc;	/**< 0, or MQTTPACKET_BUFFER_TOO_SHORT once a field did not fit */
+} MQTTPacketWriter;
+
+void MQTTPacketWriter_init(MQTTPacketWriter* w, unsigned char* buf, int buflen);
+unsigned char* MQTTPacketWriter_reserve(MQTTPacketWriter* w, int len);
+void MQTTPacketWriter_char(MQTTPacketWriter* w, char c);
+void MQTTPacketWriter_int(MQTTPacketWriter* w, int anInt);
+void MQTTPacketWriter_bytes(MQTTPacketWriter* w, const void* data, int len);
+void MQTTPacketWriter_string(MQTTPacketWriter* w, MQTTString mqttstring);
+int MQTTPacketWriter_finish(MQTTPacketWriter* w, unsigned char header, unsigned char** packet);
+
 DLLExport int MQTTPacket_read(unsigned char* buf, int buflen, int (*getfn)(unsigned char*, int));
 
 typedef struct {
@@ -25,9 +25,30 @@
   #define DLLExport
 #endif
 
+#define MQTT_PUBLISHV_HEADER_LEN 9 /* header byte, 4 remaining length bytes, topic length, packet id */
+#define MQTT_PUBLISHV_SEGMENTS 4 /* header, topic, packet id, payload */
+
+typedef struct
+{
+	const unsigned char* data;
+	int len;
+} MQTTIovec;
+
 DLLExport int MQTTSerialize_publish(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
 		MQTTString topicName, unsigned char* payload, int payloadlen);
 
+DLLExport int MQTTSerialize_publishSinglePass(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		MQTTString topicName, const unsigned char* payload, int payloadlen, unsigned char** packet);
+
+DLLExport int MQTTSerialize_publishv(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		MQTTString topicName, const unsigned char* payload, int payloadlen, MQTTIovec* iov, int iovcnt);
+
+DLLExport int MQTTSerialize_publishvTopic(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		const MQTTTopic* topic, const unsigned char* payload, int payloadlen, MQTTIovec* iov, int iovcnt);
+
+DLLExport int MQTTSerialize_publishTopic(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		const MQTTTopic* topic, const unsigned char* payload, int payloadlen);
+
 DLLExport int MQTTDeserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid, MQTTString* topicName,
 		unsigned char** payload, int* payloadlen, unsigned char* buf, int len);
 
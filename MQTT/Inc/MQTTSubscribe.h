@@ -28,6 +28,9 @@
 DLLExport int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
 		int count, MQTTString topicFilters[], int requestedQoSs[]);
 
+DLLExport int MQTTSerialize_subscribeSinglePass(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		int count, MQTTString topicFilters[], int requestedQoSs[], unsigned char** packet);
+
 DLLExport int MQTTDeserialize_subscribe(unsigned char* dup, unsigned short* packetid,
 		int maxcount, int* count, MQTTString topicFilters[], int requestedQoSs[], unsigned char* buf, int len);
 
@@ -0,0 +1,11 @@
+#ifndef __HEAP_CONF_H
+#define __HEAP_CONF_H
+
+
+// Shared by the firmware and the MQTT library, which must not depend on main.h and the HAL
+#ifndef NO_HEAP
+#define NO_HEAP 1             // 1: no heap, set _Min_Heap_Size of the linker script for 0
+#endif
+
+
+#endif
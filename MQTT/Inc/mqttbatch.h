@@ -0,0 +1,47 @@
+/**
+  ************************************************************************************************
+  * @file           : mqttbatch.h
+  * @brief          : Header for mqttbatch.c file.
+  *                   Publishes and their PUBRELs are serialized one after the other into a pool
+  *                   block, the block goes to the DMA as one transmission. In transparent mode
+  *                   the module already packs bytes arriving within its 20 ms gap into one TCP
+  *                   segment, and a normal wake up sends a single publish. The batch only saves
+  *                   transmissions on bursts, e.g. the resends after a reconnect.
+  ************************************************************************************************
+*/
+
+
+#ifndef __MQTTBATCH_H
+#define __MQTTBATCH_H
+
+
+#include "main.h"
+#include <MQTTPacket.h>
+
+
+// Defines
+#define MQTT_BATCH_THRESHOLD        96       // bytes in the block that send it right away
+#define MQTT_BATCH_DEADLINE         20       // ms the first packet waits in the block at most, the packetizer gap of the module
+
+
+// Typedefs
+typedef struct __MQTT_BatchStatsTypeDef {
+	uint16_t packets;                        // packets added to a block
+	uint16_t transmits;                      // blocks handed to the DMA
+	uint16_t direct;                         // publishes too long for a block, sent on their own
+	uint32_t bytes;                          // bytes of all blocks
+} MQTT_BatchStatsTypeDef;
+
+
+// Function exports
+extern int mqtt_BatchPublish(const MQTTTopic *topic, const uint8_t *payload, uint16_t len, uint8_t qos, uint8_t dup, uint16_t packetId);
+extern int mqtt_BatchAck(uint8_t type, uint16_t packetId);
+extern uint8_t mqtt_BatchFlush(void);
+extern void mqtt_BatchPrintStats(void);
+
+
+// Variable exports
+extern MQTT_BatchStatsTypeDef mqtt_BatchStats;
+
+
+#endif
@@ -19,15 +19,28 @@
 #define __MQTTCLIENT_H
 
 #include <stdio.h>
+#include <stdint.h>
+#include <MQTTPacket.h>
+#include "buf_pool.h"
 
 #define MQTT_KeepAliveInterval   60
-#define MQTT_PacketBuffSize      1024
+#define MQTT_PacketBuffSize      BUF_POOL_BLOCK_SIZE     // packets built or received in a pool block
+#define MQTT_TxTimeout           200     // ms to wait for a packet to be transmitted
+#define MQTT_ConnackTimeout      3000    // ms to wait for CONNACK
+#define MQTT_PingTimeout         1000    // ms to wait for PINGRESP
+#define MQTT_CleanSession        0       // 0: broker keeps the session between connections
+#define MQTT_IovCopyMax          16      // segments up to this length are copied, longer ones referenced
+#define MQTT_PublishQoS          2       // QoS of the button publish, 1: at least once, 2: exactly once
 
 #define MQTT_RecvEndFlag         ESP_RecvEndFlag
 
 
 extern uint8_t mqtt_ConnectServer(void);
-extern uint8_t mqtt_PacketBuf[MQTT_PacketBuffSize];
+extern int mqtt_transport_sendPacketBlock(uint8_t *block, int buflen);
+extern int mqtt_transport_sendPacketVector(const MQTTIovec *iov, int count);
+extern int mqtt_transport_readPacket(uint8_t *buf, int buflen);
+extern uint8_t mqtt_Ping(void);
+extern void mqtt_Disconnect(void);
 extern void mqtt_TransmitPublish(char *topic, char *buf);
 
 #endif
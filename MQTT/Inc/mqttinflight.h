@@ -0,0 +1,71 @@
+/**
+  ************************************************************************************************
+  * @file           : mqttinflight.h
+  * @brief          : Header for mqttinflight.c file.
+  *                   QoS 1 and QoS 2 publishes in flight. Publishes are pipelined up to the
+  *                   window size, the packet id selects the slot so an acknowledgement is matched
+  *                   without search. The protocol state of a slot takes 2 bits of a packed table.
+  *                   Unacknowledged packets are sent again after a timeout and after a new
+  *                   CONNECT, the table is kept in RAM while the system sleeps.
+  ************************************************************************************************
+*/
+
+
+#ifndef __MQTTINFLIGHT_H
+#define __MQTTINFLIGHT_H
+
+
+#include "main.h"
+#include <MQTTPacket.h>
+
+
+// Defines
+#define MQTT_INFLIGHT_WINDOW        4        // publishes awaiting acknowledgement, power of two
+#define MQTT_INFLIGHT_RETRY         1500     // ms until a packet is sent again
+#define MQTT_INFLIGHT_TRIES         3        // transmissions per connection, then the connection is given up
+#define MQTT_INFLIGHT_DRAIN         5000     // ms to wait for the window to drain before sleep
+
+#define MQTT_INFLIGHT_STATE_BITS    2
+#define MQTT_INFLIGHT_STATE_BYTES   ((MQTT_INFLIGHT_WINDOW * MQTT_INFLIGHT_STATE_BITS + 7) / 8)
+
+
+// Typedefs
+typedef enum __MQTT_InflightStateTypeDef {
+	MQTT_INFLIGHT_FREE = 0,
+	MQTT_INFLIGHT_PUBACK,                    // QoS 1 PUBLISH sent, waiting for PUBACK
+	MQTT_INFLIGHT_PUBREC,                    // QoS 2 PUBLISH sent, waiting for PUBREC
+	MQTT_INFLIGHT_PUBCOMP                    // QoS 2 PUBREL sent, waiting for PUBCOMP
+} MQTT_InflightStateTypeDef;
+
+typedef struct __MQTT_InflightTypeDef {
+	const MQTTTopic *topic;
+	const uint8_t *payload;                  // flash or RAM, has to stay valid until PUBACK or PUBREC
+	uint16_t len;
+	uint16_t packetId;
+	uint16_t sentAt;                         // low 16 bits of the tick of the last transmission
+	uint8_t tries;                           // transmissions on this connection
+} MQTT_InflightTypeDef;
+
+typedef struct __MQTT_InflightStatsTypeDef {
+	uint16_t published;
+	uint16_t acked;                          // PUBACKs and PUBCOMPs
+	uint16_t resent;                         // PUBLISHes with DUP and repeated PUBRELs
+	uint16_t stalls;                         // publishes that waited for a free slot
+} MQTT_InflightStatsTypeDef;
+
+
+// Function exports
+extern uint8_t mqtt_InflightPublish(const MQTTTopic *topic, const uint8_t *payload, uint16_t len, uint8_t qos);
+extern uint8_t mqtt_InflightHandle(int type, uint8_t *packet);
+extern uint8_t mqtt_InflightPoll(void);
+extern uint8_t mqtt_InflightDrain(uint32_t timeout);
+extern void mqtt_InflightResend(void);
+extern uint8_t mqtt_InflightPending(void);
+extern void mqtt_InflightPrintStats(void);
+
+
+// Variable exports
+extern MQTT_InflightStatsTypeDef mqtt_InflightStats;
+
+
+#endif
@@ -0,0 +1,56 @@
+/**
+  ************************************************************************************************
+  * @file           : mqttsession.h
+  * @brief          : Header for mqttsession.c file.
+  *                   This file contains the defines and exports of the MQTT session manager
+  ************************************************************************************************
+*/
+
+
+#ifndef __MQTTSESSION_H
+#define __MQTTSESSION_H
+
+
+#include "main.h"
+#include <mqtttemplate.h>
+
+
+// Defines
+#define MQTT_SESSION_PING_MARGIN     10       // s before keepalive deadline the ping is sent
+#define MQTT_SESSION_PING_COST       500      // ms awake for a ping, until measured
+#define MQTT_SESSION_CONNECT_COST    4000     // ms awake for a new connection, until measured
+#define MQTT_SESSION_MAX_INTERVAL    86400UL  // s, press intervals are measured within a day
+
+
+// Typedefs
+typedef enum __MQTT_SessionStateTypeDef {
+	MQTT_SESSION_CLOSED = 0,    // no connection to broker
+	MQTT_SESSION_OPEN           // connection held open while sleeping
+} MQTT_SessionStateTypeDef;
+
+typedef struct __MQTT_SessionStatsTypeDef {
+	uint32_t intervalEma;       // s, average time between button presses, 0 if unknown
+	uint32_t pingCost;          // ms, average time awake for a keepalive
+	uint32_t connectCost;       // ms, average time awake for a new connection
+	uint16_t pings;             // successful keepalives
+	uint16_t pingFails;         // keepalives that lost the session
+	uint16_t connects;          // CONNECTs sent
+	uint16_t holds;             // sleeps with session held open
+	uint16_t reconnects;        // sleeps with session closed
+} MQTT_SessionStatsTypeDef;
+
+
+// Function exports
+extern uint8_t mqtt_SessionOpen(void);
+extern void mqtt_SessionPublish(const MQTTTopic *topic, const uint8_t *payload, uint16_t len);
+extern uint8_t mqtt_SessionKeepAlive(void);
+extern void mqtt_SessionClose(void);
+extern void mqtt_SessionSleep(void);
+extern MQTT_SessionStateTypeDef mqtt_SessionGetState(void);
+
+
+// Variable exports
+extern MQTT_SessionStatsTypeDef mqtt_SessionStats;
+
+
+#endif
@@ -0,0 +1,65 @@
+/**
+  ************************************************************************************************
+  * @file           : mqtttemplate.h
+  * @brief          : Header for mqtttemplate.c file.
+  *                   This file contains the macros to build MQTT packets from compile-time
+  *                   strings. The packets are laid out by the compiler and placed in flash, at
+  *                   runtime only remaining length, packet id and payload are added.
+  ************************************************************************************************
+*/
+
+
+#ifndef __MQTTTEMPLATE_H
+#define __MQTTTEMPLATE_H
+
+
+#include "main.h"
+#include <mqttclient.h>
+#include <net_conf.h>
+
+
+// Defines
+#define MQTT_STR_LEN(s)            (sizeof(s) - 1)                        // length of a string literal
+#define MQTT_U16(v)                (uint8_t)((v) >> 8), (uint8_t)((v) & 0xff)
+
+#define MQTT_CONNECT_FLAG_USER     0x80
+#define MQTT_CONNECT_FLAG_PASS     0x40
+#define MQTT_CONNECT_FLAG_CLEAN    0x02
+
+
+// Typedefs
+typedef struct __attribute__((packed)) __MQTT_ConnectTemplateTypeDef {
+	uint8_t header;
+	uint8_t remLen;                                // single byte, checked below
+	uint8_t protoLen[2];
+	char proto[4];
+	uint8_t level;
+	uint8_t flags;
+	uint8_t keepAlive[2];
+	uint8_t idLen[2];
+	char id[MQTT_STR_LEN(MQTT_CLIENTID)];
+	uint8_t userLen[2];
+	char user[MQTT_STR_LEN(MQTT_USERNAME)];
+	uint8_t passLen[2];
+	char pass[MQTT_STR_LEN(MQTT_PASSWORD)];
+} MQTT_ConnectTemplateTypeDef;
+
+
+// Defines a topic descriptor, length prefix, length and hash are laid out by the compiler and the
+// topic is sent straight from flash
+#define MQTT_TOPIC_DEFINE(name, topic) \
+	static const struct __attribute__((packed)) { uint8_t len[2]; char str[MQTT_STR_LEN(topic)]; } name##_Bytes = \
+		{ { MQTT_U16(MQTT_STR_LEN(topic)) }, topic }; \
+	const MQTTTopic name = { name##_Bytes.str, (const uint8_t*) &name##_Bytes, MQTT_STR_LEN(topic), MQTTTOPIC_HASH_LITERAL(topic) }
+
+
+// Function exports
+extern void mqtt_TransmitPublishTemplate(const MQTTTopic *topic, const uint8_t *payload, uint16_t len);
+extern int mqtt_TransmitPublishId(const MQTTTopic *topic, const uint8_t *payload, uint16_t len, uint8_t qos, uint8_t dup, uint16_t packetId);
+
+
+// Variable exports
+extern const MQTT_ConnectTemplateTypeDef mqtt_ConnectTemplate;
+
+
+#endif
@@ -121,6 +121,63 @@ int MQTTSerialize_connect(unsigned char* buf, int buflen, MQTTPacket_connectData
 }
 
 
+/**
+  * Serializes the connect options in a single pass, see MQTTPacketWriter_init. Every string is
+  * measured once while it is copied.
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param options the options to be used to build the connect packet
+  * @param packet returns the start of the packet within buf, NULL to move it to the start of buf
+  * @return serialized length.  <= 0 indicates error
+  */
+int MQTTSerialize_connectSinglePass(unsigned char* buf, int buflen, MQTTPacket_connectData* options, unsigned char** packet)
+{
+	static const unsigned char protocol4[] = { 0, 4, 'M', 'Q', 'T', 'T', 4 };
+	static const unsigned char protocol3[] = { 0, 6, 'M', 'Q', 'I', 's', 'd', 'p', 3 };
+	MQTTPacketWriter w;
+	MQTTHeader header = {0};
+	MQTTConnectFlags flags = {0};
+
+	MQTTPacketWriter_init(&w, buf, buflen);
+
+	if (options->MQTTVersion == 4)
+		MQTTPacketWriter_bytes(&w, protocol4, sizeof(protocol4));
+	else
+		MQTTPacketWriter_bytes(&w, protocol3, sizeof(protocol3));
+
+	flags.all = 0;
+	flags.bits.cleansession = options->cleansession;
+	flags.bits.will = (options->willFlag) ? 1 : 0;
+	if (flags.bits.will)
+	{
+		flags.bits.willQoS = options->will.qos;
+		flags.bits.willRetain = options->will.retained;
+	}
+
+	if (options->username.cstring || options->username.lenstring.data)
+		flags.bits.username = 1;
+	if (options->password.cstring || options->password.lenstring.data)
+		flags.bits.password = 1;
+
+	MQTTPacketWriter_char(&w, flags.all);
+	MQTTPacketWriter_int(&w, options->keepAliveInterval);
+	MQTTPacketWriter_string(&w, options->clientID);
+	if (options->willFlag)
+	{
+		MQTTPacketWriter_string(&w, options->will.topicName);
+		MQTTPacketWriter_string(&w, options->will.message);
+	}
+	if (flags.bits.username)
+		MQTTPacketWriter_string(&w, options->username);
+	if (flags.bits.password)
+		MQTTPacketWriter_string(&w, options->password);
+
+	header.byte = 0;
+	header.bits.type = CONNECT;
+	return MQTTPacketWriter_finish(&w, header.byte, packet);
+}
+
+
 /**
   * Deserializes the supplied (wire) buffer into connack data - return code
   * @param sessionPresent the session present flag returned (only for MQTT 3.1.1)
@@ -143,7 +200,8 @@ int MQTTDeserialize_connack(unsigned char* sessionPresent, unsigned char* connac
 	if (header.bits.type != CONNACK)
 		goto exit;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	if (MQTTPacket_decodeLen(&curdata, buf + buflen, &mylen) < 0 || mylen > buf + buflen - curdata) /* read remaining length */
+		goto exit;
 	enddata = curdata + mylen;
 	if (enddata - curdata < 2)
 		goto exit;
@@ -64,7 +64,8 @@ int MQTTDeserialize_connect(MQTTPacket_connectData* data, unsigned char* buf, in
 	if (header.bits.type != CONNECT)
 		goto exit;
 
-	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	if (MQTTPacket_decodeLen(&curdata, enddata, &mylen) < 0) /* read remaining length */
+		goto exit;
 
 	if (!readMQTTLenString(&Protocol, &curdata, enddata) ||
 		enddata - curdata < 0) /* do we have enough data to read the protocol version byte? */
@@ -50,7 +50,8 @@ int MQTTDeserialize_publish(unsigned char* dup, int* qos, unsigned char* retaine
 	*qos = header.bits.qos;
 	*retained = header.bits.retain;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	if (MQTTPacket_decodeLen(&curdata, buf + buflen, &mylen) < 0 || mylen > buf + buflen - curdata) /* read remaining length */
+		goto exit;
 	enddata = curdata + mylen;
 
 	if (!readMQTTLenString(topicName, &curdata, enddata) ||
@@ -92,7 +93,8 @@ int MQTTDeserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned
 	*dup = header.bits.dup;
 	*packettype = header.bits.type;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	if (MQTTPacket_decodeLen(&curdata, buf + buflen, &mylen) < 0 || mylen > buf + buflen - curdata) /* read remaining length */
+		goto exit;
 	enddata = curdata + mylen;
 
 	if (enddata - curdata < 2)
@@ -16,6 +16,7 @@
 
 #include "StackTrace.h"
 #include "MQTTPacket.h"
+#include "heap_conf.h"
 
 #include <string.h>
 
@@ -34,6 +35,8 @@ const char* MQTTPacket_getName(unsigned short packetid)
 }
 
 
+// Debug formatters use snprintf, which links the allocator of the C library
+#if NO_HEAP == 0
 int MQTTStringFormat_connect(char* strbuf, int strbuflen, MQTTPacket_connectData* data)
 {
 	int strindex = 0;
@@ -112,18 +115,22 @@ int MQTTStringFormat_unsubscribe(char* strbuf, int strbuflen, unsigned char dup,
 					dup, packetid, count,
 					topicFilters[0].lenstring.len, topicFilters[0].lenstring.data);
 }
+#endif
 
 
-#if defined(MQTT_CLIENT)
+#if defined(MQTT_CLIENT) && NO_HEAP == 0
 char* MQTTFormat_toClientString(char* strbuf, int strbuflen, unsigned char* buf, int buflen)
 {
 	int index = 0;
 	int rem_length = 0;
 	MQTTHeader header = {0};
 	int strindex = 0;
+	unsigned char* curdata = &buf[1];
 
 	header.byte = buf[index++];
-	index += MQTTPacket_decodeBuf(&buf[index], &rem_length);
+	if (MQTTPacket_decodeLen(&curdata, buf + buflen, &rem_length) < 0)
+		return strbuf;
+	index = curdata - buf;
 
 	switch (header.bits.type)
 	{
@@ -184,16 +191,19 @@ char* MQTTFormat_toClientString(char* strbuf, int strbuflen, unsigned char* buf,
 }
 #endif
 
-#if defined(MQTT_SERVER)
+#if defined(MQTT_SERVER) && NO_HEAP == 0
 char* MQTTFormat_toServerString(char* strbuf, int strbuflen, unsigned char* buf, int buflen)
 {
 	int index = 0;
 	int rem_length = 0;
 	MQTTHeader header = {0};
 	int strindex = 0;
+	unsigned char* curdata = &buf[1];
 
 	header.byte = buf[index++];
-	index += MQTTPacket_decodeBuf(&buf[index], &rem_length);
+	if (MQTTPacket_decodeLen(&curdata, buf + buflen, &rem_length) < 0)
+		return strbuf;
+	index = curdata - buf;
 
 	switch (header.bits.type)
 	{
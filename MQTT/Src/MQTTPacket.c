@@ -20,6 +20,8 @@
 
 #include <string.h>
 
+#define MAX_NO_OF_REMAINING_LENGTH_BYTES 4
+
 /**
  * Encodes the message length according to the MQTT algorithm
  * @param buf the buffer into which the encoded data is written
@@ -56,7 +58,6 @@ int MQTTPacket_decode(int (*getcharfn)(unsigned char*, int), int* value)
 	unsigned char c;
 	int multiplier = 1;
 	int len = 0;
-#define MAX_NO_OF_REMAINING_LENGTH_BYTES 4
 
 	FUNC_ENTRY;
 	*value = 0;
@@ -98,22 +99,58 @@ int MQTTPacket_len(int rem_len)
 }
 
 
-static unsigned char* bufptr;
-
-int bufchar(unsigned char* c, int count)
+/**
+ * Decodes the message length according to the MQTT algorithm straight from a buffer.
+ * Reentrant, the cursor is kept by the caller and no byte at or behind enddata is read.
+ * @param pptr pointer to the input buffer - incremented by the number of bytes used
+ * @param enddata pointer to the end of the data in the buffer
+ * @param value the decoded length returned
+ * @return the number of bytes used, or MQTTPACKET_READ_ERROR if the length is malformed or truncated
+ */
+int MQTTPacket_decodeLen(unsigned char** pptr, unsigned char* enddata, int* value)
 {
-	int i;
+	unsigned char* ptr = *pptr;
+	unsigned char* end = enddata;
+	int result = 0;
+	int shift = 0;
+	unsigned char c;
 
-	for (i = 0; i < count; ++i)
-		*c = *bufptr++;
-	return count;
+	/* lengths below 128, every ack and short publish */
+	if (ptr < enddata && (*ptr & 128) == 0)
+	{
+		*value = *ptr;
+		*pptr = ptr + 1;
+		return 1;
+	}
+
+	if (end - ptr > MAX_NO_OF_REMAINING_LENGTH_BYTES)
+		end = ptr + MAX_NO_OF_REMAINING_LENGTH_BYTES;
+
+	do
+	{
+		if (ptr >= end)
+			return MQTTPACKET_READ_ERROR;
+
+		c = *ptr++;
+		result |= (c & 127) << shift;
+		shift += 7;
+	} while (c & 128);
+
+	*value = result;
+	*pptr = ptr;
+	return shift / 7;
 }
 
 
+/**
+ * Decodes the message length of a complete packet in a buffer
+ * @param buf the buffer holding the remaining length field
+ * @param value the decoded length returned
+ * @return the number of bytes used, or MQTTPACKET_READ_ERROR if the length is malformed
+ */
 int MQTTPacket_decodeBuf(unsigned char* buf, int* value)
 {
-	bufptr = buf;
-	return MQTTPacket_decode(bufchar, value);
+	return MQTTPacket_decodeLen(&buf, buf + MAX_NO_OF_REMAINING_LENGTH_BYTES, value);
 }
 
 
@@ -206,6 +243,160 @@ void writeMQTTString(unsigned char** pptr, MQTTString mqttstring)
 }
 
 
+/**
+ * Starts a single-pass serialization. The variable header and payload are written behind a slot
+ * of MQTTPACKET_HEADER_SLOT bytes, the fixed header is filled in by MQTTPacketWriter_finish once
+ * the remaining length is known, so nothing has to be measured beforehand.
+ * @param w the writer to be initialized
+ * @param buf the buffer into which the packet will be serialized
+ * @param buflen the length in bytes of the supplied buffer
+ */
+void MQTTPacketWriter_init(MQTTPacketWriter* w, unsigned char* buf, int buflen)
+{
+	w->buf = buf;
+	w->ptr = buf + MQTTPACKET_HEADER_SLOT;
+	w->end = buf + buflen;
+	w->rc = (buflen < MQTTPACKET_HEADER_SLOT) ? MQTTPACKET_BUFFER_TOO_SHORT : 0;
+}
+
+
+/**
+ * Reserves the next bytes of the packet. Once a field did not fit, every further field is refused.
+ * @param w the writer
+ * @param len the number of bytes
+ * @return pointer to the reserved bytes, or NULL if the buffer is too short
+ */
+unsigned char* MQTTPacketWriter_reserve(MQTTPacketWriter* w, int len)
+{
+	unsigned char* ptr = w->ptr;
+
+	if (w->rc < 0 || w->end - ptr < len)
+	{
+		w->rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		return NULL;
+	}
+	w->ptr += len;
+	return ptr;
+}
+
+
+/**
+ * Writes one character to the packet.
+ * @param w the writer
+ * @param c the character to write
+ */
+void MQTTPacketWriter_char(MQTTPacketWriter* w, char c)
+{
+	unsigned char* ptr = MQTTPacketWriter_reserve(w, 1);
+
+	if (ptr)
+		*ptr = c;
+}
+
+
+/**
+ * Writes an integer as 2 bytes to the packet.
+ * @param w the writer
+ * @param anInt the integer to write
+ */
+void MQTTPacketWriter_int(MQTTPacketWriter* w, int anInt)
+{
+	unsigned char* ptr = MQTTPacketWriter_reserve(w, 2);
+
+	if (ptr)
+	{
+		ptr[0] = (unsigned char)(anInt / 256);
+		ptr[1] = (unsigned char)(anInt % 256);
+	}
+}
+
+
+/**
+ * Writes bytes to the packet as they are.
+ * @param w the writer
+ * @param data the bytes to write
+ * @param len the number of bytes
+ */
+void MQTTPacketWriter_bytes(MQTTPacketWriter* w, const void* data, int len)
+{
+	unsigned char* ptr = MQTTPacketWriter_reserve(w, len);
+
+	if (ptr && len > 0)
+		memcpy(ptr, data, len);
+}
+
+
+/**
+ * Writes a length-delimited string to the packet. The length of a C string is taken once and
+ * used for the bounds check, the length field and the copy.
+ * @param w the writer
+ * @param mqttstring the string to write
+ */
+void MQTTPacketWriter_string(MQTTPacketWriter* w, MQTTString mqttstring)
+{
+	const char* data = mqttstring.lenstring.data;
+	int len = mqttstring.lenstring.len;
+	unsigned char* ptr;
+
+	if (len <= 0)
+	{
+		data = mqttstring.cstring;
+		len = data ? strlen(data) : 0;
+	}
+
+	if ((ptr = MQTTPacketWriter_reserve(w, 2 + len)) != NULL)
+	{
+		ptr[0] = (unsigned char)(len / 256);
+		ptr[1] = (unsigned char)(len % 256);
+		memcpy(ptr + 2, data, len);
+	}
+}
+
+
+/**
+ * Completes a single-pass serialization. The remaining length is encoded right in front of the
+ * variable header and the header byte in front of it, so the packet starts 0 to 3 bytes into buf.
+ * @param w the writer
+ * @param header the header byte of the packet
+ * @param packet returns the start of the packet within buf. NULL moves the packet to the start
+ * of buf instead, which copies it once more.
+ * @return the length of the serialized packet.  <= 0 indicates error
+ */
+int MQTTPacketWriter_finish(MQTTPacketWriter* w, unsigned char header, unsigned char** packet)
+{
+	unsigned char* body = w->buf + MQTTPACKET_HEADER_SLOT;
+	unsigned char* start;
+	int rem_len = w->ptr - body;
+	int rc = w->rc;
+
+	FUNC_ENTRY;
+	if (rc < 0)
+		goto exit;
+
+	if (rem_len < 128)
+		start = body - 2;
+	else if (rem_len < 16384)
+		start = body - 3;
+	else if (rem_len < 2097152)
+		start = body - 4;
+	else
+		start = body - 5;
+
+	start[0] = header;
+	MQTTPacket_encode(start + 1, rem_len);
+	rc = w->ptr - start;
+
+	if (packet)
+		*packet = start;
+	else if (start != w->buf)
+		memmove(w->buf, start, rc);
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 /**
  * @param mqttstring the MQTTString structure into which the data is to be read
  * @param pptr pointer to the output buffer - incremented by the number of bytes used & returned
@@ -279,6 +470,103 @@ int MQTTPacket_equals(MQTTString* a, char* bptr)
 }
 
 
+/**
+ * Hashes a topic with FNV-1a over its last MQTTTOPIC_HASH_SPAN characters, backwards. Topics of
+ * one device usually share their first levels, so the end tells them apart.
+ * MQTTTOPIC_HASH_LITERAL gives the same hash for a string literal at compile time.
+ * @param data the topic, not terminated
+ * @param len the length of the topic
+ * @return the hash
+ */
+unsigned int MQTTTopic_hash(const char* data, int len)
+{
+	unsigned int hash = MQTTTOPIC_HASH_BASIS;
+	int i;
+
+	for (i = 0; i < len && i < MQTTTOPIC_HASH_SPAN; ++i)
+		hash = (hash ^ (unsigned char)data[len - 1 - i]) * MQTTTOPIC_HASH_PRIME;
+	return hash;
+}
+
+
+/**
+ * Sets up a descriptor for a topic known at runtime, e.g. to be published several times.
+ * @param topic the descriptor to be set up
+ * @param data the topic, not terminated. Has to stay valid while the descriptor is used.
+ * @param len the length of the topic
+ */
+void MQTTTopic_init(MQTTTopic* topic, const char* data, int len)
+{
+	topic->data = data;
+	topic->prefixed = NULL;
+	topic->len = len;
+	topic->hash = MQTTTopic_hash(data, len);
+}
+
+
+/**
+ * Compares two topic descriptors, the characters only if length and hash are equal.
+ * @param a the first topic
+ * @param b the second topic
+ * @return boolean - equal or not
+ */
+int MQTTTopic_equals(const MQTTTopic* a, const MQTTTopic* b)
+{
+	return a->len == b->len && a->hash == b->hash && memcmp(a->data, b->data, a->len) == 0;
+}
+
+
+/**
+ * Compares a topic descriptor to a topic name, e.g. of a received publish.
+ * @param topic the topic descriptor
+ * @param name the topic name
+ * @return boolean - equal or not
+ */
+int MQTTTopic_equalsString(const MQTTTopic* topic, MQTTString* name)
+{
+	const char* data = name->lenstring.data;
+	int len = name->lenstring.len;
+
+	if (name->cstring)
+	{
+		data = name->cstring;
+		len = strlen(data);
+	}
+	return topic->len == len && memcmp(topic->data, data, len) == 0;
+}
+
+
+/**
+ * Looks up a topic name in a list of descriptors. The name is hashed once, the characters are
+ * only compared for a descriptor of the same length and hash.
+ * @param topics the topic descriptors
+ * @param count the number of descriptors
+ * @param name the topic name, e.g. of a received publish
+ * @return the index of the matching descriptor, or -1
+ */
+int MQTTTopic_find(const MQTTTopic* const topics[], int count, MQTTString* name)
+{
+	const char* data = name->lenstring.data;
+	int len = name->lenstring.len;
+	unsigned int hash;
+	int i;
+
+	if (name->cstring)
+	{
+		data = name->cstring;
+		len = strlen(data);
+	}
+
+	hash = MQTTTopic_hash(data, len);
+	for (i = 0; i < count; ++i)
+	{
+		if (topics[i]->len == len && topics[i]->hash == hash && memcmp(topics[i]->data, data, len) == 0)
+			return i;
+	}
+	return -1;
+}
+
+
 /**
  * Helper function to read packet data from some source into a buffer
  * @param buf the buffer into which the packet will be serialized
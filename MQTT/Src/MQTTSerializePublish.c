@@ -91,6 +91,220 @@ exit:
 }
 
 
+/**
+  * Serializes the supplied publish data in a single pass, see MQTTPacketWriter_init. Topic and
+  * payload are copied once and the topic length is not measured beforehand.
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param topicName MQTTString - the MQTT topic in the publish
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @param packet returns the start of the packet within buf, NULL to move it to the start of buf
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTSerialize_publishSinglePass(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		MQTTString topicName, const unsigned char* payload, int payloadlen, unsigned char** packet)
+{
+	MQTTPacketWriter w;
+	MQTTHeader header = {0};
+
+	MQTTPacketWriter_init(&w, buf, buflen);
+	MQTTPacketWriter_string(&w, topicName);
+	if (qos > 0)
+		MQTTPacketWriter_int(&w, packetid);
+	MQTTPacketWriter_bytes(&w, payload, payloadlen);
+
+	header.bits.type = PUBLISH;
+	header.bits.dup = dup;
+	header.bits.qos = qos;
+	header.bits.retain = retained;
+	return MQTTPacketWriter_finish(&w, header.byte, packet);
+}
+
+
+
+/**
+  * Serializes the supplied publish data as a list of segments, ready for sending without copying
+  * topic and payload. Only the fixed header, the topic length and the packet id are written to
+  * the supplied buffer, the other segments point to the caller's memory.
+  * @param buf the buffer for the header bytes, at least MQTT_PUBLISHV_HEADER_LEN bytes
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param topicName MQTTString - the MQTT topic in the publish
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @param iov the segment list to be filled, in sending order
+  * @param iovcnt the number of entries in iov, at least MQTT_PUBLISHV_SEGMENTS
+  * @return the number of segments used.  <= 0 indicates error
+  */
+int MQTTSerialize_publishv(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		MQTTString topicName, const unsigned char* payload, int payloadlen, MQTTIovec* iov, int iovcnt)
+{
+	MQTTTopic topic = {NULL, NULL, 0, 0};
+
+	if (topicName.lenstring.len > 0)
+	{
+		topic.data = topicName.lenstring.data;
+		topic.len = topicName.lenstring.len;
+	}
+	else if (topicName.cstring)
+	{
+		topic.data = topicName.cstring;
+		topic.len = strlen(topicName.cstring);
+	}
+
+	return MQTTSerialize_publishvTopic(buf, buflen, dup, qos, retained, packetid, &topic, payload, payloadlen, iov, iovcnt);
+}
+
+
+/**
+  * Serializes the supplied publish data as a list of segments for a topic descriptor. The topic
+  * length is taken from the descriptor, and if it holds the length prefix, the prefix is sent
+  * together with the topic.
+  * @param buf the buffer for the header bytes, at least MQTT_PUBLISHV_HEADER_LEN bytes
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param topic the topic descriptor
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @param iov the segment list to be filled, in sending order
+  * @param iovcnt the number of entries in iov, at least MQTT_PUBLISHV_SEGMENTS
+  * @return the number of segments used.  <= 0 indicates error
+  */
+int MQTTSerialize_publishvTopic(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		const MQTTTopic* topic, const unsigned char* payload, int payloadlen, MQTTIovec* iov, int iovcnt)
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (buflen < MQTT_PUBLISHV_HEADER_LEN || iovcnt < MQTT_PUBLISHV_SEGMENTS)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.bits.type = PUBLISH;
+	header.bits.dup = dup;
+	header.bits.qos = qos;
+	header.bits.retain = retained;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, 2 + topic->len + payloadlen + ((qos > 0) ? 2 : 0)); /* write remaining length */
+
+	if (topic->prefixed)
+	{
+		iov[rc].data = buf;
+		iov[rc++].len = ptr - buf;
+		iov[rc].data = topic->prefixed;
+		iov[rc++].len = 2 + topic->len;
+	}
+	else
+	{
+		writeInt(&ptr, topic->len);
+		iov[rc].data = buf;
+		iov[rc++].len = ptr - buf;
+
+		if (topic->len > 0)
+		{
+			iov[rc].data = (const unsigned char*)topic->data;
+			iov[rc++].len = topic->len;
+		}
+	}
+
+	if (qos > 0)
+	{
+		iov[rc].data = ptr;
+		iov[rc++].len = 2;
+		writeInt(&ptr, packetid);
+	}
+
+	if (payloadlen > 0)
+	{
+		iov[rc].data = payload;
+		iov[rc++].len = payloadlen;
+	}
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
+/**
+  * Serializes the supplied publish data for a topic descriptor into the supplied buffer. The
+  * descriptor holds the topic length, so the remaining length is known up front and the packet
+  * is written in place at the start of buf, in one pass and without a header slot.
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param qos integer - the MQTT QoS value
+  * @param retained integer - the MQTT retained flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param topic the topic descriptor
+  * @param payload byte buffer - the MQTT publish payload
+  * @param payloadlen integer - the length of the MQTT payload
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTSerialize_publishTopic(unsigned char* buf, int buflen, unsigned char dup, int qos, unsigned char retained, unsigned short packetid,
+		const MQTTTopic* topic, const unsigned char* payload, int payloadlen)
+{
+	unsigned char *ptr = buf;
+	MQTTHeader header = {0};
+	int rem_len = 2 + topic->len + payloadlen + ((qos > 0) ? 2 : 0);
+	int rc = 0;
+
+	FUNC_ENTRY;
+	if (MQTTPacket_len(rem_len) > buflen)
+	{
+		rc = MQTTPACKET_BUFFER_TOO_SHORT;
+		goto exit;
+	}
+
+	header.bits.type = PUBLISH;
+	header.bits.dup = dup;
+	header.bits.qos = qos;
+	header.bits.retain = retained;
+	writeChar(&ptr, header.byte); /* write header */
+
+	ptr += MQTTPacket_encode(ptr, rem_len); /* write remaining length */
+
+	if (topic->prefixed)
+		memcpy(ptr, topic->prefixed, 2 + topic->len);
+	else
+	{
+		ptr[0] = (unsigned char)(topic->len / 256);
+		ptr[1] = (unsigned char)(topic->len % 256);
+		memcpy(ptr + 2, topic->data, topic->len);
+	}
+	ptr += 2 + topic->len;
+
+	if (qos > 0)
+		writeInt(&ptr, packetid);
+
+	if (payloadlen > 0)
+		memcpy(ptr, payload, payloadlen);
+	ptr += payloadlen;
+
+	rc = ptr - buf;
+
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
+
+
 
 /**
   * Serializes the ack packet into the supplied buffer.
@@ -86,6 +86,41 @@ exit:
 }
 
 
+/**
+  * Serializes the supplied subscribe data in a single pass, see MQTTPacketWriter_init.
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied buffer
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param count - number of members in the topicFilters and reqQos arrays
+  * @param topicFilters - array of topic filter names
+  * @param requestedQoSs - array of requested QoS
+  * @param packet returns the start of the packet within buf, NULL to move it to the start of buf
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTSerialize_subscribeSinglePass(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid, int count,
+		MQTTString topicFilters[], int requestedQoSs[], unsigned char** packet)
+{
+	MQTTPacketWriter w;
+	MQTTHeader header = {0};
+	int i = 0;
+
+	MQTTPacketWriter_init(&w, buf, buflen);
+	MQTTPacketWriter_int(&w, packetid);
+
+	for (i = 0; i < count; ++i)
+	{
+		MQTTPacketWriter_string(&w, topicFilters[i]);
+		MQTTPacketWriter_char(&w, requestedQoSs[i]);
+	}
+
+	header.bits.type = SUBSCRIBE;
+	header.bits.dup = dup;
+	header.bits.qos = 1;
+	return MQTTPacketWriter_finish(&w, header.byte, packet);
+}
+
+
 
 /**
   * Deserializes the supplied (wire) buffer into suback data
@@ -110,7 +145,8 @@ int MQTTDeserialize_suback(unsigned short* packetid, int maxcount, int* count, i
 	if (header.bits.type != SUBACK)
 		goto exit;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	if (MQTTPacket_decodeLen(&curdata, buf + buflen, &mylen) < 0 || mylen > buf + buflen - curdata) /* read remaining length */
+		goto exit;
 	enddata = curdata + mylen;
 	if (enddata - curdata < 2)
 		goto exit;
@@ -47,7 +47,8 @@ int MQTTDeserialize_subscribe(unsigned char* dup, unsigned short* packetid, int
 		goto exit;
 	*dup = header.bits.dup;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	if (MQTTPacket_decodeLen(&curdata, buf + buflen, &mylen) < 0 || mylen > buf + buflen - curdata) /* read remaining length */
+		goto exit;
 	enddata = curdata + mylen;
 
 	*packetid = readInt(&curdata);
@@ -46,7 +46,8 @@ int MQTTDeserialize_unsubscribe(unsigned char* dup, unsigned short* packetid, in
 		goto exit;
 	*dup = header.bits.dup;
 
-	curdata += (rc = MQTTPacket_decodeBuf(curdata, &mylen)); /* read remaining length */
+	if (MQTTPacket_decodeLen(&curdata, buf + len, &mylen) < 0 || mylen > buf + len - curdata) /* read remaining length */
+		goto exit;
 	enddata = curdata + mylen;
 
 	*packetid = readInt(&curdata);
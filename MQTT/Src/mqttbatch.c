@@ -0,0 +1,174 @@
+/**
+  ************************************************************************************************
+  * @file           : mqttbatch.c
+  * @brief          : This file contains the batching of publishes. Packets are serialized into
+  *                   the open pool block until it is filled to MQTT_BATCH_THRESHOLD, the next
+  *                   packet does not fit, the first one waited MQTT_BATCH_DEADLINE, or a flush
+  *                   is asked for. Every wait for the broker and every other packet flushes the
+  *                   block first, so the order on the wire stays the order of the calls.
+  ************************************************************************************************
+*/
+
+
+// Includes
+#include <mqttbatch.h>
+#include <mqttclient.h>
+#include <mqtttemplate.h>
+#include "uart_com.h"
+
+
+// Checks of the threshold
+_Static_assert(MQTT_BATCH_THRESHOLD <= MQTT_PacketBuffSize, "Threshold has to fit into a pool block");
+
+
+// Private variables
+static uint8_t *batch_Block = NULL;         // open block, NULL if nothing is batched
+static uint16_t batch_Fill = 0;
+static uint16_t batch_OpenedAt = 0;         // low 16 bits of the tick of the first packet
+
+MQTT_BatchStatsTypeDef mqtt_BatchStats;
+
+
+
+/**
+  * @brief  Function to get the open block for a new packet. A block whose first packet waited
+  *         too long is sent first.
+  * @retval Block, NULL if the pool is empty
+  */
+static uint8_t *mqtt_BatchOpen(void)
+{
+	if (batch_Block != NULL && (uint16_t) ((uint16_t) HAL_GetTick() - batch_OpenedAt) >= MQTT_BATCH_DEADLINE)
+		mqtt_BatchFlush();
+
+	if (batch_Block == NULL && (batch_Block = buf_Alloc(BUF_OWNER_MQTT)) != NULL)
+	{
+		batch_Fill = 0;
+		batch_OpenedAt = (uint16_t) HAL_GetTick();
+	}
+
+	return batch_Block;
+}
+
+
+/**
+  * @brief  Function to take a packet serialized at the end of the open block.
+  * @param len: Packet length
+  * @retval Packet length
+  */
+static int mqtt_BatchAdd(int len)
+{
+	batch_Fill += len;
+	mqtt_BatchStats.packets++;
+
+	if (batch_Fill >= MQTT_BATCH_THRESHOLD)
+		mqtt_BatchFlush();
+
+	return len;
+}
+
+
+/**
+  * @brief  Function to add a publish to the batch. Topic and payload are copied into the block,
+  *         the caller's memory is free again on return. A publish longer than a block is sent
+  *         on its own after the block.
+  * @param topic: Topic descriptor
+  * @param payload: Data to be published
+  * @param len: Length of data
+  * @param qos: QoS of the publish
+  * @param dup: 1 if the publish was sent before
+  * @param packetId: Packet id, unused for QoS 0
+  * @retval Packet length, -1 if the packet could not be queued
+  */
+int mqtt_BatchPublish(const MQTTTopic *topic, const uint8_t *payload, uint16_t len, uint8_t qos, uint8_t dup, uint16_t packetId)
+{
+	uint8_t *block;
+	int packetLen;
+	uint8_t tries;
+
+	// Second try in a new block, if the rest of the open one was too short
+	for (tries = 0; tries < 2 && (block = mqtt_BatchOpen()) != NULL; tries++)
+	{
+		packetLen = MQTTSerialize_publishTopic(block + batch_Fill, MQTT_PacketBuffSize - batch_Fill, dup, qos, 0, packetId,
+				topic, payload, len);
+
+		if (packetLen > 0)
+			return mqtt_BatchAdd(packetLen);
+
+		if (batch_Fill == 0)
+			break;
+
+		mqtt_BatchFlush();
+	}
+
+	mqtt_BatchStats.direct++;
+
+	return mqtt_TransmitPublishId(topic, payload, len, qos, dup, packetId);
+}
+
+
+/**
+  * @brief  Function to add an acknowledgement, e.g. the PUBREL of a QoS 2 publish, to the batch.
+  * @param type: Packet type
+  * @param packetId: Packet id
+  * @retval Packet length, -1 if the packet could not be queued
+  */
+int mqtt_BatchAck(uint8_t type, uint16_t packetId)
+{
+	uint8_t packet[4];
+	MQTTIovec iov = { packet, 0 };
+	uint8_t *block;
+	int packetLen;
+
+	if ((block = mqtt_BatchOpen()) != NULL && MQTT_PacketBuffSize - batch_Fill < (int) sizeof(packet))
+	{
+		mqtt_BatchFlush();
+		block = mqtt_BatchOpen();
+	}
+
+	if (block != NULL && (packetLen = MQTTSerialize_ack(block + batch_Fill, sizeof(packet), type, 0, packetId)) > 0)
+		return mqtt_BatchAdd(packetLen);
+
+	iov.len = MQTTSerialize_ack(packet, sizeof(packet), type, 0, packetId);
+
+	return mqtt_transport_sendPacketVector(&iov, 1);
+}
+
+
+/**
+  * @brief  Function to hand the open block to the DMA. The block is freed when it was transmitted.
+  * @retval 1 if nothing was batched or the block was queued
+  */
+uint8_t mqtt_BatchFlush(void)
+{
+	uint8_t *block = batch_Block;
+	uint16_t len = batch_Fill;
+
+	if (block == NULL)
+		return 1;
+
+	batch_Block = NULL;
+	batch_Fill = 0;
+
+	if (uart_TxEnqueueBlock(&ESP_TxQueue, block, len) != HAL_OK)
+		return 0;
+
+	if (len > 0)
+	{
+		mqtt_BatchStats.transmits++;
+		mqtt_BatchStats.bytes += len;
+	}
+
+	return 1;
+}
+
+
+/**
+  * @brief  Function to print the packets per transmission and the bytes per transmission.
+  * @retval None
+  */
+void mqtt_BatchPrintStats(void)
+{
+	pc_printf("Batch: %u packets in %u transmits, %lu bytes per transmit, %u sent on their own\r\n",
+			mqtt_BatchStats.packets, mqtt_BatchStats.transmits,
+			mqtt_BatchStats.transmits ? mqtt_BatchStats.bytes / mqtt_BatchStats.transmits : 0, mqtt_BatchStats.direct);
+}
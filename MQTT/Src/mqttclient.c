@@ -8,132 +8,320 @@
 
 // Includes
 #include <stdlib.h>
+#include <string.h>
 #include <mqttclient.h>
+#include <mqtttemplate.h>
+#include <mqttinflight.h>
+#include <mqttbatch.h>
 #include <MQTTConnect.h>
 #include <MQTTPacket.h>
 #include <transport.h>
 #include <net_conf.h>
 #include "uart_com.h"
+#include "wait.h"
 #include "main.h"
 
 
 // Global variables
 int mqtt_transport_publishGetData(uint8_t *buf, int buflen);
-uint32_t mqtt_msgId = 0;
-uint8_t mqtt_PacketBuf[MQTT_PacketBuffSize];
-
-int mqtt_buflen = MQTT_PacketBuffSize;
 int mqtt_serialLen = 0;
 char responMsg = -1;
 int packageID = 0;
 int packagePos;
 
 
+// Private variables
+static uint32_t mqtt_RxDiscard = 0;       // bytes of a packet too long for the buffer still to be dropped
+
+
 
 /**
-  * @brief  Function to transmit packet to broker
-  * @param buf: Buffer with package
-  * @param buflen: Length of buffer
-  * @retval Buffer length
+  * @brief  Function to transmit packet to broker. The packet was serialized into a pool block,
+  *         the block is handed to the DMA without copy and freed when it was transmitted.
+  *         Batched publishes are sent before.
+  * @param block: Pool block with package
+  * @param buflen: Length of package, the block is freed if it is not positive
+  * @retval Package length, -1 if the packet could not be queued
   */
-int mqtt_transport_sendPacketBuffer(uint8_t *buf, int buflen)
+int mqtt_transport_sendPacketBlock(uint8_t *block, int buflen)
 {
-	// MQTT Head may have 0x00
-	ESP_RecvEndFlag = 0;
-	memset(ESP_RxBUF, 0, ESP_MAX_RECVLEN);
+	mqtt_BatchFlush();
+
+	if (buflen <= 0)
+	{
+		buf_Free(block);
+		return -1;
+	}
 
-	HAL_UART_Transmit(&huart1, buf, buflen, 0xff);
+	if (uart_TxEnqueueBlock(&ESP_TxQueue, block, buflen) != HAL_OK)
+		return -1;
 
 	return buflen;
 }
 
 
 /**
-  * @brief  Function to receive packet from broker
-  * @param buf: Buffer with received package
-  * @param buflen: Length of received buffer
-  * @retval Buffer length
+  * @brief  Function to transmit a packet given as list of segments to broker. Short segments are
+  *         copied to the transmit arena, long ones are sent straight from the caller's memory.
+  *         Waits until the transmission is done if RAM of the caller is referenced, flash can
+  *         be sent in the background. Batched publishes are sent before. Space for all segments
+  *         is reserved first, a part of the packet in the TCP stream would desync the broker.
+  * @param iov: Segments of packet in sending order
+  * @param count: Number of segments
+  * @retval Packet length, -1 if the packet could not be queued
   */
-int mqtt_transport_getdata(uint8_t *buf, int buflen) {
+int mqtt_transport_sendPacketVector(const MQTTIovec *iov, int count)
+{
+	int i, len = 0;
+	int entries = 0, copyLen = 0;
+	uint8_t wait = 0;
+	HAL_StatusTypeDef status;
+
+	mqtt_BatchFlush();
 
-	if (ESP_RecvEndFlag == 1) {
-		memcpy(buf, (const char*) ESP_RxBUF, buflen);
+	for (i = 0; i < count; i++)
+	{
+		if (iov[i].len == 0)
+			continue;
+
+		entries++;
 
-		//pc_printf(&buf);
-		ESP_RxLen = 0;
-		ESP_RecvEndFlag = 0;
-		memset(ESP_RxBUF, 0, ESP_MAX_RECVLEN);
+		if (iov[i].len <= MQTT_IovCopyMax)
+			copyLen += iov[i].len;
 	}
 
-	return buflen;
+	if (entries > UART_TX_QUEUE_DEPTH || uart_TxReserve(&ESP_TxQueue, entries, copyLen) != HAL_OK)
+		return -1;
+
+	for (i = 0; i < count; i++)
+	{
+		if (iov[i].len <= MQTT_IovCopyMax)
+		{
+			status = uart_TxEnqueue(&ESP_TxQueue, iov[i].data, iov[i].len, NULL, NULL);
+		}
+		else
+		{
+			status = uart_TxEnqueueRef(&ESP_TxQueue, iov[i].data, iov[i].len, NULL, NULL);
+
+			if ((uintptr_t) iov[i].data >= SRAM_BASE)
+				wait = 1;
+		}
+
+		if (status != HAL_OK)
+			return -1;
+
+		len += iov[i].len;
+	}
+
+	if (wait && uart_TxFlush(&ESP_TxQueue, MQTT_TxTimeout) == 0)
+		return -1;
+
+	return len;
 }
 
 
 /**
-  * @brief  Function to connect to a MQTT broker
-  * @retval Connection result, 1 on success
+  * @brief  Function to read the next packet of the broker from the receive ring. Header and
+  *         remaining length are peeked, nothing is consumed before the whole packet arrived.
+  *         A packet longer than the buffer is dropped, also while it is still arriving.
+  * @param buf: Buffer for the packet
+  * @param buflen: Length of buffer
+  * @retval Packet type, 0 if no whole packet was received yet, -1 if a packet was dropped
   */
-uint8_t mqtt_ConnectServer(void)
+int mqtt_transport_readPacket(uint8_t *buf, int buflen)
 {
-	uint8_t sessionPresent = 0;
-	uint8_t connack_rc = 0;
+	uint8_t header[5];                      // packet type and up to 4 length bytes
+	unsigned char *ptr = &header[1];
+	uint16_t available = esp_RxAvailable();
+	uint16_t peeked;
+	int remLen;
+	uint32_t len;
+
+	if (mqtt_RxDiscard == 0)
+	{
+		if ((peeked = esp_RxPeek(header, sizeof(header))) < 2)
+			return 0;
 
-	MQTTPacket_connectData ConnectData = MQTTPacket_connectData_initializer;
-	ConnectData.clientID.cstring = MQTT_CLIENTID;
-	ConnectData.username.cstring = MQTT_USERNAME;
-	ConnectData.password.cstring = MQTT_PASSWORD;
-	ConnectData.keepAliveInterval = MQTT_KeepAliveInterval;
-	ConnectData.MQTTVersion = 4;
-	ConnectData.cleansession = 1;
+		if (MQTTPacket_decodeLen(&ptr, header + peeked, &remLen) == MQTTPACKET_READ_ERROR)
+		{
+			if (peeked < sizeof(header))
+				return 0;
 
-	pc_printf("Trying to connect MQTT server\r\n");
+			// Length of more than 4 bytes, the stream can not be followed anymore
+			esp_RxFlush();
+			return -1;
+		}
+
+		len = (ptr - header) + remLen;
+
+		if (len <= (uint32_t) buflen)
+		{
+			if (available < len)
+				return 0;
+
+			esp_RxRead(buf, len);
+			return buf[0] >> 4;
+		}
+
+		mqtt_RxDiscard = len;
+	}
+
+	len = available < mqtt_RxDiscard ? available : mqtt_RxDiscard;
+	esp_RxConsume(len);
+	mqtt_RxDiscard -= len;
+
+	return mqtt_RxDiscard == 0 ? -1 : 0;
+}
+
+
+/**
+  * @brief  Function to wait for a packet of the broker. Acknowledgements arriving meanwhile are passed
+  *         to the publishes in flight.
+  * @param type: Packet type to wait for
+  * @param timeout: ms to wait for the packet
+  * @param buf: Pool block the packet is read into
+  * @retval 1 if the packet is in buf, 0 on timeout
+  */
+static uint8_t mqtt_WaitPacket(int type, uint32_t timeout, uint8_t *buf)
+{
+	uint32_t start = HAL_GetTick();
+	uint32_t elapsed;
+	uint16_t left;
+	int rc;
 
-	// Use connack_rc as command length here
-	mqtt_serialLen = MQTTSerialize_connect(mqtt_PacketBuf, MQTT_PacketBuffSize, &ConnectData); // build connect packet
-	mqtt_transport_sendPacketBuffer(mqtt_PacketBuf, mqtt_serialLen);
+	responMsg = -1;
 
-	do
+	while (1)
 	{
-		if (responMsg != CONNACK && MQTT_RecvEndFlag == 1)
+		// Flag is cleared first, data arriving after the reads ends the sleep below
+		MQTT_RecvEndFlag = 0;
+
+		// Several packets may have arrived at once, packets too long for buf are skipped
+		while ((rc = mqtt_transport_readPacket(buf, MQTT_PacketBuffSize)) != 0)
 		{
-			responMsg = MQTTPacket_read(mqtt_PacketBuf, MQTT_PacketBuffSize, mqtt_transport_getdata);
+			if (rc == type)
+			{
+				responMsg = rc;
+				return 1;
+			}
+
+			if (rc > 0)
+				mqtt_InflightHandle(rc, buf);
 		}
 
-	} while (MQTTDeserialize_connack(&sessionPresent, &connack_rc, mqtt_PacketBuf, MQTT_PacketBuffSize) != 1 || connack_rc != 0);
+		// Start of a packet still arriving
+		left = esp_RxAvailable();
+
+		if ((elapsed = HAL_GetTick() - start) >= timeout)
+			return 0;
+
+		// PUBRELs answering the packets above
+		mqtt_BatchFlush();
+
+		// Nothing is slept through that reached the ring since the reads
+		if (esp_RxAvailable() == left)
+			wait_Flag(&MQTT_RecvEndFlag, timeout - elapsed);
+	}
+}
+
 
-	// Enable interrupt again
-	HAL_UART_Receive_DMA(&huart1, ESP_RxBUF, ESP_MAX_RECVLEN);
+/**
+  * @brief  Function to connect to a MQTT broker. With MQTT_CleanSession 0 the broker keeps the
+  *         session while the device sleeps. The CONNECT packet is built at compile time and
+  *         sent straight from flash.
+  * @retval Connection result, 1 on success
+  */
+uint8_t mqtt_ConnectServer(void)
+{
+	uint8_t sessionPresent = 0;
+	uint8_t connack_rc = 0;
+	uint8_t received;
+	uint8_t *packet;
+	MQTTIovec iov = { (const uint8_t*) &mqtt_ConnectTemplate, sizeof(mqtt_ConnectTemplate) };
+
+	pc_printf("Trying to connect MQTT server\r\n");
+
+	if (mqtt_transport_sendPacketVector(&iov, 1) < 0
+			|| (packet = buf_AllocWait(BUF_OWNER_MQTT, MQTT_TxTimeout)) == NULL)
+		return 0;
+
+	received = mqtt_WaitPacket(CONNACK, MQTT_ConnackTimeout, packet) == 1
+			&& MQTTDeserialize_connack(&sessionPresent, &connack_rc, packet, MQTT_PacketBuffSize) == 1;
+	buf_Free(packet);
+
+	if (!received)
+	{
+		pc_printf("No connack\r\n");
+		return 0;
+	}
 
 	if (connack_rc != 0)
 	{
-		pc_printf("connack_rc:%uc\r\n", connack_rc);
+		pc_printf("connack_rc:%u\r\n", connack_rc);
+		return 0;
 	}
 
-	pc_printf("Connect Success!\r\n");
+	pc_printf("Connect Success! Session present: %u\r\n", sessionPresent);
 
 	return 1;
 }
 
 
 /**
-  * @brief  Function to send a publish for a topic
-  * @param topic: Topic to publish for
-  * @param buf: Buffer with data to be published
+  * @brief  Function to send a ping to the broker and wait for its answer
+  * @retval 1 if the broker answered, 0 otherwise
+  */
+uint8_t mqtt_Ping(void)
+{
+	uint8_t *packet = buf_AllocWait(BUF_OWNER_MQTT, MQTT_TxTimeout);
+	uint8_t received;
+
+	if (packet == NULL)
+		return 0;
+
+	mqtt_serialLen = MQTTSerialize_pingreq(packet, MQTT_PacketBuffSize);
+
+	// Block goes to the DMA, the answer is read into a new one
+	if (mqtt_transport_sendPacketBlock(packet, mqtt_serialLen) < 0
+			|| (packet = buf_AllocWait(BUF_OWNER_MQTT, MQTT_TxTimeout)) == NULL)
+		return 0;
+
+	received = mqtt_WaitPacket(PINGRESP, MQTT_PingTimeout, packet);
+	buf_Free(packet);
+
+	return received;
+}
+
+
+/**
+  * @brief  Function to close the connection to the broker. The session is kept by the broker
+  *         if it was opened with MQTT_CleanSession 0.
   * @retval None
   */
-void mqtt_TransmitPublish(char *topic, char *buf)
+void mqtt_Disconnect(void)
 {
-	int length;
-	//char cntString[3];
+	uint8_t *packet = buf_AllocWait(BUF_OWNER_MQTT, MQTT_TxTimeout);
+
+	if (packet == NULL)
+		return;
 
-	MQTTString TopicName = MQTTString_initializer;
-	TopicName.cstring = topic;
+	mqtt_serialLen = MQTTSerialize_disconnect(packet, MQTT_PacketBuffSize);
+	mqtt_transport_sendPacketBlock(packet, mqtt_serialLen);
+	uart_TxFlush(&ESP_TxQueue, MQTT_TxTimeout);
+}
 
-	//sprintf(cntString, "%d", cnt);
 
-	// Serialize package and get length
-	length = MQTTSerialize_publish(mqtt_PacketBuf, MQTT_PacketBuffSize, 0, 0, 0, 1, TopicName, buf, strlen(buf));
+/**
+  * @brief  Function to send a publish for a topic known at runtime. Topic and data are measured
+  *         once and not copied, only the header is built on the stack.
+  * @param topic: Topic to publish for
+  * @param buf: Buffer with data to be published
+  * @retval None
+  */
+void mqtt_TransmitPublish(char *topic, char *buf)
+{
+	MQTTTopic descriptor;
 
-	// Transmit new package to broker
-	mqtt_transport_sendPacketBuffer(mqtt_PacketBuf, length);
+	MQTTTopic_init(&descriptor, topic, strlen(topic));
+	mqtt_TransmitPublishTemplate(&descriptor, (const uint8_t*) buf, strlen(buf));
 }
@@ -0,0 +1,350 @@
+/**
+  ************************************************************************************************
+  * @file           : mqttinflight.c
+  * @brief          : This file contains the QoS 1 and QoS 2 publishes in flight. Several
+  *                   publishes are sent without waiting for their acknowledgement, the device
+  *                   only sleeps once all of them are completed or kept for the next connection.
+  *                   QoS 2 runs PUBLISH, PUBREC, PUBREL, PUBCOMP in the slot of the publish.
+  ************************************************************************************************
+*/
+
+
+// Includes
+#include <mqttinflight.h>
+#include <mqttclient.h>
+#include <mqttbatch.h>
+#include "uart_com.h"
+#include "wait.h"
+
+
+// Checks of the window
+_Static_assert((MQTT_INFLIGHT_WINDOW & (MQTT_INFLIGHT_WINDOW - 1)) == 0,
+		"Window size has to be a power of two, the packet id selects the slot");
+
+
+// Private variables
+static MQTT_InflightTypeDef inflight_Table[MQTT_INFLIGHT_WINDOW];
+static uint8_t inflight_States[MQTT_INFLIGHT_STATE_BYTES];     // 2 bits per slot
+static uint16_t inflight_LastId = 0;
+
+MQTT_InflightStatsTypeDef mqtt_InflightStats;
+
+
+
+/**
+  * @brief  Function to get the slot of a packet id. Ids are handed out in sequence, so the slot
+  *         of a new id is only taken while the publish a window earlier is not completed.
+  * @param packetId: Packet id
+  * @retval Slot
+  */
+static MQTT_InflightTypeDef *mqtt_InflightSlot(uint16_t packetId)
+{
+	return &inflight_Table[packetId & (MQTT_INFLIGHT_WINDOW - 1)];
+}
+
+
+/**
+  * @brief  Function to get the protocol state of a slot.
+  * @param slot: Slot
+  * @retval State
+  */
+static MQTT_InflightStateTypeDef mqtt_InflightGetState(const MQTT_InflightTypeDef *slot)
+{
+	uint8_t bit = (slot - inflight_Table) * MQTT_INFLIGHT_STATE_BITS;
+
+	return (MQTT_InflightStateTypeDef) ((inflight_States[bit / 8] >> (bit % 8)) & 0x03);
+}
+
+
+/**
+  * @brief  Function to set the protocol state of a slot.
+  * @param slot: Slot
+  * @param state: New state
+  * @retval None
+  */
+static void mqtt_InflightSetState(const MQTT_InflightTypeDef *slot, MQTT_InflightStateTypeDef state)
+{
+	uint8_t bit = (slot - inflight_Table) * MQTT_INFLIGHT_STATE_BITS;
+
+	inflight_States[bit / 8] = (inflight_States[bit / 8] & ~(0x03 << (bit % 8))) | (state << (bit % 8));
+}
+
+
+/**
+  * @brief  Function to send the packet the slot waits to be acknowledged: the PUBLISH, or the
+  *         PUBREL once the broker received a QoS 2 publish.
+  * @param slot: Slot in flight
+  * @param dup: 1 if the packet was sent before
+  * @retval 1 if the packet was queued for transmission
+  */
+static uint8_t mqtt_InflightTransmit(MQTT_InflightTypeDef *slot, uint8_t dup)
+{
+	MQTT_InflightStateTypeDef state = mqtt_InflightGetState(slot);
+
+	slot->sentAt = (uint16_t) HAL_GetTick();
+	slot->tries++;
+
+	if (dup)
+		mqtt_InflightStats.resent++;
+
+	// PUBREL has no DUP flag, it is simply sent again
+	if (state == MQTT_INFLIGHT_PUBCOMP)
+		return mqtt_BatchAck(PUBREL, slot->packetId) > 0;
+
+	return mqtt_BatchPublish(slot->topic, slot->payload, slot->len, state == MQTT_INFLIGHT_PUBREC ? 2 : 1,
+			dup, slot->packetId) > 0;
+}
+
+
+/**
+  * @brief  Function to wait for acknowledgements. Packets not acknowledged in time are sent
+  *         again, until MQTT_INFLIGHT_TRIES transmissions on this connection.
+  * @param slot: Slot to be freed, NULL to wait for all
+  * @param timeout: Max time to wait in ms
+  * @retval 1 if the slot, or all slots, are free
+  */
+static uint8_t mqtt_InflightWait(MQTT_InflightTypeDef *slot, uint32_t timeout)
+{
+	uint32_t start = HAL_GetTick();
+	uint32_t now, next;
+	uint16_t age;
+	uint16_t left;
+	uint8_t i, pending;
+
+	while (1)
+	{
+		// Flag is cleared first, data arriving after the poll ends the sleep below
+		MQTT_RecvEndFlag = 0;
+		mqtt_InflightPoll();
+		left = esp_RxAvailable();
+
+		if (slot != NULL && mqtt_InflightGetState(slot) == MQTT_INFLIGHT_FREE)
+			return 1;
+
+		now = HAL_GetTick();
+		next = MQTT_INFLIGHT_RETRY;
+		pending = 0;
+
+		for (i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+		{
+			if (mqtt_InflightGetState(&inflight_Table[i]) == MQTT_INFLIGHT_FREE)
+				continue;
+
+			age = (uint16_t) now - inflight_Table[i].sentAt;
+
+			if (age >= MQTT_INFLIGHT_RETRY && inflight_Table[i].tries < MQTT_INFLIGHT_TRIES)
+			{
+				mqtt_InflightTransmit(&inflight_Table[i], 1);
+				age = 0;
+			}
+
+			// Packets given up on this connection only keep the wait going until their last retry expired
+			if (inflight_Table[i].tries < MQTT_INFLIGHT_TRIES || age < MQTT_INFLIGHT_RETRY)
+			{
+				pending = 1;
+				if (MQTT_INFLIGHT_RETRY - age < next)
+					next = MQTT_INFLIGHT_RETRY - age;
+			}
+		}
+
+		if (!pending || now - start >= timeout)
+			break;
+
+		if (timeout - (now - start) < next)
+			next = timeout - (now - start);
+
+		// Publishes and PUBRELs of this round go out before the acknowledgements are waited for
+		mqtt_BatchFlush();
+
+		// Nothing is slept through that reached the ring since the poll
+		if (esp_RxAvailable() == left)
+			wait_Flag(&MQTT_RecvEndFlag, next);
+	}
+
+	if (slot != NULL)
+		return mqtt_InflightGetState(slot) == MQTT_INFLIGHT_FREE;
+
+	return mqtt_InflightPending() == 0;
+}
+
+
+/**
+  * @brief  Function to send a QoS 1 or QoS 2 publish without waiting for its acknowledgement.
+  *         If the window is full, waits until the exchange in the slot of the new packet id is
+  *         completed.
+  * @param topic: Topic descriptor, has to stay valid until PUBACK or PUBREC
+  * @param payload: Data to be published, flash or RAM, has to stay valid until PUBACK or PUBREC
+  * @param len: Length of data
+  * @param qos: 1 or 2
+  * @retval 1 if the publish was sent, 0 if the window did not drain or the transmission failed
+  */
+uint8_t mqtt_InflightPublish(const MQTTTopic *topic, const uint8_t *payload, uint16_t len, uint8_t qos)
+{
+	uint16_t packetId = inflight_LastId + 1;
+	MQTT_InflightTypeDef *slot;
+
+	// Packet id 0 is not allowed
+	if (packetId == 0)
+		packetId = 1;
+
+	slot = mqtt_InflightSlot(packetId);
+
+	if (mqtt_InflightGetState(slot) != MQTT_INFLIGHT_FREE)
+	{
+		mqtt_InflightStats.stalls++;
+
+		if (!mqtt_InflightWait(slot, MQTT_INFLIGHT_RETRY * MQTT_INFLIGHT_TRIES))
+			return 0;
+	}
+
+	inflight_LastId = packetId;
+
+	slot->topic = topic;
+	slot->payload = payload;
+	slot->len = len;
+	slot->packetId = packetId;
+	slot->tries = 0;
+	mqtt_InflightSetState(slot, qos == 2 ? MQTT_INFLIGHT_PUBREC : MQTT_INFLIGHT_PUBACK);
+	mqtt_InflightStats.published++;
+
+	return mqtt_InflightTransmit(slot, 0);
+}
+
+
+/**
+  * @brief  Function to take a packet read from the broker. PUBACK and PUBCOMP complete the
+  *         exchange of their packet id, PUBREC is answered with PUBREL. Other packets are left
+  *         to the caller.
+  * @param type: Packet type of mqtt_transport_readPacket
+  * @param packet: Packet
+  * @retval 1 if the packet was taken
+  */
+uint8_t mqtt_InflightHandle(int type, uint8_t *packet)
+{
+	unsigned char ackType, dup;
+	unsigned short packetId;
+	MQTT_InflightTypeDef *slot;
+	MQTT_InflightStateTypeDef state;
+
+	if ((type != PUBACK && type != PUBREC && type != PUBCOMP)
+			|| MQTTDeserialize_ack(&ackType, &dup, &packetId, packet, MQTT_PacketBuffSize) != 1)
+		return 0;
+
+	slot = mqtt_InflightSlot(packetId);
+	state = slot->packetId == packetId ? mqtt_InflightGetState(slot) : MQTT_INFLIGHT_FREE;
+
+	if ((type == PUBACK && state == MQTT_INFLIGHT_PUBACK) || (type == PUBCOMP && state == MQTT_INFLIGHT_PUBCOMP))
+	{
+		mqtt_InflightSetState(slot, MQTT_INFLIGHT_FREE);
+		mqtt_InflightStats.acked++;
+	}
+	else if (type == PUBREC && state == MQTT_INFLIGHT_PUBREC)
+	{
+		// Broker owns the message now, only the packet id is kept
+		mqtt_InflightSetState(slot, MQTT_INFLIGHT_PUBCOMP);
+		slot->tries = 0;
+		mqtt_InflightTransmit(slot, 0);
+	}
+	else if (type == PUBREC)
+	{
+		// Repeated PUBREC of a completed exchange, the broker still waits for PUBREL
+		mqtt_BatchAck(PUBREL, packetId);
+	}
+
+	return 1;
+}
+
+
+/**
+  * @brief  Function to read all packets received from the broker and take the acknowledgements.
+  * @retval Number of packets read
+  */
+uint8_t mqtt_InflightPoll(void)
+{
+	uint8_t *packet;
+	uint8_t count = 0;
+	int type;
+
+	if (esp_RxAvailable() == 0 || (packet = buf_Alloc(BUF_OWNER_MQTT)) == NULL)
+		return 0;
+
+	// Packets too long for the block are dropped and skipped
+	while ((type = mqtt_transport_readPacket(packet, MQTT_PacketBuffSize)) != 0)
+	{
+		if (type < 0)
+			continue;
+
+		mqtt_InflightHandle(type, packet);
+		count++;
+	}
+
+	buf_Free(packet);
+
+	return count;
+}
+
+
+/**
+  * @brief  Function to wait until all exchanges are completed. Packets not acknowledged in time
+  *         are sent again, until MQTT_INFLIGHT_TRIES transmissions.
+  * @param timeout: Max time to wait in ms
+  * @retval 1 if the window is empty, 0 if publishes are still in flight
+  */
+uint8_t mqtt_InflightDrain(uint32_t timeout)
+{
+	return mqtt_InflightWait(NULL, timeout);
+}
+
+
+/**
+  * @brief  Function to continue all exchanges after a new CONNECT: PUBLISHes not acknowledged
+  *         are sent again with DUP, QoS 2 publishes received by the broker get their PUBREL
+  *         again. The transmissions of the old connection do not count anymore.
+  * @retval None
+  */
+void mqtt_InflightResend(void)
+{
+	uint16_t packetId = inflight_LastId;
+	MQTT_InflightTypeDef *slot;
+	uint8_t i;
+
+	// Oldest first, the slot after the last id holds the publish sent a window earlier
+	for (i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+	{
+		slot = mqtt_InflightSlot(++packetId);
+
+		if (mqtt_InflightGetState(slot) == MQTT_INFLIGHT_FREE)
+			continue;
+
+		slot->tries = 0;
+		mqtt_InflightTransmit(slot, 1);
+	}
+}
+
+
+/**
+  * @brief  Function to get the number of exchanges not completed yet.
+  * @retval Number of publishes
+  */
+uint8_t mqtt_InflightPending(void)
+{
+	uint8_t i, pending = 0;
+
+	for (i = 0; i < MQTT_INFLIGHT_WINDOW; i++)
+		if (mqtt_InflightGetState(&inflight_Table[i]) != MQTT_INFLIGHT_FREE)
+			pending++;
+
+	return pending;
+}
+
+
+/**
+  * @brief  Function to print the publish statistics and the RAM of the table.
+  * @retval None
+  */
+void mqtt_InflightPrintStats(void)
+{
+	pc_printf("In flight: %u published, %u completed, %u resent, %u stalls, %u pending, %u bytes\r\n",
+			mqtt_InflightStats.published, mqtt_InflightStats.acked, mqtt_InflightStats.resent,
+			mqtt_InflightStats.stalls, mqtt_InflightPending(), (unsigned int) (sizeof(inflight_Table) + sizeof(inflight_States)));
+}
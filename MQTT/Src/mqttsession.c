@@ -0,0 +1,255 @@
+/**
+  ************************************************************************************************
+  * @file           : mqttsession.c
+  * @brief          : This file contains the MQTT session manager. It keeps the connection to the
+  *                   broker open while the system sleeps, if this costs less energy than
+  *                   connecting again on the next button press.
+  ************************************************************************************************
+*/
+
+
+// Includes
+#include <mqttsession.h>
+#include <mqttclient.h>
+#include <mqtttemplate.h>
+#include <mqttinflight.h>
+#include <mqttbatch.h>
+#include "esp8266.h"
+#include "uart_com.h"
+#include "utils.h"
+
+
+// Private variables
+static MQTT_SessionStateTypeDef sess_State = MQTT_SESSION_CLOSED;
+static uint32_t sess_LastActivity = 0;     // RTC time of the last packet to the broker
+static uint32_t sess_LastPress = 0;        // RTC time of the last button press
+static uint8_t sess_PressSeen = 0;
+
+MQTT_SessionStatsTypeDef mqtt_SessionStats = {
+	.intervalEma = 0,
+	.pingCost = MQTT_SESSION_PING_COST,
+	.connectCost = MQTT_SESSION_CONNECT_COST
+};
+
+
+
+/**
+  * @brief  Function to get the seconds passed since an RTC time stamp
+  * @param since: RTC time of rtc_GetTime
+  * @retval Seconds passed, also over more than one day
+  */
+static uint32_t mqtt_SessionElapsed(uint32_t since)
+{
+	return rtc_GetTime() - since;
+}
+
+
+/**
+  * @brief  Function to add a sample to an average, weight of new sample is 1/4
+  * @param avg: Average to be updated
+  * @param sample: New sample
+  * @retval None
+  */
+static void mqtt_SessionAverage(uint32_t *avg, uint32_t sample)
+{
+	*avg = (*avg * 3 + sample) / 4;
+}
+
+
+/**
+  * @brief  Function to decide if holding the session until the next expected button press costs
+  *         less charge than closing it and connecting again. Charge is compared in uAs, in 64 bits
+  *         as e.g. 56 mA for a day do not fit into 32 bits.
+  * @retval 1 if the session should be held open
+  */
+static uint8_t mqtt_SessionHoldPays(void)
+{
+	uint32_t interval = mqtt_SessionStats.intervalEma;
+	uint32_t period = MQTT_KeepAliveInterval - MQTT_SESSION_PING_MARGIN;
+	uint64_t hold, reconnect;
+
+	// Nothing known about the user yet, keep the session
+	if (interval == 0)
+		return 1;
+
+	hold = (uint64_t) esp8266_IdleCurrent[ESP8266_SLEEP_MODE] * interval
+			+ (uint64_t) (interval / period) * (ESP8266_ACTIVE_CURRENT / 1000) * mqtt_SessionStats.pingCost;
+
+	reconnect = (uint64_t) esp8266_IdleCurrent[ESP_SLEEP_DEEP] * interval
+			+ (uint64_t) (ESP8266_ACTIVE_CURRENT / 1000) * mqtt_SessionStats.connectCost;
+
+	pc_printf("Session hold %lu mAs, reconnect %lu mAs\r\n", (uint32_t) (hold / 1000), (uint32_t) (reconnect / 1000));
+
+	return hold < reconnect;
+}
+
+
+/**
+  * @brief  Function to make sure a session with the broker is open. Needs a TCP connection set
+  *         up by the ESP8266 module. If the module kept the TCP connection, the held session is
+  *         used without CONNECT.
+  * @retval 1 if the session is open
+  */
+uint8_t mqtt_SessionOpen(void)
+{
+	uint32_t start;
+
+	if (sess_State == MQTT_SESSION_OPEN && esp8266_GetPath() == ESP_PATH_WARM_TCP)
+	{
+		pc_printf("Session held, no connect needed\r\n");
+		return 1;
+	}
+
+	start = HAL_GetTick();
+
+	if (mqtt_ConnectServer() != 1)
+	{
+		sess_State = MQTT_SESSION_CLOSED;
+		return 0;
+	}
+
+	mqtt_SessionAverage(&mqtt_SessionStats.connectCost, esp8266_SetupTime + (HAL_GetTick() - start));
+	mqtt_SessionStats.connects++;
+
+	sess_LastActivity = rtc_GetTime();
+	sess_State = MQTT_SESSION_OPEN;
+
+	// Publishes not acknowledged on the previous connection
+	mqtt_InflightResend();
+
+	return 1;
+}
+
+
+/**
+  * @brief  Function to publish on button press with MQTT_PublishQoS. Learns the interval between
+  *         presses. The acknowledgement is not waited for, the window is drained before sleep.
+  * @param topic: Topic descriptor to publish for, has to stay valid until acknowledged
+  * @param payload: Data to be published, has to stay valid until acknowledged
+  * @param len: Length of data
+  * @retval None
+  */
+void mqtt_SessionPublish(const MQTTTopic *topic, const uint8_t *payload, uint16_t len)
+{
+	uint32_t interval;
+
+	if (sess_PressSeen)
+	{
+		interval = mqtt_SessionElapsed(sess_LastPress);
+
+		if (mqtt_SessionStats.intervalEma == 0)
+			mqtt_SessionStats.intervalEma = interval;
+		else
+			mqtt_SessionAverage(&mqtt_SessionStats.intervalEma, interval);
+	}
+
+	sess_LastPress = rtc_GetTime();
+	sess_PressSeen = 1;
+
+	if (mqtt_InflightPublish(topic, payload, len, MQTT_PublishQoS) != 1)
+		pc_printf("Publish window did not drain\r\n");
+	sess_LastActivity = sess_LastPress;
+}
+
+
+/**
+  * @brief  Function to keep the held session alive, executed on RTC wake up
+  * @retval 1 if the broker answered the ping
+  */
+uint8_t mqtt_SessionKeepAlive(void)
+{
+	uint32_t start;
+
+	if (sess_State != MQTT_SESSION_OPEN)
+		return 0;
+
+	// TCP connection was lost by the module, broker dropped the connection already
+	if (esp8266_GetPath() != ESP_PATH_WARM_TCP)
+	{
+		mqtt_SessionStats.pingFails++;
+		sess_State = MQTT_SESSION_CLOSED;
+		return 0;
+	}
+
+	start = HAL_GetTick();
+
+	if (mqtt_Ping() != 1)
+	{
+		pc_printf("No ping response\r\n");
+		mqtt_SessionStats.pingFails++;
+		sess_State = MQTT_SESSION_CLOSED;
+		return 0;
+	}
+
+	mqtt_SessionAverage(&mqtt_SessionStats.pingCost, esp8266_SetupTime + (HAL_GetTick() - start));
+	mqtt_SessionStats.pings++;
+	sess_LastActivity = rtc_GetTime();
+
+	return 1;
+}
+
+
+/**
+  * @brief  Function to mark the session as lost, e.g. if the TCP connection failed
+  * @retval None
+  */
+void mqtt_SessionClose(void)
+{
+	sess_State = MQTT_SESSION_CLOSED;
+}
+
+
+/**
+  * @brief  Function to prepare the session and the Wifi module for sleep. Waits until the
+  *         publishes in flight are acknowledged, then either holds the session and sets the RTC
+  *         alarm for the next ping, or closes the connection and sends the module to deep sleep.
+  *         Publishes still not acknowledged are sent again on the next connection.
+  * @retval None
+  */
+void mqtt_SessionSleep(void)
+{
+	uint32_t period = MQTT_KeepAliveInterval - MQTT_SESSION_PING_MARGIN;
+	uint32_t elapsed;
+
+	// Batched packets go out before the module sleeps
+	mqtt_BatchFlush();
+
+	if (sess_State == MQTT_SESSION_OPEN && mqtt_InflightDrain(MQTT_INFLIGHT_DRAIN) != 1)
+	{
+		pc_printf("Publishes not acknowledged: %u\r\n", mqtt_InflightPending());
+		sess_State = MQTT_SESSION_CLOSED;
+	}
+
+	if (sess_State == MQTT_SESSION_OPEN && mqtt_SessionHoldPays())
+	{
+		elapsed = mqtt_SessionElapsed(sess_LastActivity);
+
+		rtc_SetAlarm(elapsed < period ? period - elapsed : 1);
+		mqtt_SessionStats.holds++;
+
+		esp8266_EnterSleep(ESP8266_SLEEP_MODE);
+		return;
+	}
+
+	rtc_CancelAlarm();
+
+	// Broker keeps the session, subscriptions survive the reconnect
+	if (sess_State == MQTT_SESSION_OPEN)
+	{
+		mqtt_Disconnect();
+		sess_State = MQTT_SESSION_CLOSED;
+		mqtt_SessionStats.reconnects++;
+	}
+
+	esp8266_EnterSleep(ESP_SLEEP_DEEP);
+}
+
+
+/**
+  * @brief  Function to get the state of the session
+  * @retval Session state
+  */
+MQTT_SessionStateTypeDef mqtt_SessionGetState(void)
+{
+	return sess_State;
+}
@@ -0,0 +1,80 @@
+/**
+  ************************************************************************************************
+  * @file           : mqtttemplate.c
+  * @brief          : This file contains the MQTT packets built at compile time and the functions
+  *                   to send them
+  ************************************************************************************************
+*/
+
+
+// Includes
+#include <mqtttemplate.h>
+#include <mqttbatch.h>
+#include <MQTTPacket.h>
+#include "uart_com.h"
+
+
+// Checks of the CONNECT template
+_Static_assert(MQTT_STR_LEN(MQTT_USERNAME) > 0 && MQTT_STR_LEN(MQTT_PASSWORD) > 0,
+		"CONNECT template expects username and password");
+_Static_assert(sizeof(MQTT_ConnectTemplateTypeDef) - 2 < 128,
+		"CONNECT template needs a remaining length of one byte");
+
+
+// CONNECT packet, MQTT 3.1.1
+const MQTT_ConnectTemplateTypeDef mqtt_ConnectTemplate = {
+	.header = CONNECT << 4,
+	.remLen = sizeof(MQTT_ConnectTemplateTypeDef) - 2,
+	.protoLen = { MQTT_U16(4) },
+	.proto = "MQTT",
+	.level = 4,
+	.flags = MQTT_CONNECT_FLAG_USER | MQTT_CONNECT_FLAG_PASS | (MQTT_CleanSession ? MQTT_CONNECT_FLAG_CLEAN : 0),
+	.keepAlive = { MQTT_U16(MQTT_KeepAliveInterval) },
+	.idLen = { MQTT_U16(MQTT_STR_LEN(MQTT_CLIENTID)) },
+	.id = MQTT_CLIENTID,
+	.userLen = { MQTT_U16(MQTT_STR_LEN(MQTT_USERNAME)) },
+	.user = MQTT_USERNAME,
+	.passLen = { MQTT_U16(MQTT_STR_LEN(MQTT_PASSWORD)) },
+	.pass = MQTT_PASSWORD
+};
+
+
+
+/**
+  * @brief  Function to send a QoS 0 publish for a topic descriptor. The publish is batched
+  *         with the packets around it, topic and payload are not measured.
+  * @param topic: Topic descriptor, e.g. of MQTT_TOPIC_DEFINE
+  * @param payload: Data to be published
+  * @param len: Length of data
+  * @retval None
+  */
+void mqtt_TransmitPublishTemplate(const MQTTTopic *topic, const uint8_t *payload, uint16_t len)
+{
+	mqtt_BatchPublish(topic, payload, len, 0, 0, 0);
+}
+
+
+/**
+  * @brief  Function to send a publish with QoS and packet id for a topic descriptor on its own.
+  *         Only header byte and remaining length are built, topic and payload are not copied.
+  * @param topic: Topic descriptor
+  * @param payload: Data to be published
+  * @param len: Length of data
+  * @param qos: QoS of the publish
+  * @param dup: 1 if the publish was sent before
+  * @param packetId: Packet id, unused for QoS 0
+  * @retval Packet length, -1 if the packet could not be queued
+  */
+int mqtt_TransmitPublishId(const MQTTTopic *topic, const uint8_t *payload, uint16_t len, uint8_t qos, uint8_t dup, uint16_t packetId)
+{
+	uint8_t header[MQTT_PUBLISHV_HEADER_LEN];
+	MQTTIovec iov[MQTT_PUBLISHV_SEGMENTS];
+	int count;
+
+	count = MQTTSerialize_publishvTopic(header, sizeof(header), dup, qos, 0, packetId, topic, payload, len, iov, MQTT_PUBLISHV_SEGMENTS);
+
+	if (count <= 0)
+		return -1;
+
+	return mqtt_transport_sendPacketVector(iov, count);
+}
@@ -0,0 +1,165 @@
+#!/usr/bin/env python3
+"""
+Decoder for the deferred binary logger (Core/Src/log.c).
+
+The firmware only sends frames of
+    SYNC(0xfe) LEN ID_LO ID_HI ARGS...
+where ID is the offset of the format string in the non-loaded ELF section
+.log_str. Integer arguments are 4 bytes little endian, string arguments are
+one length byte followed by the characters. This tool reads the format
+strings from the ELF file and rebuilds the text.
+
+Usage:
+    log_decode.py mqttSensor.elf [capture.bin]     # capture file or stdin
+    log_decode.py mqttSensor.elf /dev/ttyACM0      # serial port, needs pyserial
+"""
+
+import re
+import struct
+import sys
+
+FRAME_SYNC = 0xFE
+CONVERSION = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?(hh|h|ll|l|z|j|t)?([diouxXcsp%])")
+
+
+def read_log_strings(elf_path):
+    """Returns the raw contents of the .log_str section of an ELF32 file."""
+    with open(elf_path, "rb") as f:
+        elf = f.read()
+
+    if elf[:4] != b"\x7fELF" or elf[4] != 1:
+        raise ValueError("not an ELF32 file: %s" % elf_path)
+
+    endian = "<" if elf[5] == 1 else ">"
+    shoff, = struct.unpack_from(endian + "I", elf, 0x20)
+    shentsize, shnum, shstrndx = struct.unpack_from(endian + "HHH", elf, 0x2E)
+
+    def section(index):
+        return struct.unpack_from(endian + "IIIIIIIIII", elf, shoff + index * shentsize)
+
+    names = section(shstrndx)
+    for i in range(shnum):
+        sh = section(i)
+        start = names[4] + sh[0]
+        name = elf[start:elf.index(b"\0", start)].decode()
+        if name == ".log_str":
+            return elf[sh[4]:sh[4] + sh[5]]
+
+    raise ValueError("no .log_str section in %s" % elf_path)
+
+
+def format_message(fmt, args):
+    """Applies a C printf format string to the decoded arguments."""
+    args = list(args)
+
+    def take_int():
+        return args.pop(0) if args and isinstance(args[0], int) else 0
+
+    def convert(m):
+        flags, width, precision, length, conv = m.groups()
+        if conv == "%":
+            return "%"
+        if width == "*":
+            width = str(take_int())
+        if precision == "*":
+            precision = str(take_int())
+
+        spec = "%" + flags + (width or "") + ("." + precision if precision else "")
+
+        if conv == "s":
+            value = args.pop(0) if args else ""
+            if isinstance(value, int):
+                value = "0x%08x" % value
+            return (spec + "s") % value
+
+        value = take_int()
+        if conv in "di":
+            if value & 0x80000000:
+                value -= 1 << 32
+            return (spec + "d") % value
+        if conv == "c":
+            return (spec + "c") % chr(value & 0xFF)
+        if conv == "p":
+            return "0x%08x" % value
+        return (spec + conv) % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def decode_stream(strings, data):
+    """Yields the decoded messages found in a captured byte stream."""
+    pos = 0
+    while pos + 4 <= len(data):
+        if data[pos] != FRAME_SYNC:
+            pos += 1
+            continue
+
+        length = data[pos + 1]
+        frame = data[pos + 2:pos + 2 + length]
+        if len(frame) < length or length < 2:
+            break
+
+        string_id = frame[0] | (frame[1] << 8)
+        end = strings.find(b"\0", string_id)
+        if string_id >= len(strings) or end < 0:
+            pos += 1
+            continue
+        fmt = strings[string_id:end].decode(errors="replace")
+
+        args = []
+        i = 2
+        for m in CONVERSION.finditer(fmt):
+            if m.group(5) == "%":
+                continue
+            for star in (m.group(2), m.group(3)):
+                if star == "*" and i + 4 <= length:
+                    args.append(struct.unpack_from("<I", frame, i)[0])
+                    i += 4
+            if i >= length:
+                break
+            if m.group(5) == "s":
+                n = frame[i]
+                args.append(frame[i + 1:i + 1 + n].decode(errors="replace"))
+                i += 1 + n
+            else:
+                args.append(struct.unpack_from("<I", frame, i)[0])
+                i += 4
+
+        yield format_message(fmt, args)
+        pos += 2 + length
+
+
+def main():
+    if len(sys.argv) < 2:
+        print(__doc__)
+        return 1
+
+    strings = read_log_strings(sys.argv[1])
+
+    if len(sys.argv) > 2 and sys.argv[2].startswith("/dev/"):
+        import serial
+        port = serial.Serial(sys.argv[2], 115200, timeout=0.1)
+        buf = b""
+        while True:
+            buf += port.read(256)
+            last = buf.rfind(bytes([FRAME_SYNC]))
+            if last <= 0:
+                continue
+            for msg in decode_stream(strings, buf[:last]):
+                sys.stdout.write(msg)
+            sys.stdout.flush()
+            buf = buf[last:]
+
+    if len(sys.argv) > 2:
+        with open(sys.argv[2], "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    for msg in decode_stream(strings, data):
+        sys.stdout.write(msg)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+"""
+Static RAM report of a link, read from the GNU ld map file.
+
+Lists every .data and .bss input section by size and sums them per object
+file, so the largest buffers are seen at a glance. With the linker script
+given, the reserved heap and stack (_Min_Heap_Size, _Min_Stack_Size) are
+added and the total is checked against the RAM region, the exit code is 1 if
+it does not fit. Compile with -fdata-sections to get one section per variable.
+
+Usage:
+    ram_report.py mqttSensor.map [--ld STM32F030R8TX_FLASH.ld] [--top N]
+    ram_report.py build/mqttSensor_host.map --only Core/ --only MQTT/ --ld ../STM32F030R8TX_FLASH.ld
+
+The host build (make -C Host ram) stores pointers in 8 instead of 4 bytes,
+structures holding pointers come out larger than on the target.
+"""
+
+import argparse
+import re
+import sys
+from collections import defaultdict
+
+RAM_SECTIONS = (".data", ".bss", "COMMON")
+FLASH_SECTIONS = (".data.rel.ro",)    # const tables with pointers on a host, flash on the target
+
+# " .bss.name  0xaddr  0xsize  file.o", name and the rest may be split over two lines
+SECTION_RE = re.compile(r"^ (\S+)\s+0x([0-9a-fA-F]+)\s+0x([0-9a-fA-F]+)\s+(\S.*)$")
+NAME_RE = re.compile(r"^ (\S+)$")
+
+
+def parse_map(path):
+    """Returns a list of (section, size, object) of the RAM input sections of a map file."""
+    sections = []
+    pending = None
+    in_map = False
+
+    with open(path) as f:
+        for line in f:
+            line = line.rstrip("\n")
+
+            # Discarded input sections are listed before the memory map
+            if line.startswith("Linker script and memory map"):
+                in_map = True
+                continue
+            if not in_map:
+                continue
+
+            if pending is not None and line.startswith("   "):
+                line = " " + pending + " " + line.strip()
+            pending = None
+
+            name = NAME_RE.match(line)
+            if name:
+                pending = name.group(1)
+                continue
+
+            m = SECTION_RE.match(line)
+            if not m:
+                continue
+
+            section, size, obj = m.group(1), int(m.group(3), 16), m.group(4).strip()
+            if size == 0 or not section.startswith(RAM_SECTIONS) or section.startswith(FLASH_SECTIONS):
+                continue
+            sections.append((section, size, obj))
+
+    return sections
+
+
+def number(text):
+    """Returns the value of a linker script number, e.g. 0x200, 8K or 512."""
+    if text.lower().startswith("0x"):
+        return int(text, 16)
+    if text[-1] in "Kk":
+        return int(text[:-1]) * 1024
+    return int(text)
+
+
+def parse_ld(path):
+    """Returns RAM length, heap and stack reserve of a linker script."""
+    with open(path) as f:
+        text = f.read()
+
+    values = []
+    for pattern in (r"RAM\s*\(xrw\)\s*:\s*ORIGIN\s*=\s*\w+,\s*LENGTH\s*=\s*(\w+)",
+                    r"_Min_Heap_Size\s*=\s*(\w+)", r"_Min_Stack_Size\s*=\s*(\w+)"):
+        m = re.search(pattern, text)
+        values.append(number(m.group(1)) if m else 0)
+    return values
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("map", help="map file of the link, e.g. -Wl,-Map=mqttSensor.map")
+    parser.add_argument("--ld", help="linker script with the RAM region and heap/stack reserve")
+    parser.add_argument("--only", action="append", default=[], help="count objects containing this path only")
+    parser.add_argument("--top", type=int, default=20, help="number of sections listed")
+    args = parser.parse_args()
+
+    sections = parse_map(args.map)
+    if args.only:
+        sections = [s for s in sections if any(o in s[2] for o in args.only)]
+
+    per_object = defaultdict(int)
+    for _, size, obj in sections:
+        per_object[obj] += size
+    total = sum(per_object.values())
+
+    print("%-40s %6s  %s" % ("section", "bytes", "object"))
+    for section, size, obj in sorted(sections, key=lambda s: -s[1])[:args.top]:
+        print("%-40s %6d  %s" % (section, size, obj))
+
+    print()
+    print("%-40s %6s" % ("object", "bytes"))
+    for obj, size in sorted(per_object.items(), key=lambda o: -o[1]):
+        print("%-40s %6d" % (obj, size))
+
+    print()
+    print("%-40s %6d" % ("static RAM", total))
+    if not args.ld:
+        return 0
+
+    ram, heap, stack = parse_ld(args.ld)
+    used = total + heap + stack
+    print("%-40s %6d" % ("heap reserve", heap))
+    print("%-40s %6d" % ("stack reserve", stack))
+    print("%-40s %6d of %d, %d free" % ("worst case", used, ram, ram - used))
+
+    if used > ram:
+        print("RAM overflow by %d bytes" % (used - ram), file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,87 @@
+#!/usr/bin/env python3
+"""
+Decoder for the latency report of the wake-to-publish trace (Core/Src/trace.c).
+
+The firmware publishes TRACE_ReportTypeDef on <MQTT_SUBSCRIBE_FOR>/trace:
+    version(1) stages(1) wakes(2)
+    per stage: min(4) max(4) sum(4) count(2) hist(16)
+all little endian, times in us. Histogram bucket 0 counts durations below
+128 us, bucket n durations of 2^(n+6) us and more, the last bucket >= 2 s.
+
+Usage:
+    trace_decode.py report.bin [...]       # payloads, e.g. of mosquitto_sub -C 1
+    mosquitto_sub -t NucleoButton/trace -C 1 | trace_decode.py
+"""
+
+import struct
+import sys
+
+REPORT_VERSION = 2
+HIST_BUCKETS = 16
+HIST_SHIFT = 6
+STAGE_FORMAT = "<IIIH%dB" % HIST_BUCKETS
+
+# Order of TRACE_StageTypeDef and esp8266_Steps
+STAGES = ["clock", "peripherals", "ESP set up", "MQTT connect", "publish", "LED", "total"]
+AT_STEPS = [
+    "wake module", "leave transparent mode", "probe module", "close echo after wake",
+    "disable sleep", "probe connection", "probe AP", "reset", "close transparent mode",
+    "raise baud rate", "verify baud rate", "close echo", "set Wifi mode", "enable auto connect",
+    "connect to AP", "get AP info", "get IP info", "set DHCP mode", "set single connection",
+    "set transparent mode", "connect TCP server", "enable data send",
+]
+
+
+def stage_name(index):
+    if index < len(STAGES):
+        return STAGES[index]
+    step = index - len(STAGES)
+    return "AT " + (AT_STEPS[step] if step < len(AT_STEPS) else str(step))
+
+
+def bucket_label(i):
+    if i == 0:
+        return "<%d" % (1 << (HIST_SHIFT + 1))
+    return ">=%d" % (1 << (i + HIST_SHIFT))
+
+
+def decode(data):
+    """Returns wakes and a list of (name, count, min, avg, max, hist) of a report."""
+    version, stages, wakes = struct.unpack_from("<BBH", data, 0)
+    if version != REPORT_VERSION:
+        raise ValueError("unknown report version %d" % version)
+
+    size = struct.calcsize(STAGE_FORMAT)
+    rows = []
+    for i in range(stages):
+        fields = struct.unpack_from(STAGE_FORMAT, data, 4 + i * size)
+        lo, hi, total, count = fields[:4]
+        if count:
+            rows.append((stage_name(i), count, lo, total // count, hi, fields[4:]))
+    return wakes, rows
+
+
+def print_report(wakes, rows):
+    print("%d wake ups" % wakes)
+    print("%-28s %5s %10s %10s %10s  histogram (us)" % ("stage", "n", "min us", "avg us", "max us"))
+    for name, count, lo, avg, hi, hist in rows:
+        buckets = " ".join("%s:%d" % (bucket_label(i), n) for i, n in enumerate(hist) if n)
+        print("%-28s %5d %10d %10d %10d  %s" % (name, count, lo, avg, hi, buckets))
+
+
+def main():
+    if len(sys.argv) > 1 and sys.argv[1] in ("-h", "--help"):
+        print(__doc__)
+        return 1
+
+    if len(sys.argv) > 1:
+        for path in sys.argv[1:]:
+            with open(path, "rb") as f:
+                print_report(*decode(f.read()))
+    else:
+        print_report(*decode(sys.stdin.buffer.read()))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())